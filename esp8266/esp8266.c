@@ -1,254 +1,375 @@
 #include <stdio.h>
+#include <string.h>
 #include "ringbuffer.h"
 #include "esp8266.h"
 
 #define ESP8266_CONNECT_TIMEOUT 15000
 #define ESP8266_SEND_TIMEOUT    500
+#define ESP8266_SEND_OK_TIMEOUT 5000    /* for SEND OK once the payload is written */
 #define ESP8266_RECV_TIMEOUT    500
 #define ESP8266_MISC_TIMEOUT    500
 
-#define ESP8266_SOCKET_COUNT    5
+#define ESP8266_LINK_TCP        0
+#define ESP8266_LINK_UDP        1
 
-static int connect_error;
-static bool fail;
+/* header stored in front of every datagram queued on a UDP link */
+#define ESP8266_DGRAM_HEADER    8
 
-static ringbuffer ringbuf;
-static atcmd at;
+static void packet_handler(void *arg);
+static void connect_error_handler(void *arg);
+static void send_ok_handler(void *arg);
+static void send_fail_handler(void *arg);
+static void wifi_got_ip_handler(void *arg);
+static void wifi_disconnect_handler(void *arg);
+static void socket_connect_handler(void *arg, int id);
+static void socket_closed_handler(void *arg, int id);
 
-static int socket_open[ESP8266_SOCKET_COUNT];
-static unsigned long id_flags = 0;
+static int poll_links(esp8266_t *esp, socket_pollfd *fds, unsigned int nfds, int timeout);
 
-static void packet_handler(void);
-static void connect_error_handler(void);
-static void socket0_closed_handler(void);
-static void socket1_closed_handler(void);
-static void socket2_closed_handler(void);
-static void socket3_closed_handler(void);
-static void socket4_closed_handler(void);
-
-static int get_fd(void)
+static int get_fd(esp8266_t *esp)
 {
     for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
-        if (!(id_flags & (1 << i))) {
-            id_flags |= (1 << i);
+        if (!(esp->id_flags & (1UL << i))) {
+            esp->id_flags |= (1UL << i);
             return i;
         }
     }
     return -1;
 }
 
-static void put_fd(int fd)
+static void put_fd(esp8266_t *esp, int fd)
 {
     if (fd >= 0 && fd < ESP8266_SOCKET_COUNT) {
-        id_flags &= ~(1 << fd);
+        esp->id_flags &= ~(1UL << fd);
     }
 }
 
-void esp8266_init(atcmd_ops *ops)
+void esp8266_init(esp8266_t *esp, atcmd_ops *ops, void *priv)
 {
-    static bool inited = false;
-    static char ringbuf_buf[2048]; 
-    static char at_buf[256];
+    memset(esp, 0, sizeof(*esp));
+    esp->ssl_sni_supported = true;
+
+    atcmd_init(&esp->at, ops, priv, esp->at_buf, sizeof(esp->at_buf));
+
+    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
+        ringbuffer_init(&esp->sockets[i].rxbuf, esp->sockets[i].buf, sizeof(esp->sockets[i].buf));
+        esp->sockets[i].handshake_ms = -1;
+    }
 
-    if (!inited) {
+    atcmd_add_handler(&esp->at, "+IPD", packet_handler, esp);
+    atcmd_add_handler(&esp->at, "+CWJAP:", connect_error_handler, esp);
+    atcmd_add_handler(&esp->at, "SEND OK", send_ok_handler, esp);
+    atcmd_add_handler(&esp->at, "SEND FAIL", send_fail_handler, esp);
+    atcmd_add_handler(&esp->at, "WIFI GOT IP", wifi_got_ip_handler, esp);
+    atcmd_add_handler(&esp->at, "WIFI DISCONNECT", wifi_disconnect_handler, esp);
+    atcmd_add_id_handler(&esp->at, "%d,CONNECT", socket_connect_handler, esp);
+    atcmd_add_id_handler(&esp->at, "%d,CLOSED", socket_closed_handler, esp);
+}
 
-        atcmd_init(&at, ops, at_buf, sizeof(at_buf));
+void esp8266_set_clock(esp8266_t *esp, unsigned long (*clock_ms)(void))
+{
+    esp->clock_ms = clock_ms;
+}
+
+void esp8266_set_lock(esp8266_t *esp, void (*lock)(void *arg), void (*unlock)(void *arg), void *arg)
+{
+    esp->lock = lock;
+    esp->unlock = unlock;
+    esp->lock_arg = arg;
+}
+
+static void lock(esp8266_t *esp)
+{
+    if (esp->lock) {
+        esp->lock(esp->lock_arg);
+    }
+}
+
+static void unlock(esp8266_t *esp)
+{
+    if (esp->unlock) {
+        esp->unlock(esp->lock_arg);
+    }
+}
+
+static void discard(esp8266_t *esp, int amount)
+{
+    char ch;
+    for (int i = 0; i < amount; i++) {
+        if (atcmd_read(&esp->at, &ch, 1) != 1) {
+            break;
+        }
+    }
+}
 
-        ringbuffer_init(&ringbuf, ringbuf_buf, sizeof(ringbuf_buf));
+static void put_dgram_header(ringbuffer *rb, int amount, const char *ip, int port)
+{
+    unsigned char addr[4] = {0};
 
-        atcmd_add_handler(&at, "+IPD", packet_handler);
-        atcmd_add_handler(&at, "+CWJAP:", connect_error_handler);
-        atcmd_add_handler(&at, "0,CLOSED", socket0_closed_handler);
-        atcmd_add_handler(&at, "1,CLOSED", socket1_closed_handler);
-        atcmd_add_handler(&at, "2,CLOSED", socket2_closed_handler);
-        atcmd_add_handler(&at, "3,CLOSED", socket3_closed_handler);
-        atcmd_add_handler(&at, "4,CLOSED", socket4_closed_handler);
+    sscanf(ip, "%hhu.%hhu.%hhu.%hhu", &addr[0], &addr[1], &addr[2], &addr[3]);
 
-        inited = true;
+    ringbuffer_put(rb, (amount >> 8) & 0xff);
+    ringbuffer_put(rb, amount & 0xff);
+    ringbuffer_put(rb, (port >> 8) & 0xff);
+    ringbuffer_put(rb, port & 0xff);
+    for (int i = 0; i < 4; i++) {
+        ringbuffer_put(rb, addr[i]);
     }
 }
 
-static void packet_handler(void)
+static void packet_handler(void *arg)
 {
+    esp8266_t *esp = arg;
     int fd;
     int amount;
+    char sep;
+    char ip[16] = "0.0.0.0";
+    int port = 0;
+
+    // "+IPD,<id>,<len>:" or, with AT+CIPDINFO=1, "+IPD,<id>,<len>,<ip>,<port>:"
+    if (!atcmd_recv(&esp->at, ",%d,%d%c", &fd, &amount, &sep)) {
+        return;
+    }
+    if (sep == ',' && !atcmd_recv(&esp->at, "%15[^,],%d:", ip, &port)) {
+        return;
+    }
 
-    if (!atcmd_recv(&at, ",%d,%d:", &fd, &amount)) {
+    if (fd < 0 || fd >= ESP8266_SOCKET_COUNT) {
+        discard(esp, amount);
+        return;
+    }
+
+    struct esp8266_socket *s = &esp->sockets[fd];
+    unsigned int start = s->rxbuf.write_pos;
+
+    if (s->type == ESP8266_LINK_UDP) {
+        // keep datagram boundaries, drop what does not fit as a whole
+        if (ringbuffer_space_left(&s->rxbuf) < (unsigned)amount + ESP8266_DGRAM_HEADER) {
+            discard(esp, amount);
+            return;
+        }
+        put_dgram_header(&s->rxbuf, amount, ip, port);
+    } else if (s->overrun || ringbuffer_space_left(&s->rxbuf) < (unsigned)amount) {
+        // overwriting would corrupt the stream, fail the link instead
+        discard(esp, amount);
+        s->overrun = 1;
+        s->open = 0;
         return;
     }
 
     for (int i = 0; i < amount; i++) {
         char ch;
-        if (atcmd_read(&at, &ch, 1) != 1) {
+        if (atcmd_read(&esp->at, &ch, 1) != 1) {
+            if (s->type == ESP8266_LINK_UDP) {
+                // the header announces the whole datagram, take it back with the part read
+                s->rxbuf.write_pos = start;
+            }
             break;
         }
-        ringbuffer_put(&ringbuf, ch);
+        ringbuffer_put(&s->rxbuf, ch);
     }
 }
 
-static void socket0_closed_handler(void)
+/* take a client out of the accept queue, keeping the order of the others */
+static void unqueue(esp8266_t *esp, int id)
 {
-    socket_open[0] = 0;
-    put_fd(0);
-}
+    struct esp8266_server *srv = &esp->server;
+    int kept = 0;
 
-static void socket1_closed_handler(void)
-{
-    socket_open[1] = 0;
-    put_fd(1);
+    for (int i = 0; i < srv->count; i++) {
+        int queued = srv->queue[(srv->head + i) % ESP8266_SOCKET_COUNT];
+        if (queued != id) {
+            srv->queue[(srv->head + kept++) % ESP8266_SOCKET_COUNT] = queued;
+        }
+    }
+    srv->count = kept;
+    srv->queued &= ~(1UL << id);
 }
 
-static void socket2_closed_handler(void)
+static void socket_connect_handler(void *arg, int id)
 {
-    socket_open[2] = 0;
-    put_fd(2);
-}
+    esp8266_t *esp = arg;
+    struct esp8266_server *srv = &esp->server;
 
-static void socket3_closed_handler(void)
-{
-    socket_open[3] = 0;
-    put_fd(3);
+    if (id < 0 || id >= ESP8266_SOCKET_COUNT) {
+        return;
+    }
+
+    // a link we are not opening was opened by a client of our server. a queued
+    // ID whose client left unaccepted is taken over by the new client.
+    if (!esp->sockets[id].opening) {
+        // the ID is still held by an accepted client that left, it cannot be taken
+        if (!srv->listening ||
+            ((esp->id_flags & (1UL << id)) && !(srv->queued & (1UL << id)))) {
+            return;
+        }
+        if (!(srv->queued & (1UL << id))) {
+            if (srv->count >= ESP8266_SOCKET_COUNT) {
+                return;
+            }
+            srv->queue[(srv->head + srv->count++) % ESP8266_SOCKET_COUNT] = id;
+            srv->queued |= (1UL << id);
+        }
+        ringbuffer_reset(&esp->sockets[id].rxbuf);
+        esp->sockets[id].overrun = 0;
+        esp->sockets[id].type = ESP8266_LINK_TCP;
+        esp->sockets[id].timeout = ESP8266_RECV_TIMEOUT;
+        esp->sockets[id].handshake_ms = -1;
+    }
+
+    esp->sockets[id].open = 1;
+    esp->id_flags |= (1UL << id);
 }
 
-static void socket4_closed_handler(void)
+static void socket_closed_handler(void *arg, int id)
 {
-    socket_open[4] = 0;
-    put_fd(4);
+    esp8266_t *esp = arg;
+
+    if (id < 0 || id >= ESP8266_SOCKET_COUNT) {
+        return;
+    }
+    esp->sockets[id].open = 0;
+
+    // a client that left data is still handed out by accept, which releases it on close
+    if (esp->server.queued & (1UL << id)) {
+        if (ringbuffer_length(&esp->sockets[id].rxbuf)) {
+            return;
+        }
+        unqueue(esp, id);
+    }
+    put_fd(esp, id);
 }
 
-bool esp8266_reset(void)
+bool esp8266_reset(esp8266_t *esp)
 {
     bool done;
 
-    atcmd_set_timeout(&at, ESP8266_CONNECT_TIMEOUT);
+    lock(esp);
+    atcmd_set_timeout(&esp->at, ESP8266_CONNECT_TIMEOUT);
 
     for (int i = 0; i < 2; i++) {
-        done = atcmd_send(&at, "AT+RST") &&
-            atcmd_recv(&at, "OK\n") &&
-            atcmd_recv(&at, "ready");
+        done = atcmd_send(&esp->at, "AT+RST") &&
+            atcmd_recv(&esp->at, "OK\n") &&
+            atcmd_recv(&esp->at, "ready");
         if (done){
             break;
         }
     }
 
-    atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
+    if (done) {
+        // the module forgot the settings made by esp8266_startup()
+        esp->started = false;
+    }
+
+    atcmd_set_timeout(&esp->at, ESP8266_MISC_TIMEOUT);
+    unlock(esp);
     return done;
 }
 
-int esp8266_get_firmware_version(void)
+int esp8266_get_firmware_version(esp8266_t *esp)
 {
     int version;
 
-    if (atcmd_send(&at, "AT+GMR") &&
-        atcmd_recv(&at, "SDK version:%d", &version) &&
-        atcmd_recv(&at, "OK\n"))
-    {
-        return version;
-    }
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+GMR") &&
+        atcmd_recv(&esp->at, "SDK version:%d", &version) &&
+        atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
 
-    return -1;
+    return done ? version : -1;
 }
 
-int esp8266_get_default_wifi_mode(void)
+int esp8266_get_default_wifi_mode(esp8266_t *esp)
 {
     int8_t mode;
 
-    if (atcmd_send(&at, "AT+CWMODE_DEF?") &&
-        atcmd_recv(&at, "+CWMODE_DEF:%hhd", &mode) &&
-        atcmd_recv(&at, "OK\n"))
-    {
-        return mode;
-    }
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+CWMODE_DEF?") &&
+        atcmd_recv(&esp->at, "+CWMODE_DEF:%hhd", &mode) &&
+        atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
 
-    return 0;
+    return done ? mode : 0;
 }
 
-bool esp8266_set_default_wifi_mode(const int8_t mode)
+bool esp8266_set_default_wifi_mode(esp8266_t *esp, const int8_t mode)
 {
-    return atcmd_send(&at, "AT+CWMODE_DEF=%hhd", mode) && atcmd_recv(&at, "OK\n");
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+CWMODE_DEF=%hhd", mode) && atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
+    return done;
 }
 
-const char *esp8266_get_ipaddress(void)
+const char *esp8266_get_ipaddress(esp8266_t *esp)
 {
-    static char ip_buffer[16];
     char *ip = NULL;
 
-    atcmd_set_timeout(&at, ESP8266_CONNECT_TIMEOUT);
+    lock(esp);
+    atcmd_set_timeout(&esp->at, ESP8266_CONNECT_TIMEOUT);
 
-    if (atcmd_send(&at, "AT+CIFSR") &&
-        atcmd_recv(&at, "+CIFSR:STAIP,\"%15[^\"]\"", ip_buffer) &&
-        atcmd_recv(&at, "OK\n"))
+    if (atcmd_send(&esp->at, "AT+CIFSR") &&
+        atcmd_recv(&esp->at, "+CIFSR:STAIP,\"%15[^\"]\"", esp->ip_buffer) &&
+        atcmd_recv(&esp->at, "OK\n"))
     {
-        ip = ip_buffer;
+        ip = esp->ip_buffer;
+        esp->wifi_connected = strcmp(ip, "0.0.0.0") != 0;
     }
 
-    atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
+    atcmd_set_timeout(&esp->at, ESP8266_MISC_TIMEOUT);
+    unlock(esp);
     return ip;
 }
 
-const char *esp8266_get_macaddress(void)
+const char *esp8266_get_macaddress(esp8266_t *esp)
 {
-    static char _mac_buffer[18];
-    if (!(atcmd_send(&at, "AT+CIFSR") &&
-          atcmd_recv(&at, "+CIFSR:STAMAC,\"%17[^\"]\"", _mac_buffer) &&
-          atcmd_recv(&at, "OK\n")))
-    {
-        return 0;
-    }
-    return _mac_buffer;
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+CIFSR") &&
+        atcmd_recv(&esp->at, "+CIFSR:STAMAC,\"%17[^\"]\"", esp->mac_buffer) &&
+        atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
+    return done ? esp->mac_buffer : 0;
 }
 
-const char *esp8266_get_gateway(void)
+const char *esp8266_get_gateway(esp8266_t *esp)
 {
-    static char _gateway_buffer[16];
-    if (!(atcmd_send(&at, "AT+CIPSTA_CUR?") &&
-          atcmd_recv(&at, "+CIPSTA_CUR:gateway:\"%15[^\"]\"", _gateway_buffer) &&
-          atcmd_recv(&at, "OK\n")))
-    {
-        return 0;
-    }
-    return _gateway_buffer;
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+CIPSTA_CUR?") &&
+        atcmd_recv(&esp->at, "+CIPSTA_CUR:gateway:\"%15[^\"]\"", esp->gateway_buffer) &&
+        atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
+    return done ? esp->gateway_buffer : 0;
 }
 
-const char *esp8266_get_netmask(void)
+const char *esp8266_get_netmask(esp8266_t *esp)
 {
-    static char _netmask_buffer[16];
-    if (!(atcmd_send(&at, "AT+CIPSTA_CUR?") &&
-          atcmd_recv(&at, "+CIPSTA_CUR:netmask:\"%15[^\"]\"", _netmask_buffer) &&
-          atcmd_recv(&at, "OK\n")))
-    {
-        return 0;
-    }
-    return _netmask_buffer;
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+CIPSTA_CUR?") &&
+        atcmd_recv(&esp->at, "+CIPSTA_CUR:netmask:\"%15[^\"]\"", esp->netmask_buffer) &&
+        atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
+    return done ? esp->netmask_buffer : 0;
 }
 
-int esp8266_get_rssi(void)
+int esp8266_get_rssi(esp8266_t *esp)
 {
     int8_t rssi;
     char bssid[18];
 
-    atcmd_set_timeout(&at, ESP8266_CONNECT_TIMEOUT);
-    if (!(atcmd_send(&at, "AT+CWJAP_CUR?") &&
-          atcmd_recv(&at, "+CWJAP_CUR:\"%*[^\"]\",\"%17[^\"]\"", bssid) &&
-          atcmd_recv(&at, "OK\n")))
-    {
-        return 0;
-    }
-    atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
-
-    atcmd_set_timeout(&at, ESP8266_CONNECT_TIMEOUT);
-    if (!(atcmd_send(&at, "AT+CWLAP=\"\",\"%s\",", bssid) &&
-          atcmd_recv(&at, "+CWLAP:(%*d,\"%*[^\"]\",%hhd,", &rssi) &&
-          atcmd_recv(&at, "OK\n")))
-    {
-        return 0;
-    }
-    atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
-
-    return rssi;
+    lock(esp);
+    atcmd_set_timeout(&esp->at, ESP8266_CONNECT_TIMEOUT);
+    bool done = atcmd_send(&esp->at, "AT+CWJAP_CUR?") &&
+        atcmd_recv(&esp->at, "+CWJAP_CUR:\"%*[^\"]\",\"%17[^\"]\"", bssid) &&
+        atcmd_recv(&esp->at, "OK\n") &&
+        atcmd_send(&esp->at, "AT+CWLAP=\"\",\"%s\",", bssid) &&
+        atcmd_recv(&esp->at, "+CWLAP:(%*d,\"%*[^\"]\",%hhd,", &rssi) &&
+        atcmd_recv(&esp->at, "OK\n");
+    atcmd_set_timeout(&esp->at, ESP8266_MISC_TIMEOUT);
+    unlock(esp);
+
+    return done ? rssi : 0;
 }
 
-int esp8266_startup(int mode)
+int esp8266_startup(esp8266_t *esp, int mode)
 {
     if (mode != ESP8266_WIFIMODE_STATION &&
         mode != ESP8266_WIFIMODE_SOFTAP &&
@@ -257,167 +378,788 @@ int esp8266_startup(int mode)
         return false;
     }
 
-    atcmd_set_timeout(&at, ESP8266_CONNECT_TIMEOUT);
+    lock(esp);
+    atcmd_set_timeout(&esp->at, ESP8266_CONNECT_TIMEOUT);
 
-    bool done = atcmd_send(&at, "AT+CWMODE_CUR=%d", mode) &&
-        atcmd_recv(&at, "OK\n") &&
-        atcmd_send(&at, "AT+CIPMUX=1") &&
-        atcmd_recv(&at, "OK\n");
+    bool done = atcmd_send(&esp->at, "AT+CWMODE_CUR=%d", mode) &&
+        atcmd_recv(&esp->at, "OK\n") &&
+        atcmd_send(&esp->at, "AT+CIPMUX=1") &&
+        atcmd_recv(&esp->at, "OK\n") &&
+        atcmd_send(&esp->at, "AT+CIPDINFO=1") &&
+        atcmd_recv(&esp->at, "OK\n");
+    if (done) {
+        esp->started = true;
+    }
 
-    atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
+    atcmd_set_timeout(&esp->at, ESP8266_MISC_TIMEOUT);
+    unlock(esp);
     return done;
 }
 
-bool esp8266_dhcp(bool enabled, int mode)
+bool esp8266_dhcp(esp8266_t *esp, bool enabled, int mode)
 {
     if (mode < 0 || mode > 2)
     {
         return false;
     }
 
-    return atcmd_send(&at, "AT+CWDHCP_CUR=%d,%d", mode, enabled ? 1 : 0)
-        && atcmd_recv(&at, "OK\n");
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+CWDHCP_CUR=%d,%d", mode, enabled ? 1 : 0)
+        && atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
+    return done;
 }
 
-static void connect_error_handler(void)
+static void connect_error_handler(void *arg)
 {
-    fail = false;
-    connect_error = 0;
-
-    if (atcmd_recv(&at, "%d", &connect_error) &&
-        atcmd_recv(&at, "FAIL")) {
-        fail = true;
-        atcmd_abort(&at);
+    esp8266_t *esp = arg;
+    esp->fail = false;
+    esp->connect_error = 0;
+
+    if (atcmd_recv(&esp->at, "%d", &esp->connect_error) &&
+        atcmd_recv(&esp->at, "FAIL")) {
+        esp->fail = true;
+        atcmd_abort(&esp->at);
     }
 }
 
-int esp8266_connect(const char *ap, const char *password)
+static void wifi_got_ip_handler(void *arg)
+{
+    esp8266_t *esp = arg;
+    esp->wifi_connected = true;
+}
+
+static void wifi_disconnect_handler(void *arg)
+{
+    esp8266_t *esp = arg;
+    esp->wifi_connected = false;
+}
+
+bool esp8266_wifi_connected(esp8266_t *esp)
+{
+    return esp->wifi_connected;
+}
+
+int esp8266_connect(esp8266_t *esp, const char *ap, const char *password)
 {
     nsapi_error_t ret = NSAPI_ERROR_OK;
 
-    atcmd_set_timeout(&at, ESP8266_CONNECT_TIMEOUT);
+    lock(esp);
+    atcmd_set_timeout(&esp->at, ESP8266_CONNECT_TIMEOUT);
 
-    atcmd_send(&at, "AT+CWJAP_CUR=\"%s\",\"%s\"", ap, password);
+    atcmd_send(&esp->at, "AT+CWJAP_CUR=\"%s\",\"%s\"", ap, password);
 
-    if (!atcmd_recv(&at, "OK\n")) {
-        if (fail) {
-            if (connect_error == 1)
+    if (!atcmd_recv(&esp->at, "OK\n")) {
+        if (esp->fail) {
+            if (esp->connect_error == 1)
                 ret = NSAPI_ERROR_CONNECTION_TIMEOUT;
-            else if (connect_error == 2)
+            else if (esp->connect_error == 2)
                 ret = NSAPI_ERROR_AUTH_FAILURE;
-            else if (connect_error == 3)
+            else if (esp->connect_error == 3)
                 ret = NSAPI_ERROR_NO_SSID;
             else
                 ret = NSAPI_ERROR_NO_CONNECTION;
 
-            fail = false;
-            connect_error = 0;
+            esp->fail = false;
+            esp->connect_error = 0;
         }
     }
 
-    atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
+    atcmd_set_timeout(&esp->at, ESP8266_MISC_TIMEOUT);
+    unlock(esp);
     return ret;
 }
 
-int esp8266_open_tcp(const char *addr, int port, int keepalive)
+// dotted quad of decimal octets, RFC 6066 does not allow these as server name
+static bool is_ipv4(const char *addr)
+{
+    for (int part = 0; part < 4; part++) {
+        int value = 0;
+        int digits = 0;
+        while (*addr >= '0' && *addr <= '9') {
+            value = value * 10 + (*addr++ - '0');
+            if (++digits > 3 || value > 255) {
+                return false;
+            }
+        }
+        if (!digits || *addr != (part < 3 ? '.' : '\0')) {
+            return false;
+        }
+        addr++;
+    }
+    return true;
+}
+
+static int open_stream(esp8266_t *esp, const char *type, const char *addr, int port, int keepalive,
+                       const char *sni, int timeout)
 {
-    int fd = get_fd();
-    if (fd < 0 || socket_open[fd]) {
+    int fd = get_fd(esp);
+    if (fd < 0) {
+        return -1;
+    }
+    if (esp->sockets[fd].open) {
+        put_fd(esp, fd);
         return -1;
     }
+    ringbuffer_reset(&esp->sockets[fd].rxbuf);
+    esp->sockets[fd].overrun = 0;
+    esp->sockets[fd].type = ESP8266_LINK_TCP;
+    esp->sockets[fd].timeout = ESP8266_RECV_TIMEOUT;
+
+    // SNI is optional, firmware without AT+CIPSSLCSNI is not asked again
+    if (sni && !is_ipv4(sni) && esp->ssl_sni_supported) {
+        esp->ssl_sni_supported = atcmd_send(&esp->at, "AT+CIPSSLCSNI=%d,\"%s\"", fd, sni) &&
+            atcmd_recv(&esp->at, "OK\n");
+    }
+
+    atcmd_set_timeout(&esp->at, timeout);
 
+    esp->sockets[fd].opening = 1;
+    unsigned long start = esp->clock_ms ? esp->clock_ms() : 0;
     bool done = false;
-    static const char *type = "TCP";
     if (keepalive) {
-        done = atcmd_send(&at, "AT+CIPSTART=%d,\"%s\",\"%s\",%d,%d",
+        done = atcmd_send(&esp->at, "AT+CIPSTART=%d,\"%s\",\"%s\",%d,%d",
                           fd, type, addr, port, keepalive) &&
-            atcmd_recv(&at, "OK\n");
+            atcmd_recv(&esp->at, "OK\n");
     } else {
-        done = atcmd_send(&at, "AT+CIPSTART=%d,\"%s\",\"%s\",%d",
+        done = atcmd_send(&esp->at, "AT+CIPSTART=%d,\"%s\",\"%s\",%d",
                           fd, type, addr, port) &&
-            atcmd_recv(&at, "OK\n");
+            atcmd_recv(&esp->at, "OK\n");
     }
 
+    atcmd_set_timeout(&esp->at, ESP8266_MISC_TIMEOUT);
+    esp->sockets[fd].opening = 0;
+    esp->sockets[fd].handshake_ms = esp->clock_ms ? (int)(esp->clock_ms() - start) : -1;
+
     if (done) {
-        socket_open[fd] = 1;
+        esp->sockets[fd].open = 1;
     } else {
-        put_fd(fd);
+        esp->sockets[fd].open = 0;
+        put_fd(esp, fd);
         fd = -1;
     }
     return fd;
 }
 
-static int _send_tcp(int fd, const void *data, unsigned int amount)
+int esp8266_open_tcp(esp8266_t *esp, const char *addr, int port, int keepalive)
 {
-    int rc = NSAPI_ERROR_DEVICE_ERROR;
+    lock(esp);
+    int fd = open_stream(esp, "TCP", addr, port, keepalive, NULL, ESP8266_MISC_TIMEOUT);
+    unlock(esp);
+    return fd;
+}
+
+bool esp8266_set_ssl_buffer_size(esp8266_t *esp, int size)
+{
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+CIPSSLSIZE=%d", size) && atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
+    return done;
+}
+
+bool esp8266_set_ssl_auth_mode(esp8266_t *esp, int mode)
+{
+    lock(esp);
+    bool done = atcmd_send(&esp->at, "AT+CIPSSLCCONF=%d", mode) && atcmd_recv(&esp->at, "OK\n");
+    unlock(esp);
+    return done;
+}
+
+int esp8266_open_ssl(esp8266_t *esp, const char *addr, int port, int keepalive, const char *sni)
+{
+    // the handshake keeps the module silent for seconds
+    lock(esp);
+    int fd = open_stream(esp, "SSL", addr, port, keepalive, sni, ESP8266_CONNECT_TIMEOUT);
+    unlock(esp);
+    return fd;
+}
+
+int esp8266_get_handshake_ms(esp8266_t *esp, int fd)
+{
+    if (fd < 0 || fd >= ESP8266_SOCKET_COUNT) {
+        return -1;
+    }
+    return esp->sockets[fd].handshake_ms;
+}
 
-    atcmd_set_timeout(&at, ESP8266_SEND_TIMEOUT);
+static int open_dgram(esp8266_t *esp, const char *addr, int port, int local_port, int mode)
+{
+    int fd = get_fd(esp);
+    if (fd < 0) {
+        return -1;
+    }
+    if (esp->sockets[fd].open) {
+        put_fd(esp, fd);
+        return -1;
+    }
+    ringbuffer_reset(&esp->sockets[fd].rxbuf);
+    esp->sockets[fd].overrun = 0;
+    esp->sockets[fd].type = ESP8266_LINK_UDP;
+    esp->sockets[fd].timeout = ESP8266_RECV_TIMEOUT;
+    esp->sockets[fd].handshake_ms = -1;
+
+    esp->sockets[fd].opening = 1;
+    bool done = false;
+    if (local_port) {
+        done = atcmd_send(&esp->at, "AT+CIPSTART=%d,\"UDP\",\"%s\",%d,%d,%d",
+                          fd, addr, port, local_port, mode) &&
+            atcmd_recv(&esp->at, "OK\n");
+    } else {
+        done = atcmd_send(&esp->at, "AT+CIPSTART=%d,\"UDP\",\"%s\",%d",
+                          fd, addr, port) &&
+            atcmd_recv(&esp->at, "OK\n");
+    }
+    esp->sockets[fd].opening = 0;
 
-    bool done = atcmd_send(&at, "AT+CIPSEND=%d,%lu", fd, amount) && atcmd_recv(&at, ">");
     if (done) {
-        rc = atcmd_write(&at, (char *)data, (int)amount);
-        atcmd_set_timeout(&at, ESP8266_RECV_TIMEOUT);
-        atcmd_process_oob(&at); // Poll for inbound packets
-        atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
+        esp->sockets[fd].open = 1;
+    } else {
+        esp->sockets[fd].open = 0;
+        put_fd(esp, fd);
+        fd = -1;
     }
+    return fd;
+}
 
-    atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
+int esp8266_open_udp(esp8266_t *esp, const char *addr, int port, int local_port, int mode)
+{
+    lock(esp);
+    int fd = open_dgram(esp, addr, port, local_port, mode);
+    unlock(esp);
+    return fd;
+}
 
-    return rc;
+static void send_ok_handler(void *arg)
+{
+    esp8266_t *esp = arg;
+    esp->send_result = 1;
 }
 
-int esp8266_send_tcp(int fd, const void *data, unsigned int amount)
+static void send_fail_handler(void *arg)
 {
-    if (socket_open[fd] == 0) {
+    esp8266_t *esp = arg;
+    esp->send_result = -1;
+}
+
+/* ask for the prompt, nothing is sent yet if it does not come */
+static bool send_prompt(esp8266_t *esp, int fd, unsigned int amount, const char *addr, int port)
+{
+    bool done;
+
+    esp->send_result = 0;
+    if (addr) {
+        done = atcmd_send(&esp->at, "AT+CIPSEND=%d,%u,\"%s\",%d", fd, amount, addr, port);
+    } else {
+        done = atcmd_send(&esp->at, "AT+CIPSEND=%d,%u", fd, amount);
+    }
+    return done && atcmd_recv(&esp->at, ">");
+}
+
+/* write the payload after the prompt and wait for SEND OK or SEND FAIL */
+static int send_data(esp8266_t *esp, int fd, const socket_iovec *iov, unsigned int iovcnt,
+                     unsigned int amount)
+{
+    unsigned int written = 0;
+
+    // the segments make up the payload announced above
+    for (unsigned int i = 0; i < iovcnt; i++) {
+        int n = atcmd_write(&esp->at, (char *)iov[i].base, (int)iov[i].len);
+        if (n > 0) {
+            written += n;
+        }
+        if (n != (int)iov[i].len) {
+            break;
+        }
+    }
+
+    // until it has the announced bytes the modem would take the next command
+    // as payload, so pad up to them. the peer got a broken stream, the link is
+    // closed once the modem is back in command mode.
+    bool broken = written < amount;
+    while (written < amount) {
+        static const char zeros[16];
+        unsigned int n = amount - written < sizeof(zeros) ? amount - written : sizeof(zeros);
+        int rc = atcmd_write(&esp->at, zeros, (int)n);
+        if (rc <= 0) {
+            break;
+        }
+        written += rc;
+    }
+
+    // "Recv N bytes" is skipped, URCs arriving meanwhile are dispatched
+    unsigned long start = esp->clock_ms ? esp->clock_ms() : 0;
+    int waited = 0;
+    while (esp->send_result == 0 && esp->sockets[fd].open && waited < ESP8266_SEND_OK_TIMEOUT) {
+        bool woken = atcmd_poll_oob(&esp->at, ESP8266_SEND_TIMEOUT);
+        if (esp->clock_ms) {
+            waited = (int)(esp->clock_ms() - start);
+        } else if (!woken) {
+            // without a clock only the silent periods are counted
+            waited += ESP8266_SEND_TIMEOUT;
+        }
+    }
+
+    if (broken) {
+        if (atcmd_send(&esp->at, "AT+CIPCLOSE=%d", fd)) {
+            atcmd_recv(&esp->at, "OK\n");
+        }
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (esp->send_result > 0) {
+        return amount;
+    }
+    if (!esp->sockets[fd].open) {
         return NSAPI_ERROR_CONNECTION_LOST;
     }
+    return NSAPI_ERROR_DEVICE_ERROR;
+}
+
+static int send_retry(esp8266_t *esp, int fd, const socket_iovec *iov, unsigned int iovcnt,
+                      const char *addr, int port)
+{
+    if (fd < 0 || fd >= ESP8266_SOCKET_COUNT) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    unsigned int amount = 0;
+    for (unsigned int i = 0; i < iovcnt; i++) {
+        amount += iov[i].len;
+    }
 
     int rc = NSAPI_ERROR_DEVICE_ERROR;
 
-    for (int i = 0; i < 2; i++) {
-        rc = _send_tcp(fd, data, amount);
-        if (rc >= 0) {
+    lock(esp);
+    atcmd_set_timeout(&esp->at, ESP8266_SEND_TIMEOUT);
+
+    // only a missing prompt is retried, once the payload went out it is never sent twice
+    for (int i = 0; i < 2 && esp->sockets[fd].open; i++) {
+        if (send_prompt(esp, fd, amount, addr, port)) {
+            rc = send_data(esp, fd, iov, iovcnt, amount);
             break;
         }
     }
+    if (rc == NSAPI_ERROR_DEVICE_ERROR && !esp->sockets[fd].open) {
+        rc = NSAPI_ERROR_CONNECTION_LOST;
+    }
+
+    // only handle inbound packets that are already waiting
+    while (atcmd_poll_oob(&esp->at, 0)) {
+    }
+
+    atcmd_set_timeout(&esp->at, ESP8266_MISC_TIMEOUT);
+    unlock(esp);
+
     return rc;
 }
 
-int esp8266_recv_tcp(int fd, void *data, unsigned int amount)
+int esp8266_send_tcp(esp8266_t *esp, int fd, const void *data, unsigned int amount)
 {
-    if (socket_open[fd] == 0) {
-        return NSAPI_ERROR_CONNECTION_LOST;
+    socket_iovec iov = { (void *)data, amount };
+    return send_retry(esp, fd, &iov, 1, NULL, 0);
+}
+
+int esp8266_sendv(esp8266_t *esp, int fd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    return send_retry(esp, fd, iov, iovcnt, NULL, 0);
+}
+
+int esp8266_sendto(esp8266_t *esp, int fd, const void *data, unsigned int amount, const char *addr, int port)
+{
+    if (fd >= 0 && fd < ESP8266_SOCKET_COUNT && esp->sockets[fd].type != ESP8266_LINK_UDP) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+    socket_iovec iov = { (void *)data, amount };
+    return send_retry(esp, fd, &iov, 1, addr, port);
+}
+
+static int recv_dgram(struct esp8266_socket *s, void *data, unsigned int amount,
+                      char *addr, int *port)
+{
+    unsigned char hdr[ESP8266_DGRAM_HEADER];
+
+    for (int i = 0; i < ESP8266_DGRAM_HEADER; i++) {
+        ringbuffer_get(&s->rxbuf, (char *)&hdr[i]);
+    }
+
+    unsigned int len = (hdr[0] << 8) | hdr[1];
+    if (port) {
+        *port = (hdr[2] << 8) | hdr[3];
+    }
+    if (addr) {
+        sprintf(addr, "%u.%u.%u.%u", hdr[4], hdr[5], hdr[6], hdr[7]);
+    }
+
+    // like a datagram socket, the part that does not fit is discarded
+    char *p = data;
+    for (unsigned int i = 0; i < len; i++) {
+        char ch;
+        ringbuffer_get(&s->rxbuf, &ch);
+        if (i < amount) {
+            *p++ = ch;
+        }
+    }
+    return len < amount ? len : amount;
+}
+
+/*
+ * the number of bytes buffered for the link, waiting for them up to the link
+ * timeout. 0 once the link is closed and drained, NSAPI_ERROR_WOULD_BLOCK
+ * when nothing arrived in time.
+ */
+static int rx_pending(esp8266_t *esp, int fd)
+{
+    struct esp8266_socket *s = &esp->sockets[fd];
+
+    if (!ringbuffer_length(&s->rxbuf) && s->open) {
+        socket_pollfd pfd = { .fd = fd, .events = SOCKET_POLLIN };
+        poll_links(esp, &pfd, 1, s->timeout);
     }
 
-    unsigned int len = ringbuffer_length(&ringbuf);
+    // data received before the link was closed is still handed out
+    unsigned int len = ringbuffer_length(&s->rxbuf);
     if (!len) {
-        atcmd_set_timeout(&at, ESP8266_RECV_TIMEOUT);
-        atcmd_process_oob(&at); // Poll for inbound packets
-        atcmd_set_timeout(&at, ESP8266_MISC_TIMEOUT);
-        return 0;
+        if (s->overrun) {
+            return NSAPI_ERROR_CONNECTION_LOST;
+        }
+        return s->open ? NSAPI_ERROR_WOULD_BLOCK : 0;
     }
+    return len;
+}
 
+int esp8266_settimeout(esp8266_t *esp, int fd, int timeout_ms)
+{
+    if (fd < 0 || fd >= ESP8266_SOCKET_COUNT) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    esp->sockets[fd].timeout = timeout_ms;
+    return NSAPI_ERROR_OK;
+}
+
+static int recv_from(esp8266_t *esp, int fd, void *data, unsigned int amount, char *addr, int *port)
+{
+    if (fd < 0 || fd >= ESP8266_SOCKET_COUNT) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    struct esp8266_socket *s = &esp->sockets[fd];
+
+    int pending = rx_pending(esp, fd);
+    if (pending <= 0) {
+        return pending;
+    }
+
+    if (s->type == ESP8266_LINK_UDP) {
+        return recv_dgram(s, data, amount, addr, port);
+    }
+
+    unsigned int len = pending;
     if (len > amount) {
         len = amount;
     }
     int count = len;
     char *p = data;
     while (count--) {
-        ringbuffer_get(&ringbuf, p++);
+        ringbuffer_get(&s->rxbuf, p++);
     }
     return len;
 }
 
-int esp8266_close(int fd)
+int esp8266_recvfrom(esp8266_t *esp, int fd, void *data, unsigned int amount, char *addr, int *port)
+{
+    lock(esp);
+    int rc = recv_from(esp, fd, data, amount, addr, port);
+    unlock(esp);
+    return rc;
+}
+
+int esp8266_recv_tcp(esp8266_t *esp, int fd, void *data, unsigned int amount)
 {
+    return esp8266_recvfrom(esp, fd, data, amount, NULL, NULL);
+}
+
+static int recv_iov(esp8266_t *esp, int fd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    if (fd < 0 || fd >= ESP8266_SOCKET_COUNT) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    struct esp8266_socket *s = &esp->sockets[fd];
+    if (s->type == ESP8266_LINK_UDP) {
+        // a datagram is not split over segments
+        return iovcnt ? recv_from(esp, fd, iov[0].base, iov[0].len, NULL, NULL) : 0;
+    }
+
+    int pending = rx_pending(esp, fd);
+    if (pending <= 0) {
+        return pending;
+    }
+
+    unsigned int left = pending;
+    int received = 0;
+    for (unsigned int i = 0; i < iovcnt && left; i++) {
+        unsigned int len = iov[i].len < left ? iov[i].len : left;
+        char *p = iov[i].base;
+        for (unsigned int j = 0; j < len; j++) {
+            ringbuffer_get(&s->rxbuf, p++);
+        }
+        left -= len;
+        received += len;
+    }
+    return received;
+}
+
+int esp8266_recvv(esp8266_t *esp, int fd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    lock(esp);
+    int rc = recv_iov(esp, fd, iov, iovcnt);
+    unlock(esp);
+    return rc;
+}
+
+static int listen_server(esp8266_t *esp, int port, int max_conn)
+{
+    if (esp->server.listening) {
+        return NSAPI_ERROR_ADDRESS_IN_USE;
+    }
+
+    bool done = true;
+    if (max_conn > 0) {
+        done = atcmd_send(&esp->at, "AT+CIPSERVERMAXCONN=%d", max_conn) &&
+            atcmd_recv(&esp->at, "OK\n");
+    }
+    done = done &&
+        atcmd_send(&esp->at, "AT+CIPSERVER=1,%d", port) &&
+        atcmd_recv(&esp->at, "OK\n");
+    if (!done) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    esp->server.listening = 1;
+    esp->server.head = 0;
+    esp->server.count = 0;
+    return ESP8266_SERVER_FD;
+}
+
+int esp8266_listen(esp8266_t *esp, int port, int max_conn)
+{
+    lock(esp);
+    int rc = listen_server(esp, port, max_conn);
+    unlock(esp);
+    return rc;
+}
+
+static bool get_remote(esp8266_t *esp, int fd, char *addr, int *port)
+{
+    char format[64];
+    char ip[SOCKET_ADDRESS_SIZE];
+    int remote_port;
+
+    // only the status line of our link matches, the others are skipped
+    snprintf(format, sizeof(format), "+CIPSTATUS:%d,\"%%*[^\"]\",\"%%15[^\"]\",%%d,", fd);
+    if (!(atcmd_send(&esp->at, "AT+CIPSTATUS") &&
+          atcmd_recv(&esp->at, format, ip, &remote_port) &&
+          atcmd_recv(&esp->at, "OK\n")))
+    {
+        return false;
+    }
+
+    if (addr) {
+        strcpy(addr, ip);
+    }
+    if (port) {
+        *port = remote_port;
+    }
+    return true;
+}
+
+static int accept_client(esp8266_t *esp, int fd, char *addr, int *port)
+{
+    if (fd != ESP8266_SERVER_FD || !esp->server.listening) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    // clients are queued by the CONNECT handler, only dispatch what already arrived
+    while (!esp->server.count && atcmd_poll_oob(&esp->at, 0)) {
+    }
+
+    while (esp->server.count) {
+        int id = esp->server.queue[esp->server.head];
+        esp->server.head = (esp->server.head + 1) % ESP8266_SOCKET_COUNT;
+        esp->server.count--;
+        esp->server.queued &= ~(1UL << id);
+
+        // skip clients that went away before being accepted
+        if (!esp->sockets[id].open && !ringbuffer_length(&esp->sockets[id].rxbuf)) {
+            put_fd(esp, id);
+            continue;
+        }
+        if ((addr || port) && !get_remote(esp, id, addr, port)) {
+            if (addr) {
+                strcpy(addr, "0.0.0.0");
+            }
+            if (port) {
+                *port = 0;
+            }
+        }
+        return id;
+    }
+    return NSAPI_ERROR_WOULD_BLOCK;
+}
+
+int esp8266_accept(esp8266_t *esp, int fd, char *addr, int *port)
+{
+    lock(esp);
+    int rc = accept_client(esp, fd, addr, port);
+    unlock(esp);
+    return rc;
+}
+
+static int close_link(esp8266_t *esp, int fd)
+{
+    if (fd == ESP8266_SERVER_FD) {
+        // stop accepting, links already accepted stay open
+        if (esp->server.listening &&
+            atcmd_send(&esp->at, "AT+CIPSERVER=0") && atcmd_recv(&esp->at, "OK\n")) {
+            esp->server.listening = 0;
+            // clients never accepted are closed, their CLOSED releases them
+            while (esp->server.count) {
+                int id = esp->server.queue[esp->server.head];
+                esp->server.head = (esp->server.head + 1) % ESP8266_SOCKET_COUNT;
+                esp->server.count--;
+                esp->server.queued &= ~(1UL << id);
+                if (!esp->sockets[id].open ||
+                    !(atcmd_send(&esp->at, "AT+CIPCLOSE=%d", id) && atcmd_recv(&esp->at, "OK\n"))) {
+                    put_fd(esp, id);
+                }
+            }
+            return 0;
+        }
+        return -1;
+    }
+    if (fd < 0 || fd >= ESP8266_SOCKET_COUNT) {
+        return -1;
+    }
+    if (!esp->sockets[fd].open && (esp->id_flags & (1UL << fd))) {
+        // an accepted client that had left, only its ID is left to release
+        put_fd(esp, fd);
+        return 0;
+    }
+
     for (int i = 0; i < 2; i++) {
-        if (atcmd_send(&at, "AT+CIPCLOSE=%d", fd) && atcmd_recv(&at, "OK\n")) {
-            if (!socket_open[fd]) {
+        if (atcmd_send(&esp->at, "AT+CIPCLOSE=%d", fd) && atcmd_recv(&esp->at, "OK\n")) {
+            if (!esp->sockets[fd].open) {
                 // recv(processing OOBs) needs to be done first
-                put_fd(fd);
+                put_fd(esp, fd);
                 return 0;
             }
         }
     }
     return -1;
 }
+
+int esp8266_close(esp8266_t *esp, int fd)
+{
+    lock(esp);
+    int rc = close_link(esp, fd);
+    unlock(esp);
+    return rc;
+}
+
+static int poll_ready(esp8266_t *esp, socket_pollfd *fds, unsigned int nfds)
+{
+    int ready = 0;
+
+    for (unsigned int i = 0; i < nfds; i++) {
+        socket_pollfd *pfd = &fds[i];
+        pfd->revents = 0;
+
+        if (pfd->fd == ESP8266_SERVER_FD) {
+            if (!esp->server.listening) {
+                pfd->revents = SOCKET_POLLHUP;
+            } else if ((pfd->events & SOCKET_POLLIN) && esp->server.count) {
+                pfd->revents = SOCKET_POLLIN;
+            }
+        } else if (pfd->fd < 0 || pfd->fd >= ESP8266_SOCKET_COUNT) {
+            pfd->revents = SOCKET_POLLHUP;
+        } else {
+            struct esp8266_socket *s = &esp->sockets[pfd->fd];
+            if ((pfd->events & SOCKET_POLLIN) && ringbuffer_length(&s->rxbuf)) {
+                pfd->revents |= SOCKET_POLLIN;
+            }
+            if (!s->open) {
+                pfd->revents |= SOCKET_POLLHUP;
+            } else if (pfd->events & SOCKET_POLLOUT) {
+                // AT+CIPSEND is synchronous, an open link always accepts data
+                pfd->revents |= SOCKET_POLLOUT;
+            }
+        }
+
+        if (pfd->revents) {
+            ready++;
+        }
+    }
+    return ready;
+}
+
+/*
+ * wait up to timeout ms for a URC and dispatch it. with a lock set, the wait
+ * for input is done without it when the transport can tell, so the other
+ * threads keep using the modem meanwhile.
+ */
+static bool wait_urc(esp8266_t *esp, int timeout)
+{
+    if (!esp->unlock || !esp->at.ops->wait_readable) {
+        return atcmd_poll_oob(&esp->at, timeout);
+    }
+
+    unlock(esp);
+    int readable = atcmd_wait_readable(&esp->at, timeout);
+    lock(esp);
+
+    // another thread may have read the input meanwhile
+    return readable > 0 && atcmd_poll_oob(&esp->at, 0);
+}
+
+static int poll_links(esp8266_t *esp, socket_pollfd *fds, unsigned int nfds, int timeout)
+{
+    unsigned long start = esp->clock_ms ? esp->clock_ms() : 0;
+    int waited = 0;
+
+    // dispatch what the module has already sent before deciding to wait
+    while (atcmd_poll_oob(&esp->at, 0)) {
+    }
+
+    int ready = poll_ready(esp, fds, nfds);
+
+    // every wakeup is a URC, which may be for a link we are not watching
+    while (!ready && (timeout < 0 || waited < timeout)) {
+        int wait = timeout < 0 ? ESP8266_RECV_TIMEOUT : timeout - waited;
+        bool woken = wait_urc(esp, wait);
+        if (woken) {
+            while (atcmd_poll_oob(&esp->at, 0)) {
+            }
+        }
+        ready = poll_ready(esp, fds, nfds);
+
+        if (timeout < 0) {
+            continue;
+        }
+        if (esp->clock_ms) {
+            waited = (int)(esp->clock_ms() - start);
+        } else if (woken) {
+            break;  // without a clock the time spent is unknown
+        } else {
+            waited += wait;
+        }
+    }
+    return ready;
+}
+
+int esp8266_poll(esp8266_t *esp, socket_pollfd *fds, unsigned int nfds, int timeout)
+{
+    lock(esp);
+    int ready = poll_links(esp, fds, nfds, timeout);
+    unlock(esp);
+    return ready;
+}
+
@@ -2,56 +2,193 @@
 #define _ESP8266_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "socket.h"
 #include "atcmd.h"
-
-enum nsapi_error
-{
-    NSAPI_ERROR_OK                          = 0,        /*!< no error */
-    NSAPI_ERROR_WOULD_BLOCK                 = -3001,    /*!< no data is not available but call is non-blocking */
-    NSAPI_ERROR_UNSUPPORTED                 = -3002,    /*!< unsupported functionality */
-    NSAPI_ERROR_PARAMETER                   = -3003,    /*!< invalid configuration */
-    NSAPI_ERROR_NO_CONNECTION               = -3004,    /*!< not connected to a network */
-    NSAPI_ERROR_NO_SOCKET                   = -3005,    /*!< socket not available for use */
-    NSAPI_ERROR_NO_ADDRESS                  = -3006,    /*!< IP address is not known */
-    NSAPI_ERROR_NO_MEMORY                   = -3007,    /*!< memory resource not available */
-    NSAPI_ERROR_NO_SSID                     = -3008,    /*!< ssid not found */
-    NSAPI_ERROR_DNS_FAILURE                 = -3009,    /*!< DNS failed to complete successfully */
-    NSAPI_ERROR_DHCP_FAILURE                = -3010,    /*!< DHCP failed to complete successfully */
-    NSAPI_ERROR_AUTH_FAILURE                = -3011,    /*!< connection to access point failed */
-    NSAPI_ERROR_DEVICE_ERROR                = -3012,    /*!< failure interfacing with the network processor */
-    NSAPI_ERROR_IN_PROGRESS                 = -3013,    /*!< operation (eg connect) in progress */
-    NSAPI_ERROR_ALREADY                     = -3014,    /*!< operation (eg connect) already in progress */
-    NSAPI_ERROR_IS_CONNECTED                = -3015,    /*!< socket is already connected */
-    NSAPI_ERROR_CONNECTION_LOST             = -3016,    /*!< connection lost */
-    NSAPI_ERROR_CONNECTION_TIMEOUT          = -3017,    /*!< connection timed out */
-    NSAPI_ERROR_ADDRESS_IN_USE              = -3018,    /*!< Address already in use */
-};
-
-typedef signed int nsapi_error_t;
+#include "ringbuffer.h"
 
 #define ESP8266_WIFIMODE_STATION            1
 #define ESP8266_WIFIMODE_SOFTAP             2
 #define ESP8266_WIFIMODE_STATION_SOFTAP     3
 
-void esp8266_init(atcmd_ops *ops);
-bool esp8266_reset(void);
-int esp8266_startup(int mode);
-bool esp8266_dhcp(bool enabled, int mode);
-
-int esp8266_get_firmware_version(void);
-int esp8266_get_default_wifi_mode(void);
-bool esp8266_set_default_wifi_mode(const int8_t mode);
-const char *esp8266_get_ipaddress(void);
-const char *esp8266_get_macaddress(void);
-const char *esp8266_get_gateway(void);
-const char *esp8266_get_netmask(void);
-int esp8266_get_rssi(void);
-
-int esp8266_connect(const char *ap, const char *password);
-int esp8266_open_tcp(const char *addr, int port, int keepalive);
-int esp8266_send_tcp(int fd, const void *data, unsigned int amount);
-int esp8266_recv_tcp(int fd, void *data, unsigned int amount);
-int esp8266_close(int fd);
+#define ESP8266_UDP_MODE_FIXED              0   /* remote peer never changes */
+#define ESP8266_UDP_MODE_ONCE               1   /* remote changes once, to the first sender */
+#define ESP8266_UDP_MODE_ANY                2   /* remote may change with every datagram */
+
+#define ESP8266_SSL_AUTH_NONE               0   /* no certificates */
+#define ESP8266_SSL_AUTH_CLIENT             1   /* send the client certificate */
+#define ESP8266_SSL_AUTH_SERVER             2   /* verify the server with the CA */
+#define ESP8266_SSL_AUTH_BOTH               3
+
+/* link IDs handled by the driver, the AT firmware supports at most 5 */
+#ifndef ESP8266_SOCKET_COUNT
+#define ESP8266_SOCKET_COUNT                5
+#endif
+
+/* descriptor of the listening socket, link IDs are below it */
+#define ESP8266_SERVER_FD                   ESP8266_SOCKET_COUNT
+
+/*
+ * receive buffer per link, must be a power of 2. a single +IPD carries up to
+ * 1460 bytes and is dropped when it does not fit, so keep room for a full
+ * segment on top of what the application leaves unread.
+ */
+#ifndef ESP8266_SOCKET_BUFFER_SIZE
+#define ESP8266_SOCKET_BUFFER_SIZE          2048
+#endif
+
+/*
+ * one modem, all its state and buffers live here so several modems can be
+ * driven side by side. priv is handed to the atcmd_ops callbacks.
+ */
+typedef struct esp8266_t {
+    atcmd at;
+    char at_buf[256];
+
+    struct esp8266_socket {
+        int open;
+        int type;
+        int timeout;        /* recv wait in ms, 0 never waits, < 0 waits forever */
+        int overrun;        /* TCP data was dropped, the stream is broken */
+        int opening;        /* AT+CIPSTART sent, the CONNECT of the ID is ours */
+        int handshake_ms;   /* AT+CIPSTART of the last TCP/SSL open, else -1 */
+        ringbuffer rxbuf;
+        char buf[ESP8266_SOCKET_BUFFER_SIZE];
+    } sockets[ESP8266_SOCKET_COUNT];
+    unsigned long id_flags;
+
+    /* links opened by remote clients, in the order their CONNECT arrived */
+    struct esp8266_server {
+        int listening;
+        int queue[ESP8266_SOCKET_COUNT];
+        int head;
+        int count;
+        unsigned long queued;   /* IDs in the queue, reserved until accepted */
+    } server;
+
+    bool started;
+    bool wifi_connected;
+    int connect_error;
+    bool fail;
+    int send_result;
+    bool ssl_sni_supported;
+    unsigned long (*clock_ms)(void);
+    void (*lock)(void *arg);
+    void (*unlock)(void *arg);
+    void *lock_arg;
+
+    char ip_buffer[16];
+    char mac_buffer[18];
+    char gateway_buffer[16];
+    char netmask_buffer[16];
+} esp8266_t;
+
+void esp8266_init(esp8266_t *esp, atcmd_ops *ops, void *priv);
+
+/*
+ * optional millisecond clock, used to bound esp8266_poll() when URCs of
+ * other links arrive while waiting. without it such a URC ends the wait.
+ */
+void esp8266_set_clock(esp8266_t *esp, unsigned long (*clock_ms)(void));
+
+/*
+ * optional lock taken by every call on the modem, when several threads use
+ * it (e.g. the MQTT_TASK receive thread polling while others publish). AT
+ * exchanges must not interleave: a poll in the middle of AT+CIPSEND would
+ * take its prompt. esp8266_poll() waits without the lock when the atcmd_ops
+ * have wait_readable, otherwise it keeps the modem for the whole wait.
+ */
+void esp8266_set_lock(esp8266_t *esp, void (*lock)(void *arg), void (*unlock)(void *arg), void *arg);
+bool esp8266_reset(esp8266_t *esp);
+int esp8266_startup(esp8266_t *esp, int mode);
+bool esp8266_dhcp(esp8266_t *esp, bool enabled, int mode);
+
+int esp8266_get_firmware_version(esp8266_t *esp);
+int esp8266_get_default_wifi_mode(esp8266_t *esp);
+bool esp8266_set_default_wifi_mode(esp8266_t *esp, const int8_t mode);
+const char *esp8266_get_ipaddress(esp8266_t *esp);
+const char *esp8266_get_macaddress(esp8266_t *esp);
+const char *esp8266_get_gateway(esp8266_t *esp);
+const char *esp8266_get_netmask(esp8266_t *esp);
+int esp8266_get_rssi(esp8266_t *esp);
+
+int esp8266_connect(esp8266_t *esp, const char *ap, const char *password);
+
+/* tracks the WIFI GOT IP / WIFI DISCONNECT URCs seen so far */
+bool esp8266_wifi_connected(esp8266_t *esp);
+
+int esp8266_open_tcp(esp8266_t *esp, const char *addr, int port, int keepalive);
+int esp8266_send_tcp(esp8266_t *esp, int fd, const void *data, unsigned int amount);
+int esp8266_recv_tcp(esp8266_t *esp, int fd, void *data, unsigned int amount);
+
+/*
+ * how long recv waits for data on the link: 0 returns at once, a negative
+ * timeout waits until data or close. links start with 500 ms. recv returns
+ * NSAPI_ERROR_WOULD_BLOCK when nothing arrived in time and 0 only once the
+ * link is closed and its buffer drained. a TCP link whose buffer overflowed
+ * is reported closed, recv then returns NSAPI_ERROR_CONNECTION_LOST once the
+ * data received before is drained.
+ */
+int esp8266_settimeout(esp8266_t *esp, int fd, int timeout_ms);
+
+/*
+ * the segments go out with a single AT+CIPSEND, written one after the other
+ * after the prompt. recvv fills the segments in order from the link buffer,
+ * on UDP links the datagram is received into the first segment only.
+ */
+int esp8266_sendv(esp8266_t *esp, int fd, const socket_iovec *iov, unsigned int iovcnt);
+int esp8266_recvv(esp8266_t *esp, int fd, const socket_iovec *iov, unsigned int iovcnt);
+int esp8266_close(esp8266_t *esp, int fd);
+
+/*
+ * SSL links behave like TCP links. the buffer size (2048 to 4096) and the
+ * authentication mode apply to links opened afterwards; the firmware allows
+ * a single SSL link at a time. sni, if not NULL and not an IPv4 address, is
+ * sent as server name when the firmware supports AT+CIPSSLCSNI. the firmware
+ * keeps no TLS session cache, so a reconnect always does a full handshake:
+ * keep links open with keepalive rather than reopening them.
+ */
+bool esp8266_set_ssl_buffer_size(esp8266_t *esp, int size);
+bool esp8266_set_ssl_auth_mode(esp8266_t *esp, int mode);
+int esp8266_open_ssl(esp8266_t *esp, const char *addr, int port, int keepalive, const char *sni);
+
+/*
+ * how long the last open of the link took in ms: the TCP connect and, on SSL
+ * links, the TLS handshake. -1 without esp8266_set_clock(), for UDP and
+ * accepted links and for a bad fd.
+ */
+int esp8266_get_handshake_ms(esp8266_t *esp, int fd);
+
+/*
+ * open a UDP link to addr:port, bound to local_port (0 lets the module choose,
+ * mode is then ignored). on UDP links every recv returns a single datagram.
+ */
+int esp8266_open_udp(esp8266_t *esp, const char *addr, int port, int local_port, int mode);
+int esp8266_sendto(esp8266_t *esp, int fd, const void *data, unsigned int amount, const char *addr, int port);
+
+/* addr, if not NULL, must hold SOCKET_ADDRESS_SIZE bytes */
+int esp8266_recvfrom(esp8266_t *esp, int fd, void *data, unsigned int amount, char *addr, int *port);
+
+/*
+ * start the TCP server on port, accepting at most max_conn clients
+ * (0 keeps the firmware default). return ESP8266_SERVER_FD, which is polled
+ * for SOCKET_POLLIN and passed to esp8266_accept() and esp8266_close().
+ */
+int esp8266_listen(esp8266_t *esp, int port, int max_conn);
+
+/*
+ * return the link ID of the next client, or NSAPI_ERROR_WOULD_BLOCK if none
+ * connected. it never waits: poll ESP8266_SERVER_FD for SOCKET_POLLIN to
+ * wait for clients. addr (SOCKET_ADDRESS_SIZE bytes) and port may be NULL.
+ */
+int esp8266_accept(esp8266_t *esp, int fd, char *addr, int *port);
+
+/*
+ * wait up to timeout ms for any of the links to become readable
+ * (SOCKET_POLLIN), writable (SOCKET_POLLOUT) or closed (SOCKET_POLLHUP),
+ * a negative timeout waits until one does. URCs of all links are dispatched
+ * while waiting. return the number of entries with revents set.
+ */
+int esp8266_poll(esp8266_t *esp, socket_pollfd *fds, unsigned int nfds, int timeout);
 
 #endif
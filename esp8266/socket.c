@@ -1,5 +1,11 @@
+#include <string.h>
 #include "socket.h"
 
+/* segments are gathered into chunks of this size when the backend has no sendv */
+#ifndef SOCKET_SENDV_BUFFER_SIZE
+#define SOCKET_SENDV_BUFFER_SIZE    256
+#endif
+
 static socket_interface *sock = 0;
 
 int socket_init(socket_interface *si, const char *ssid, const char *password)
@@ -13,6 +19,11 @@ int socket_connect(const char *address, const unsigned port)
     return sock ? sock->connect(address, port) : -1;
 }
 
+int socket_connect_ssl(const char *address, const unsigned port)
+{
+    return sock && sock->connect_ssl ? sock->connect_ssl(address, port) : -1;
+}
+
 int socket_close(int sockfd)
 {
     return sock ? sock->close(sockfd) : -1;
@@ -27,3 +38,159 @@ int socket_recv(int sockfd, void *buf, unsigned int nbytes)
 {
     return sock ? sock->recv(sockfd, buf, nbytes) : -1;
 }
+
+int socket_settimeout(int sockfd, int timeout_ms)
+{
+    return sock && sock->settimeout ? sock->settimeout(sockfd, timeout_ms) : -1;
+}
+
+/* wait for the socket with poll, so the call itself does not wait again */
+static int wait_ready(int sockfd, short events, int timeout_ms)
+{
+    socket_pollfd pfd = { .fd = sockfd, .events = events };
+
+    if (!sock->poll) {
+        return 1;
+    }
+    return sock->poll(&pfd, 1, timeout_ms) > 0;
+}
+
+int socket_send_timeout(int sockfd, const void *buf, unsigned int nbytes, int timeout_ms)
+{
+    if (!sock) {
+        return -1;
+    }
+    if (!wait_ready(sockfd, SOCKET_POLLOUT, timeout_ms)) {
+        return NSAPI_ERROR_WOULD_BLOCK;
+    }
+    return sock->send(sockfd, buf, nbytes);
+}
+
+int socket_recv_timeout(int sockfd, void *buf, unsigned int nbytes, int timeout_ms)
+{
+    if (!sock) {
+        return -1;
+    }
+    // POLLHUP also wakes us, recv then reports the close
+    if (!wait_ready(sockfd, SOCKET_POLLIN, timeout_ms)) {
+        return NSAPI_ERROR_WOULD_BLOCK;
+    }
+    return sock->recv(sockfd, buf, nbytes);
+}
+
+static int sendv_copy(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    char buf[SOCKET_SENDV_BUFFER_SIZE];
+    unsigned int used = 0;
+    int sent = 0;
+
+    for (unsigned int i = 0; i <= iovcnt; i++) {
+        const char *p = i < iovcnt ? iov[i].base : NULL;
+        unsigned int left = i < iovcnt ? iov[i].len : 0;
+
+        // small segments share one send, large ones go out as they are
+        if (used && (i == iovcnt || used + left > sizeof(buf))) {
+            int rc = sock->send(sockfd, buf, used);
+            if (rc < 0) {
+                return sent ? sent : rc;
+            }
+            sent += rc;
+            if ((unsigned int)rc < used) {
+                return sent;
+            }
+            used = 0;
+        }
+
+        if (left > sizeof(buf)) {
+            int rc = sock->send(sockfd, p, left);
+            if (rc < 0) {
+                return sent ? sent : rc;
+            }
+            sent += rc;
+            if ((unsigned int)rc < left) {
+                return sent;
+            }
+        } else if (left) {
+            memcpy(&buf[used], p, left);
+            used += left;
+        }
+    }
+    return sent;
+}
+
+int socket_sendv(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    if (!sock) {
+        return -1;
+    }
+    return sock->sendv ? sock->sendv(sockfd, iov, iovcnt) : sendv_copy(sockfd, iov, iovcnt);
+}
+
+static int recvv_each(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    int received = 0;
+
+    for (unsigned int i = 0; i < iovcnt; i++) {
+        if (!iov[i].len) {
+            continue;
+        }
+
+        // only the first recv may wait, later ones take what is already there
+        if (received) {
+            socket_pollfd pfd = { .fd = sockfd, .events = SOCKET_POLLIN };
+            if (!sock->poll || sock->poll(&pfd, 1, 0) <= 0 || !(pfd.revents & SOCKET_POLLIN)) {
+                break;
+            }
+        }
+
+        int rc = sock->recv(sockfd, iov[i].base, iov[i].len);
+        if (rc <= 0) {
+            return received ? received : rc;
+        }
+        received += rc;
+        if ((unsigned int)rc < iov[i].len) {
+            break;
+        }
+    }
+    return received;
+}
+
+int socket_recvv(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    if (!sock) {
+        return -1;
+    }
+    return sock->recvv ? sock->recvv(sockfd, iov, iovcnt) : recvv_each(sockfd, iov, iovcnt);
+}
+
+int socket_open_udp(const char *address, const unsigned port, const unsigned local_port)
+{
+    return sock && sock->open_udp ? sock->open_udp(address, port, local_port) : -1;
+}
+
+int socket_sendto(int sockfd, const void *buf, unsigned int nbytes,
+                  const char *address, const unsigned port)
+{
+    return sock && sock->sendto ? sock->sendto(sockfd, buf, nbytes, address, port) : -1;
+}
+
+int socket_recvfrom(int sockfd, void *buf, unsigned int nbytes,
+                    char *address, unsigned *port)
+{
+    return sock && sock->recvfrom ? sock->recvfrom(sockfd, buf, nbytes, address, port) : -1;
+}
+
+int socket_listen(const unsigned port, int backlog)
+{
+    return sock && sock->listen ? sock->listen(port, backlog) : -1;
+}
+
+int socket_accept(int sockfd, char *address, unsigned *port)
+{
+    return sock && sock->accept ? sock->accept(sockfd, address, port) : -1;
+}
+
+int socket_poll(socket_pollfd *fds, unsigned int nfds, int timeout_ms)
+{
+    return sock && sock->poll ? sock->poll(fds, nfds, timeout_ms) : -1;
+}
@@ -1,19 +1,118 @@
 #ifndef _SOCK_H_
 #define _SOCK_H_
 
+enum nsapi_error
+{
+    NSAPI_ERROR_OK                          = 0,        /*!< no error */
+    NSAPI_ERROR_WOULD_BLOCK                 = -3001,    /*!< no data is not available but call is non-blocking */
+    NSAPI_ERROR_UNSUPPORTED                 = -3002,    /*!< unsupported functionality */
+    NSAPI_ERROR_PARAMETER                   = -3003,    /*!< invalid configuration */
+    NSAPI_ERROR_NO_CONNECTION               = -3004,    /*!< not connected to a network */
+    NSAPI_ERROR_NO_SOCKET                   = -3005,    /*!< socket not available for use */
+    NSAPI_ERROR_NO_ADDRESS                  = -3006,    /*!< IP address is not known */
+    NSAPI_ERROR_NO_MEMORY                   = -3007,    /*!< memory resource not available */
+    NSAPI_ERROR_NO_SSID                     = -3008,    /*!< ssid not found */
+    NSAPI_ERROR_DNS_FAILURE                 = -3009,    /*!< DNS failed to complete successfully */
+    NSAPI_ERROR_DHCP_FAILURE                = -3010,    /*!< DHCP failed to complete successfully */
+    NSAPI_ERROR_AUTH_FAILURE                = -3011,    /*!< connection to access point failed */
+    NSAPI_ERROR_DEVICE_ERROR                = -3012,    /*!< failure interfacing with the network processor */
+    NSAPI_ERROR_IN_PROGRESS                 = -3013,    /*!< operation (eg connect) in progress */
+    NSAPI_ERROR_ALREADY                     = -3014,    /*!< operation (eg connect) already in progress */
+    NSAPI_ERROR_IS_CONNECTED                = -3015,    /*!< socket is already connected */
+    NSAPI_ERROR_CONNECTION_LOST             = -3016,    /*!< connection lost */
+    NSAPI_ERROR_CONNECTION_TIMEOUT          = -3017,    /*!< connection timed out */
+    NSAPI_ERROR_ADDRESS_IN_USE              = -3018,    /*!< Address already in use */
+};
+
+typedef signed int nsapi_error_t;
+
+#define SOCKET_ADDRESS_SIZE 16  /* dotted IPv4 address and terminator */
+
+#define SOCKET_POLLIN   0x01    /* data can be received */
+#define SOCKET_POLLOUT  0x04    /* data can be sent */
+#define SOCKET_POLLHUP  0x10    /* connection closed, always reported */
+
+typedef struct socket_pollfd {
+    int fd;
+    short events;
+    short revents;
+} socket_pollfd;
+
+/* one segment of a vectored send or receive */
+typedef struct socket_iovec {
+    void *base;
+    unsigned int len;
+} socket_iovec;
+
 typedef struct socket_interface {
     int (*init)(const char *ssid, const char *password);
     int (*connect)(const char *address, const unsigned port);
+    int (*connect_ssl)(const char *address, const unsigned port);
     int (*close)(int sockfd);
     int (*send)(int sockfd, const void *buf, unsigned int nbytes);
     int (*recv)(int sockfd, void *buf, unsigned int nbytes);
+    int (*poll)(socket_pollfd *fds, unsigned int nfds, int timeout_ms);
+    int (*open_udp)(const char *address, const unsigned port, const unsigned local_port);
+    int (*sendto)(int sockfd, const void *buf, unsigned int nbytes,
+                  const char *address, const unsigned port);
+    int (*recvfrom)(int sockfd, void *buf, unsigned int nbytes,
+                    char *address, unsigned *port);
+    int (*listen)(const unsigned port, int backlog);
+    int (*accept)(int sockfd, char *address, unsigned *port);
+    int (*sendv)(int sockfd, const socket_iovec *iov, unsigned int iovcnt);
+    int (*recvv)(int sockfd, const socket_iovec *iov, unsigned int iovcnt);
+    int (*settimeout)(int sockfd, int timeout_ms);
 } socket_interface;
 
 int socket_init(socket_interface *si, const char *ssid, const char *password);
 
 int socket_connect(const char *address, const unsigned port);
+int socket_connect_ssl(const char *address, const unsigned port);
 int socket_close(int sockfd);
 int socket_send(int sockfd, const void *buf, unsigned int nbytes);
 int socket_recv(int sockfd, void *buf, unsigned int nbytes);
 
+/*
+ * how long send and recv wait on the socket: 0 makes it non-blocking, a
+ * negative timeout waits forever. when the wait ends with nothing done they
+ * return NSAPI_ERROR_WOULD_BLOCK; recv returns 0 only on orderly close.
+ */
+int socket_settimeout(int sockfd, int timeout_ms);
+
+/* send/recv waiting at most timeout_ms for this call, whatever the socket timeout */
+int socket_send_timeout(int sockfd, const void *buf, unsigned int nbytes, int timeout_ms);
+int socket_recv_timeout(int sockfd, void *buf, unsigned int nbytes, int timeout_ms);
+
+/*
+ * send the segments in order as one write, receive into them in order.
+ * like send/recv they may transfer less than the total length. backends
+ * without their own implementation go through socket_send/socket_recv.
+ */
+int socket_sendv(int sockfd, const socket_iovec *iov, unsigned int iovcnt);
+int socket_recvv(int sockfd, const socket_iovec *iov, unsigned int iovcnt);
+
+/*
+ * datagram sockets, each recvfrom returns one datagram and fills in the
+ * sender if address (SOCKET_ADDRESS_SIZE bytes) and port are not NULL
+ */
+int socket_open_udp(const char *address, const unsigned port, const unsigned local_port);
+int socket_sendto(int sockfd, const void *buf, unsigned int nbytes,
+                  const char *address, const unsigned port);
+int socket_recvfrom(int sockfd, void *buf, unsigned int nbytes,
+                    char *address, unsigned *port);
+
+/*
+ * server sockets, accept returns the connected socket or a negative
+ * error when no client is waiting
+ */
+int socket_listen(const unsigned port, int backlog);
+int socket_accept(int sockfd, char *address, unsigned *port);
+
+/*
+ * wait up to timeout_ms until one of the sockets is ready, a negative
+ * timeout_ms waits until one is. return the number of sockets with
+ * revents set
+ */
+int socket_poll(socket_pollfd *fds, unsigned int nfds, int timeout_ms);
+
 #endif /* #ifndef _SOCK_H_ */
@@ -0,0 +1,362 @@
+#include <stddef.h>
+
+#include "esp8266.h"
+#include "socket_esp8266.h"
+#include "socket_bond.h"
+
+/* bytes per second assumed for a modem that has not been measured yet */
+#define SOCKET_BOND_DEFAULT_RATE    10000
+
+/* longest wait on one modem while others may have data */
+#define SOCKET_BOND_POLL_SLICE      10
+
+#define BOND_TCP    0
+#define BOND_SSL    1
+#define BOND_UDP    2
+
+static struct bond_modem {
+    esp8266_t *esp;
+    unsigned long rate;     /* smoothed send throughput in bytes per second */
+} modems[SOCKET_BOND_MAX_MODEMS];
+
+static int modem_count = 0;
+
+static unsigned long (*_clock_ms)(void);
+
+int socket_bond_add(esp8266_t *esp)
+{
+    if (!esp || modem_count >= SOCKET_BOND_MAX_MODEMS) {
+        return -1;
+    }
+    modems[modem_count].esp = esp;
+    modems[modem_count].rate = 0;
+    return modem_count++;
+}
+
+void socket_bond_set_clock(unsigned long (*clock_ms)(void))
+{
+    _clock_ms = clock_ms;
+}
+
+/* socket descriptors are the link ID offset by the modem index */
+static struct bond_modem *lookup(int sockfd, int *link)
+{
+    if (sockfd < 0 || sockfd >= modem_count * ESP8266_SOCKET_COUNT) {
+        return NULL;
+    }
+    *link = sockfd % ESP8266_SOCKET_COUNT;
+    return &modems[sockfd / ESP8266_SOCKET_COUNT];
+}
+
+static int links_in_use(esp8266_t *esp)
+{
+    int count = 0;
+    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
+        if (esp->id_flags & (1UL << i)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void account(struct bond_modem *bm, int bytes, unsigned long start)
+{
+    if (!_clock_ms) {
+        return;
+    }
+
+    unsigned long elapsed = _clock_ms() - start;
+    if (!elapsed) {
+        return;
+    }
+
+    unsigned long sample = (unsigned long)bytes * 1000 / elapsed;
+    bm->rate = bm->rate ? (bm->rate * 7 + sample) / 8 : sample;
+}
+
+/*
+ * the modem where a new link can expect the most throughput, skipping the
+ * ones in tried, without WiFi or without a free link ID
+ */
+static int pick(unsigned int tried)
+{
+    int best = -1;
+    unsigned long best_score = 0;
+
+    for (int m = 0; m < modem_count; m++) {
+        esp8266_t *esp = modems[m].esp;
+
+        if ((tried & (1U << m)) || !esp8266_wifi_connected(esp)) {
+            continue;
+        }
+
+        int used = links_in_use(esp);
+        if (used >= ESP8266_SOCKET_COUNT) {
+            continue;
+        }
+
+        unsigned long rate = modems[m].rate ? modems[m].rate : SOCKET_BOND_DEFAULT_RATE;
+        unsigned long score = rate / (used + 1);
+        if (best < 0 || score > best_score) {
+            best = m;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static int bond_open(int type, const char *address, const unsigned port,
+                     const unsigned local_port)
+{
+    unsigned int tried = 0;
+    int m;
+
+    // let CLOSED and WiFi URCs update the state pick() looks at
+    for (m = 0; m < modem_count; m++) {
+        esp8266_poll(modems[m].esp, NULL, 0, 0);
+    }
+
+    // a modem that fails to open is skipped, the next best one is tried
+    while ((m = pick(tried)) >= 0) {
+        esp8266_t *esp = modems[m].esp;
+        int link;
+
+        tried |= 1U << m;
+
+        if (type == BOND_SSL) {
+            link = esp8266_open_ssl(esp, address, port, 0, address);
+        } else if (type == BOND_UDP) {
+            link = esp8266_open_udp(esp, address, port, local_port, ESP8266_UDP_MODE_ANY);
+        } else {
+            link = esp8266_open_tcp(esp, address, port, 0);
+        }
+
+        if (link >= 0) {
+            return m * ESP8266_SOCKET_COUNT + link;
+        }
+    }
+    return NSAPI_ERROR_NO_SOCKET;
+}
+
+static int bond_init(const char *ssid, const char *password)
+{
+    int rc = NSAPI_ERROR_NO_CONNECTION;
+    int up = 0;
+
+    for (int m = 0; m < modem_count; m++) {
+        int status = socket_esp8266_start(modems[m].esp, ssid, password);
+        if (status == NSAPI_ERROR_OK || status == NSAPI_ERROR_IS_CONNECTED) {
+            up++;
+        } else {
+            rc = status;
+        }
+    }
+    return up ? NSAPI_ERROR_OK : rc;
+}
+
+static int bond_connect(const char *address, const unsigned port)
+{
+    return bond_open(BOND_TCP, address, port, 0);
+}
+
+static int bond_connect_ssl(const char *address, const unsigned port)
+{
+    return bond_open(BOND_SSL, address, port, 0);
+}
+
+static int bond_open_udp(const char *address, const unsigned port, const unsigned local_port)
+{
+    return bond_open(BOND_UDP, address, port, local_port);
+}
+
+static int bond_close(int sockfd)
+{
+    int link;
+    struct bond_modem *bm = lookup(sockfd, &link);
+    return bm ? esp8266_close(bm->esp, link) : -1;
+}
+
+static int bond_send(int sockfd, const void *buf, unsigned int nbytes)
+{
+    int link;
+    struct bond_modem *bm = lookup(sockfd, &link);
+    if (!bm) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    unsigned long start = _clock_ms ? _clock_ms() : 0;
+    int rc = esp8266_send_tcp(bm->esp, link, buf, nbytes);
+    if (rc > 0) {
+        account(bm, rc, start);
+    }
+    return rc;
+}
+
+static int bond_recv(int sockfd, void *buf, unsigned int nbytes)
+{
+    int link;
+    struct bond_modem *bm = lookup(sockfd, &link);
+    return bm ? esp8266_recv_tcp(bm->esp, link, buf, nbytes) : NSAPI_ERROR_NO_SOCKET;
+}
+
+static int bond_sendv(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    int link;
+    struct bond_modem *bm = lookup(sockfd, &link);
+    if (!bm) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    unsigned long start = _clock_ms ? _clock_ms() : 0;
+    int rc = esp8266_sendv(bm->esp, link, iov, iovcnt);
+    if (rc > 0) {
+        account(bm, rc, start);
+    }
+    return rc;
+}
+
+static int bond_recvv(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    int link;
+    struct bond_modem *bm = lookup(sockfd, &link);
+    return bm ? esp8266_recvv(bm->esp, link, iov, iovcnt) : NSAPI_ERROR_NO_SOCKET;
+}
+
+static int bond_settimeout(int sockfd, int timeout_ms)
+{
+    int link;
+    struct bond_modem *bm = lookup(sockfd, &link);
+    return bm ? esp8266_settimeout(bm->esp, link, timeout_ms) : NSAPI_ERROR_NO_SOCKET;
+}
+
+static int bond_sendto(int sockfd, const void *buf, unsigned int nbytes,
+                       const char *address, const unsigned port)
+{
+    int link;
+    struct bond_modem *bm = lookup(sockfd, &link);
+    if (!bm) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    unsigned long start = _clock_ms ? _clock_ms() : 0;
+    int rc = esp8266_sendto(bm->esp, link, buf, nbytes, address, port);
+    if (rc > 0) {
+        account(bm, rc, start);
+    }
+    return rc;
+}
+
+static int bond_recvfrom(int sockfd, void *buf, unsigned int nbytes,
+                         char *address, unsigned *port)
+{
+    int link;
+    int remote_port = 0;
+    struct bond_modem *bm = lookup(sockfd, &link);
+    if (!bm) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    int rc = esp8266_recvfrom(bm->esp, link, buf, nbytes, address, &remote_port);
+    if (rc > 0 && port) {
+        *port = remote_port;
+    }
+    return rc;
+}
+
+/*
+ * poll every modem once, waiting up to timeout_ms on those with sockets in
+ * fds. the same link may appear several times in fds, so interest is merged
+ * per link before asking the driver.
+ */
+static int poll_once(socket_pollfd *fds, unsigned int nfds, int timeout_ms)
+{
+    int ready = 0;
+
+    for (unsigned int i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+    }
+
+    for (int m = 0; m < modem_count; m++) {
+        socket_pollfd sub[ESP8266_SOCKET_COUNT];
+        short events[ESP8266_SOCKET_COUNT] = {0};
+        unsigned int n = 0;
+
+        for (unsigned int i = 0; i < nfds; i++) {
+            if (fds[i].fd >= 0 && fds[i].fd / ESP8266_SOCKET_COUNT == m) {
+                events[fds[i].fd % ESP8266_SOCKET_COUNT] |= fds[i].events;
+            }
+        }
+        for (int link = 0; link < ESP8266_SOCKET_COUNT; link++) {
+            if (events[link]) {
+                sub[n].fd = link;
+                sub[n].events = events[link];
+                sub[n].revents = 0;
+                n++;
+            }
+        }
+
+        // modems nobody waits on only get their pending URCs handled
+        if (!esp8266_poll(modems[m].esp, sub, n, n ? timeout_ms : 0)) {
+            continue;
+        }
+
+        for (unsigned int j = 0; j < n; j++) {
+            for (unsigned int i = 0; i < nfds; i++) {
+                if (fds[i].fd == m * ESP8266_SOCKET_COUNT + sub[j].fd) {
+                    fds[i].revents = sub[j].revents & (fds[i].events | SOCKET_POLLHUP);
+                }
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < nfds; i++) {
+        if (fds[i].fd < 0 || fds[i].fd >= modem_count * ESP8266_SOCKET_COUNT) {
+            fds[i].revents = SOCKET_POLLHUP;
+        }
+        if (fds[i].revents) {
+            ready++;
+        }
+    }
+    return ready;
+}
+
+static int bond_poll(socket_pollfd *fds, unsigned int nfds, int timeout_ms)
+{
+    unsigned long start = _clock_ms ? _clock_ms() : 0;
+    int waited = 0;
+
+    int ready = poll_once(fds, nfds, 0);
+
+    // modems are waited on in turn, in slices so none is starved
+    while (!ready && (timeout_ms < 0 || waited < timeout_ms)) {
+        int slice = timeout_ms - waited;
+        if (timeout_ms < 0 || slice > SOCKET_BOND_POLL_SLICE) {
+            slice = SOCKET_BOND_POLL_SLICE;
+        }
+
+        ready = poll_once(fds, nfds, slice);
+
+        if (_clock_ms) {
+            waited = (int)(_clock_ms() - start);
+        } else {
+            waited += slice;
+        }
+    }
+    return ready;
+}
+
+socket_interface socket_bond = {
+    .init = bond_init,
+    .connect = bond_connect,
+    .connect_ssl = bond_connect_ssl,
+    .close = bond_close,
+    .send = bond_send,
+    .recv = bond_recv,
+    .poll = bond_poll,
+    .open_udp = bond_open_udp,
+    .sendto = bond_sendto,
+    .recvfrom = bond_recvfrom,
+    .sendv = bond_sendv,
+    .recvv = bond_recvv,
+    .settimeout = bond_settimeout,
+};
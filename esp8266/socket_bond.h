@@ -0,0 +1,27 @@
+#ifndef _SOCKET_BOND_H_
+#define _SOCKET_BOND_H_
+
+#include "socket.h"
+#include "esp8266.h"
+
+#ifndef SOCKET_BOND_MAX_MODEMS
+#define SOCKET_BOND_MAX_MODEMS  8
+#endif
+
+/*
+ * socket_interface spreading connections over several modems. a socket
+ * lives on one modem, new sockets go to the modem with the best expected
+ * throughput per link among those that have WiFi and a free link ID.
+ */
+extern socket_interface socket_bond;
+
+/* add an initialized modem to the pool, before socket_init() */
+int socket_bond_add(esp8266_t *esp);
+
+/*
+ * optional millisecond clock, used to measure the throughput of each modem
+ * and to bound socket_poll(). without it connections are balanced by count.
+ */
+void socket_bond_set_clock(unsigned long (*clock_ms)(void));
+
+#endif
@@ -3,14 +3,14 @@
 #include "esp8266.h"
 #include "socket_esp8266.h"
 
-static int _started = 0;
+static esp8266_t *_esp;
 
-static const char *_get_ipaddress(void)
+static const char *_get_ipaddress(esp8266_t *esp)
 {
-    if (!_started) {
+    if (!esp->started) {
         return NULL;
     }
-    const char *ip_buff = esp8266_get_ipaddress();
+    const char *ip_buff = esp8266_get_ipaddress(esp);
 
     if (!ip_buff || strcmp(ip_buff, "0.0.0.0") == 0) {
         return NULL;
@@ -18,40 +18,40 @@ static const char *_get_ipaddress(void)
     return ip_buff;
 }
 
-static nsapi_error_t _startup(const int8_t wifi_mode)
+static nsapi_error_t _startup(esp8266_t *esp, const int8_t wifi_mode)
 {
-    if (!_started) {
-        if (!esp8266_startup(wifi_mode)) {
+    if (!esp->started) {
+        if (!esp8266_startup(esp, wifi_mode)) {
             return NSAPI_ERROR_DEVICE_ERROR;
         }
     }
     return NSAPI_ERROR_OK;
 }
 
-static int _init(void)
+static int _init(esp8266_t *esp)
 {
-    if (!esp8266_reset()) {
+    if (!esp8266_reset(esp)) {
         return -1;
     }
 
-    int version = esp8266_get_firmware_version();
+    int version = esp8266_get_firmware_version(esp);
     printf("version : %d\n", version);
 
-    int mode = esp8266_get_default_wifi_mode();
+    int mode = esp8266_get_default_wifi_mode(esp);
     printf("mode %d\n", mode);
     if (mode < 0) {
         return -1;
     }
 
     if (mode != ESP8266_WIFIMODE_STATION) {
-        if (!esp8266_set_default_wifi_mode(ESP8266_WIFIMODE_STATION)) {
+        if (!esp8266_set_default_wifi_mode(esp, ESP8266_WIFIMODE_STATION)) {
             return -1;
         }
     }
     return 0;
 }
 
-int esp_init(const char *ssid, const char *pass)
+int socket_esp8266_start(esp8266_t *esp, const char *ssid, const char *pass)
 {
     nsapi_error_t status;
 
@@ -59,61 +59,142 @@ int esp_init(const char *ssid, const char *pass)
         return NSAPI_ERROR_NO_SSID;
     }
 
-    status = _init();
+    status = _init(esp);
     if (status != NSAPI_ERROR_OK) {
         return status;
     }
 
-    if (_get_ipaddress()) {
+    if (_get_ipaddress(esp)) {
         return NSAPI_ERROR_IS_CONNECTED;
     }
 
-    status = _startup(ESP8266_WIFIMODE_STATION);
+    status = _startup(esp, ESP8266_WIFIMODE_STATION);
     if (status != NSAPI_ERROR_OK) {
         return status;
     }
-    _started = 1;
 
-    if (!esp8266_dhcp(1, 1)) {
+    if (!esp8266_dhcp(esp, 1, 1)) {
         return NSAPI_ERROR_DHCP_FAILURE;
     }
 
-    int connect_error = esp8266_connect(ssid, pass);
+    int connect_error = esp8266_connect(esp, ssid, pass);
     if (connect_error) {
         return connect_error;
     }
 
-    if (!_get_ipaddress()) {
+    if (!_get_ipaddress(esp)) {
         return NSAPI_ERROR_DHCP_FAILURE;
     }
 
     return NSAPI_ERROR_OK;
 }
 
+void socket_esp8266_attach(esp8266_t *esp)
+{
+    _esp = esp;
+}
+
+static int esp_init(const char *ssid, const char *pass)
+{
+    return socket_esp8266_start(_esp, ssid, pass);
+}
+
 static int esp_connect(const char *address, const unsigned port)
 {
-    return esp8266_open_tcp(address, port, 0);
+    return esp8266_open_tcp(_esp, address, port, 0);
+}
+
+static int esp_connect_ssl(const char *address, const unsigned port)
+{
+    return esp8266_open_ssl(_esp, address, port, 0, address);
 }
 
 static int esp_close(int sockfd)
 {
-    return esp8266_close(sockfd);
+    return esp8266_close(_esp, sockfd);
 }
 
 static int esp_send(int sockfd, const void *buf, unsigned int nbytes)
 {
-    return esp8266_send_tcp(sockfd, buf, nbytes);
+    return esp8266_send_tcp(_esp, sockfd, buf, nbytes);
 }
 
 static int esp_recv(int sockfd, void *buf, unsigned int nbytes)
 {
-    return esp8266_recv_tcp(sockfd, buf, nbytes);
+    return esp8266_recv_tcp(_esp, sockfd, buf, nbytes);
+}
+
+static int esp_sendv(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    return esp8266_sendv(_esp, sockfd, iov, iovcnt);
+}
+
+static int esp_recvv(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    return esp8266_recvv(_esp, sockfd, iov, iovcnt);
+}
+
+static int esp_settimeout(int sockfd, int timeout_ms)
+{
+    return esp8266_settimeout(_esp, sockfd, timeout_ms);
+}
+
+static int esp_poll(socket_pollfd *fds, unsigned int nfds, int timeout_ms)
+{
+    return esp8266_poll(_esp, fds, nfds, timeout_ms);
+}
+
+static int esp_open_udp(const char *address, const unsigned port, const unsigned local_port)
+{
+    return esp8266_open_udp(_esp, address, port, local_port, ESP8266_UDP_MODE_ANY);
+}
+
+static int esp_sendto(int sockfd, const void *buf, unsigned int nbytes,
+                      const char *address, const unsigned port)
+{
+    return esp8266_sendto(_esp, sockfd, buf, nbytes, address, port);
+}
+
+static int esp_recvfrom(int sockfd, void *buf, unsigned int nbytes,
+                        char *address, unsigned *port)
+{
+    int remote_port = 0;
+    int rc = esp8266_recvfrom(_esp, sockfd, buf, nbytes, address, &remote_port);
+    if (rc > 0 && port) {
+        *port = remote_port;
+    }
+    return rc;
+}
+
+static int esp_listen(const unsigned port, int backlog)
+{
+    return esp8266_listen(_esp, port, backlog);
+}
+
+static int esp_accept(int sockfd, char *address, unsigned *port)
+{
+    int remote_port = 0;
+    int rc = esp8266_accept(_esp, sockfd, address, &remote_port);
+    if (rc >= 0 && port) {
+        *port = remote_port;
+    }
+    return rc;
 }
 
 socket_interface socket_esp8266 = {
     .init = esp_init,
     .connect = esp_connect,
+    .connect_ssl = esp_connect_ssl,
     .close = esp_close,
     .send = esp_send,
     .recv = esp_recv,
+    .poll = esp_poll,
+    .open_udp = esp_open_udp,
+    .sendto = esp_sendto,
+    .recvfrom = esp_recvfrom,
+    .listen = esp_listen,
+    .accept = esp_accept,
+    .sendv = esp_sendv,
+    .recvv = esp_recvv,
+    .settimeout = esp_settimeout,
 };
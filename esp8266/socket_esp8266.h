@@ -2,7 +2,14 @@
 #define _SOCKET_ESP8266_H_
 
 #include "socket.h"
+#include "esp8266.h"
 
 extern socket_interface socket_esp8266;
 
+/* modem used by socket_esp8266, must be attached before socket_init() */
+void socket_esp8266_attach(esp8266_t *esp);
+
+/* reset the modem and join the access point */
+int socket_esp8266_start(esp8266_t *esp, const char *ssid, const char *pass);
+
 #endif
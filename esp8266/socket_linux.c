@@ -0,0 +1,465 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "socket_linux.h"
+
+/* same budgets as the esp8266 driver, so both backends behave alike */
+#define SOCKET_LINUX_CONNECT_TIMEOUT    15000
+#define SOCKET_LINUX_TIMEOUT            500
+
+#ifndef SOCKET_LINUX_MAX_FDS
+#define SOCKET_LINUX_MAX_FDS            1024
+#endif
+
+/* segments handed to the kernel by one sendv/recvv */
+#define SOCKET_LINUX_IOV_MAX            16
+
+static struct linux_socket {
+    int open;
+    int type;
+    int timeout;                    /* send/recv wait in ms, < 0 waits forever */
+    struct sockaddr_in remote;      /* default peer of a datagram socket */
+} sockets[SOCKET_LINUX_MAX_FDS];
+
+static int error_code(int err)
+{
+    switch (err) {
+    case EAGAIN:
+        return NSAPI_ERROR_WOULD_BLOCK;
+    case EINPROGRESS:
+        return NSAPI_ERROR_IN_PROGRESS;
+    case ETIMEDOUT:
+        return NSAPI_ERROR_CONNECTION_TIMEOUT;
+    case EADDRINUSE:
+        return NSAPI_ERROR_ADDRESS_IN_USE;
+    case ENOMEM:
+    case ENOBUFS:
+        return NSAPI_ERROR_NO_MEMORY;
+    case EMFILE:
+    case ENFILE:
+    case EBADF:
+        return NSAPI_ERROR_NO_SOCKET;
+    default:
+        return NSAPI_ERROR_CONNECTION_LOST;
+    }
+}
+
+static struct linux_socket *lookup(int sockfd)
+{
+    if (sockfd < 0 || sockfd >= SOCKET_LINUX_MAX_FDS || !sockets[sockfd].open) {
+        return NULL;
+    }
+    return &sockets[sockfd];
+}
+
+static int resolve(const char *address, const unsigned port, struct sockaddr_in *sin)
+{
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+
+    if (getaddrinfo(address, NULL, &hints, &res) != 0) {
+        return NSAPI_ERROR_DNS_FAILURE;
+    }
+    memcpy(sin, res->ai_addr, sizeof(*sin));
+    sin->sin_port = htons(port);
+    freeaddrinfo(res);
+    return NSAPI_ERROR_OK;
+}
+
+/* wait for one socket, return the poll(2) events seen or 0 on timeout */
+static int wait_fd(int fd, short events, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+
+    int rc;
+    do {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc > 0 ? pfd.revents : 0;
+}
+
+static int new_socket(int type)
+{
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return error_code(errno);
+    }
+    if (fd >= SOCKET_LINUX_MAX_FDS) {
+        close(fd);
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    memset(&sockets[fd], 0, sizeof(sockets[fd]));
+    sockets[fd].open = 1;
+    sockets[fd].type = type;
+    sockets[fd].timeout = SOCKET_LINUX_TIMEOUT;
+    return fd;
+}
+
+static void drop_socket(int fd)
+{
+    sockets[fd].open = 0;
+    close(fd);
+}
+
+static int linux_init(const char *ssid, const char *password)
+{
+    (void)ssid;
+    (void)password;
+    return NSAPI_ERROR_OK;
+}
+
+static int linux_connect(const char *address, const unsigned port)
+{
+    struct sockaddr_in sin;
+
+    int rc = resolve(address, port, &sin);
+    if (rc != NSAPI_ERROR_OK) {
+        return rc;
+    }
+
+    int fd = new_socket(SOCK_STREAM);
+    if (fd < 0) {
+        return fd;
+    }
+
+    // MQTT writes small packets and waits for the answer
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        if (errno != EINPROGRESS) {
+            rc = error_code(errno);
+            drop_socket(fd);
+            return rc;
+        }
+
+        // like the modem, connect returns once the link is up
+        int err = ETIMEDOUT;
+        socklen_t len = sizeof(err);
+        if (wait_fd(fd, POLLOUT, SOCKET_LINUX_CONNECT_TIMEOUT)) {
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        }
+        if (err) {
+            drop_socket(fd);
+            return error_code(err);
+        }
+    }
+    return fd;
+}
+
+static int linux_close(int sockfd)
+{
+    if (!lookup(sockfd)) {
+        return -1;
+    }
+    drop_socket(sockfd);
+    return 0;
+}
+
+static int linux_send(int sockfd, const void *buf, unsigned int nbytes)
+{
+    if (!lookup(sockfd)) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    ssize_t rc = send(sockfd, buf, nbytes, MSG_NOSIGNAL);
+    if (rc < 0 && errno == EAGAIN && wait_fd(sockfd, POLLOUT, sockets[sockfd].timeout)) {
+        rc = send(sockfd, buf, nbytes, MSG_NOSIGNAL);
+    }
+    return rc < 0 ? error_code(errno) : rc;
+}
+
+static int linux_recvfrom(int sockfd, void *buf, unsigned int nbytes,
+                          char *address, unsigned *port)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+
+    if (!lookup(sockfd)) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    ssize_t rc = recvfrom(sockfd, buf, nbytes, 0, (struct sockaddr *)&sin, &len);
+    if (rc < 0 && errno == EAGAIN && wait_fd(sockfd, POLLIN, sockets[sockfd].timeout)) {
+        len = sizeof(sin);
+        rc = recvfrom(sockfd, buf, nbytes, 0, (struct sockaddr *)&sin, &len);
+    }
+
+    if (rc < 0) {
+        return error_code(errno);
+    }
+
+    if (sockets[sockfd].type == SOCK_DGRAM) {
+        if (address) {
+            inet_ntop(AF_INET, &sin.sin_addr, address, SOCKET_ADDRESS_SIZE);
+        }
+        if (port) {
+            *port = ntohs(sin.sin_port);
+        }
+    }
+    return rc;
+}
+
+static int linux_recv(int sockfd, void *buf, unsigned int nbytes)
+{
+    return linux_recvfrom(sockfd, buf, nbytes, NULL, NULL);
+}
+
+static int linux_sendv(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    struct iovec vec[SOCKET_LINUX_IOV_MAX];
+
+    if (!lookup(sockfd)) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (iovcnt > SOCKET_LINUX_IOV_MAX) {
+        iovcnt = SOCKET_LINUX_IOV_MAX;  // the rest is reported as not sent
+    }
+    for (unsigned int i = 0; i < iovcnt; i++) {
+        vec[i].iov_base = iov[i].base;
+        vec[i].iov_len = iov[i].len;
+    }
+
+    struct msghdr msg = { .msg_iov = vec, .msg_iovlen = iovcnt };
+    ssize_t rc = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if (rc < 0 && errno == EAGAIN && wait_fd(sockfd, POLLOUT, sockets[sockfd].timeout)) {
+        rc = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    }
+    return rc < 0 ? error_code(errno) : rc;
+}
+
+static int linux_recvv(int sockfd, const socket_iovec *iov, unsigned int iovcnt)
+{
+    struct iovec vec[SOCKET_LINUX_IOV_MAX];
+
+    if (!lookup(sockfd)) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (iovcnt > SOCKET_LINUX_IOV_MAX) {
+        iovcnt = SOCKET_LINUX_IOV_MAX;
+    }
+    for (unsigned int i = 0; i < iovcnt; i++) {
+        vec[i].iov_base = iov[i].base;
+        vec[i].iov_len = iov[i].len;
+    }
+
+    ssize_t rc = readv(sockfd, vec, iovcnt);
+    if (rc < 0 && errno == EAGAIN && wait_fd(sockfd, POLLIN, sockets[sockfd].timeout)) {
+        rc = readv(sockfd, vec, iovcnt);
+    }
+    return rc < 0 ? error_code(errno) : rc;
+}
+
+static int linux_open_udp(const char *address, const unsigned port, const unsigned local_port)
+{
+    struct sockaddr_in remote;
+
+    int rc = resolve(address, port, &remote);
+    if (rc != NSAPI_ERROR_OK) {
+        return rc;
+    }
+
+    int fd = new_socket(SOCK_DGRAM);
+    if (fd < 0) {
+        return fd;
+    }
+
+    if (local_port) {
+        struct sockaddr_in sin = {
+            .sin_family = AF_INET,
+            .sin_port = htons(local_port),
+            .sin_addr.s_addr = htonl(INADDR_ANY),
+        };
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            rc = error_code(errno);
+            drop_socket(fd);
+            return rc;
+        }
+    }
+
+    // not connected, any peer may answer as with ESP8266_UDP_MODE_ANY
+    sockets[fd].remote = remote;
+    return fd;
+}
+
+static int linux_sendto(int sockfd, const void *buf, unsigned int nbytes,
+                        const char *address, const unsigned port)
+{
+    struct linux_socket *s = lookup(sockfd);
+    if (!s) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (s->type != SOCK_DGRAM) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+
+    struct sockaddr_in sin = s->remote;
+    if (address) {
+        int rc = resolve(address, port, &sin);
+        if (rc != NSAPI_ERROR_OK) {
+            return rc;
+        }
+    }
+
+    ssize_t rc = sendto(sockfd, buf, nbytes, MSG_NOSIGNAL, (struct sockaddr *)&sin, sizeof(sin));
+    if (rc < 0 && errno == EAGAIN && wait_fd(sockfd, POLLOUT, s->timeout)) {
+        rc = sendto(sockfd, buf, nbytes, MSG_NOSIGNAL, (struct sockaddr *)&sin, sizeof(sin));
+    }
+    return rc < 0 ? error_code(errno) : rc;
+}
+
+static int linux_listen(const unsigned port, int backlog)
+{
+    int fd = new_socket(SOCK_STREAM);
+    if (fd < 0) {
+        return fd;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+        listen(fd, backlog > 0 ? backlog : SOMAXCONN) < 0)
+    {
+        int rc = error_code(errno);
+        drop_socket(fd);
+        return rc;
+    }
+    return fd;
+}
+
+static int linux_accept(int sockfd, char *address, unsigned *port)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+
+    if (!lookup(sockfd)) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    int fd = accept4(sockfd, (struct sockaddr *)&sin, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0 && errno == EAGAIN && wait_fd(sockfd, POLLIN, sockets[sockfd].timeout)) {
+        len = sizeof(sin);
+        fd = accept4(sockfd, (struct sockaddr *)&sin, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    }
+    if (fd < 0) {
+        return error_code(errno);
+    }
+    if (fd >= SOCKET_LINUX_MAX_FDS) {
+        close(fd);
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&sockets[fd], 0, sizeof(sockets[fd]));
+    sockets[fd].open = 1;
+    sockets[fd].type = SOCK_STREAM;
+    sockets[fd].timeout = SOCKET_LINUX_TIMEOUT;
+
+    if (address) {
+        inet_ntop(AF_INET, &sin.sin_addr, address, SOCKET_ADDRESS_SIZE);
+    }
+    if (port) {
+        *port = ntohs(sin.sin_port);
+    }
+    return fd;
+}
+
+static int linux_settimeout(int sockfd, int timeout_ms)
+{
+    struct linux_socket *s = lookup(sockfd);
+    if (!s) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    s->timeout = timeout_ms;
+    return NSAPI_ERROR_OK;
+}
+
+/*
+ * the set is built for each call from the sockets passed in, so threads
+ * polling different sockets at the same time do not disturb each other
+ */
+static int linux_poll(socket_pollfd *fds, unsigned int nfds, int timeout_ms)
+{
+    struct pollfd pfds[nfds ? nfds : 1];
+    int ready = 0;
+
+    for (unsigned int i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+        // poll(2) skips negative descriptors
+        pfds[i].fd = lookup(fds[i].fd) ? fds[i].fd : -1;
+        pfds[i].events = POLLRDHUP;
+        pfds[i].revents = 0;
+        if (fds[i].events & SOCKET_POLLIN) {
+            pfds[i].events |= POLLIN;
+        }
+        if (fds[i].events & SOCKET_POLLOUT) {
+            pfds[i].events |= POLLOUT;
+        }
+    }
+
+    int n;
+    do {
+        n = poll(pfds, nfds, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+
+    for (unsigned int i = 0; i < nfds; i++) {
+        if (pfds[i].fd < 0) {
+            fds[i].revents = SOCKET_POLLHUP;
+        } else if (n > 0) {
+            if (pfds[i].revents & POLLIN) {
+                fds[i].revents |= fds[i].events & SOCKET_POLLIN;
+            }
+            if (pfds[i].revents & POLLOUT) {
+                fds[i].revents |= fds[i].events & SOCKET_POLLOUT;
+            }
+            if (pfds[i].revents & (POLLHUP | POLLRDHUP | POLLERR | POLLNVAL)) {
+                fds[i].revents |= SOCKET_POLLHUP;
+            }
+        }
+        if (fds[i].revents) {
+            ready++;
+        }
+    }
+    return ready;
+}
+
+socket_interface socket_linux = {
+    .init = linux_init,
+    .connect = linux_connect,
+    .close = linux_close,
+    .send = linux_send,
+    .recv = linux_recv,
+    .poll = linux_poll,
+    .open_udp = linux_open_udp,
+    .sendto = linux_sendto,
+    .recvfrom = linux_recvfrom,
+    .listen = linux_listen,
+    .accept = linux_accept,
+    .sendv = linux_sendv,
+    .recvv = linux_recvv,
+    .settimeout = linux_settimeout,
+};
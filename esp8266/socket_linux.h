@@ -0,0 +1,12 @@
+#ifndef _SOCKET_LINUX_H_
+#define _SOCKET_LINUX_H_
+
+#include "socket.h"
+
+/*
+ * socket_interface over the host TCP/IP stack, to run the upper layers
+ * without a modem. init() ignores ssid and password.
+ */
+extern socket_interface socket_linux;
+
+#endif
@@ -7,16 +7,19 @@
 #define LF 10
 #define CR 13
 
+/* more digits could overflow an int, no URC carries such an id */
+#define ID_DIGITS_MAX 4
+
 static const char delimiter[] = "\r\n";
 
 static int _putc(atcmd *at, unsigned char ch)
 {
-    return at->ops->putc_timeout(ch, at->timeout);
+    return at->ops->putc_timeout(at->priv, ch, at->timeout);
 }
 
 static int _getc(atcmd *at)
 {
-    return at->ops->getc_timeout(at->timeout);
+    return at->ops->getc_timeout(at->priv, at->timeout);
 }
 
 static void debug_if(bool on, const char *format, ...)
@@ -29,32 +32,96 @@ static void debug_if(bool on, const char *format, ...)
     }
 }
 
-bool atcmd_init(atcmd *at, atcmd_ops *ops, char *buf, unsigned int buf_size)
+bool atcmd_init(atcmd *at, atcmd_ops *ops, void *priv, char *buf, unsigned int buf_size)
 {
     if (!ops || !buf || !buf_size) {
         return false;
     }
     memset(at, 0, sizeof(*at));
     at->ops = ops;
+    at->priv = priv;
     at->buffer = buf;
     at->buffer_size = buf_size;
     at->dbg_on = false;
     return true;
 }
 
-bool atcmd_add_handler(atcmd *at, const char *prefix, void (*cb)(void))
+static struct handler *alloc_handler(atcmd *at)
 {
     for (int i = 0; i < AT_PARSER_OOB_COUNT; i++) {
         struct handler *o = &at->handlers[i];
-        if (o->prefix || (o->len > 0) || o->cb) {
+        if (o->prefix || (o->len > 0) || o->cb || o->id_cb) {
             continue;
         }
-        o->prefix = prefix;
-        o->len = strlen(prefix);
-        o->cb = cb;
-        return true;
+        return o;
+    }
+    return NULL;
+}
+
+bool atcmd_add_handler(atcmd *at, const char *prefix, void (*cb)(void *arg), void *arg)
+{
+    struct handler *o = alloc_handler(at);
+    if (!o) {
+        return false;
+    }
+    o->prefix = prefix;
+    o->len = strlen(prefix);
+    o->cb = cb;
+    o->arg = arg;
+    return true;
+}
+
+bool atcmd_add_id_handler(atcmd *at, const char *pattern, void (*cb)(void *arg, int id), void *arg)
+{
+    if (strncmp(pattern, "%d", 2) != 0 || !pattern[2]) {
+        return false;
+    }
+    struct handler *o = alloc_handler(at);
+    if (!o) {
+        return false;
+    }
+    // only the literal suffix is kept, the digits are matched by handler_match()
+    o->prefix = pattern + 2;
+    o->len = strlen(o->prefix);
+    o->id_cb = cb;
+    o->arg = arg;
+    return true;
+}
+
+static bool handler_match(struct handler *handler, const char *line, unsigned int n, int *id)
+{
+    if (!handler->id_cb) {
+        return n == handler->len && memcmp(handler->prefix, line, n) == 0;
+    }
+
+    // at least one digit followed by the suffix
+    if (n <= handler->len ||
+        line[n - 1] != handler->prefix[handler->len - 1] ||
+        memcmp(handler->prefix, line + n - handler->len, handler->len) != 0) {
+        return false;
+    }
+    if (n - handler->len > ID_DIGITS_MAX) {
+        return false;
+    }
+
+    int value = 0;
+    for (unsigned int i = 0; i < n - handler->len; i++) {
+        if (line[i] < '0' || line[i] > '9') {
+            return false;
+        }
+        value = value * 10 + (line[i] - '0');
+    }
+    *id = value;
+    return true;
+}
+
+static void handler_call(struct handler *handler, int id)
+{
+    if (handler->id_cb) {
+        handler->id_cb(handler->arg, id);
+    } else {
+        handler->cb(handler->arg);
     }
-    return false;
 }
 
 static bool atcmd_vsend(atcmd *at, const char *command, va_list args)
@@ -163,12 +230,12 @@ restart:
             for (int i = 0; i < AT_PARSER_OOB_COUNT; i++) {
 
                 struct handler *handler = &at->handlers[i];
+                int id;
 
-                if ((unsigned)j == handler->len &&
-                    memcmp(handler->prefix, at->buffer + offset, handler->len) == 0) {
+                if (handler_match(handler, at->buffer + offset, j, &id)) {
 
-                    debug_if(at->dbg_on, "AT! %s\n", handler->prefix);
-                    handler->cb();
+                    debug_if(at->dbg_on, "AT! %s\n", at->buffer + offset);
+                    handler_call(handler, id);
 
                     if (at->aborted) {
                         debug_if(at->dbg_on, "AT(Aborted)\n");
@@ -241,7 +308,7 @@ int atcmd_write(atcmd *at, const char *data, int size)
     int i = 0;
     for ( ; i < size; i++) {
         if (_putc(at, data[i]) < 0) {
-            return -1;
+            return i ? i : -1;
         }
     }
     return i;
@@ -261,13 +328,18 @@ int atcmd_read(atcmd *at, char *data, int size)
 }
 
 bool atcmd_process_oob(atcmd *at)
+{
+    return atcmd_poll_oob(at, at->timeout);
+}
+
+bool atcmd_poll_oob(atcmd *at, int timeout_ms)
 {
     unsigned int i = 0;
     bool rc = false;
 
     while (1) {
-        // Receive next character
-        int c = _getc(at);
+        // Receive next character, only the start of a line waits for timeout_ms
+        int c = i ? _getc(at) : at->ops->getc_timeout(at->priv, timeout_ms);
         if (c < 0) {
             rc = false;
             goto exit;
@@ -296,12 +368,12 @@ bool atcmd_process_oob(atcmd *at)
         for (int j = 0; j < AT_PARSER_OOB_COUNT; j++) {
 
             struct handler *handler = &at->handlers[j];
+            int id;
 
-            if (i == handler->len &&
-                memcmp(handler->prefix, at->buffer, handler->len) == 0) {
+            if (handler_match(handler, at->buffer, i, &id)) {
 
-                debug_if(at->dbg_on, "AT! %s\r\n", handler->prefix);
-                handler->cb();
+                debug_if(at->dbg_on, "AT! %s\r\n", at->buffer);
+                handler_call(handler, id);
                 rc = true;
                 goto exit;
             }
@@ -318,3 +390,11 @@ bool atcmd_process_oob(atcmd *at)
 exit:
     return rc;
 }
+
+int atcmd_wait_readable(atcmd *at, int timeout_ms)
+{
+    if (!at->ops->wait_readable) {
+        return -1;
+    }
+    return at->ops->wait_readable(at->priv, timeout_ms) > 0;
+}
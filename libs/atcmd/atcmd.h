@@ -8,9 +8,15 @@
 typedef struct atcmd_ops {
     /*
      * return 0 on success, -1 on failed or timeout
+     * priv is the pointer given to atcmd_init()
      */
-    int (*getc_timeout)(int timeout_ms);
-    int (*putc_timeout)(unsigned char  ch, int timeout_ms);
+    int (*getc_timeout)(void *priv, int timeout_ms);
+    int (*putc_timeout)(void *priv, unsigned char  ch, int timeout_ms);
+    /*
+     * optional, wait up to timeout_ms for input without reading it.
+     * return > 0 when there is some, 0 on timeout
+     */
+    int (*wait_readable)(void *priv, int timeout_ms);
 } atcmd_ops;
 
 typedef struct atcmd {
@@ -24,15 +30,25 @@ typedef struct atcmd {
     struct handler {
         const char *prefix;
         unsigned int len;
-        void (*cb)(void);
+        void (*cb)(void *arg);
+        void (*id_cb)(void *arg, int id);
+        void *arg;
     } handlers[AT_PARSER_OOB_COUNT];
 
     atcmd_ops *ops;
+    void *priv;
 } atcmd;
 
-bool atcmd_init(atcmd *at, atcmd_ops *ops, char *buf, unsigned int buf_size);
+bool atcmd_init(atcmd *at, atcmd_ops *ops, void *priv, char *buf, unsigned int buf_size);
 
-bool atcmd_add_handler(atcmd *at, const char *prefix, void (*cb)(void));
+bool atcmd_add_handler(atcmd *at, const char *prefix, void (*cb)(void *arg), void *arg);
+
+/*
+ * pattern is "%d" followed by a literal suffix, e.g. "%d,CLOSED".
+ * like a prefix, the handler fires on a line starting with a decimal number
+ * of at most 4 digits and the suffix, and receives the parsed number.
+ */
+bool atcmd_add_id_handler(atcmd *at, const char *pattern, void (*cb)(void *arg, int id), void *arg);
 
 bool atcmd_send(atcmd *at, const char *command, ...);
 
@@ -42,11 +58,25 @@ void atcmd_set_timeout(atcmd *at, int timeout);
 
 void atcmd_abort(atcmd *at);
 
+/* the bytes written, fewer when the transport failed midway, -1 when none */
 int atcmd_write(atcmd *at, const char *data, int size);
 
 int atcmd_read(atcmd *at, char *data, int size);
 
 bool atcmd_process_oob(atcmd *at);
 
+/*
+ * like atcmd_process_oob(), but waits at most timeout_ms for a new line to
+ * start; the rest of a line is read with the regular timeout. timeout_ms 0
+ * only handles what is already pending.
+ */
+bool atcmd_poll_oob(atcmd *at, int timeout_ms);
+
+/*
+ * wait up to timeout_ms for input, leaving it to be read. return 1 when
+ * there is some, 0 on timeout, -1 when the ops have no wait_readable
+ */
+int atcmd_wait_readable(atcmd *at, int timeout_ms);
+
 #endif /* #ifndef _AT_PARSER_H_ */
 
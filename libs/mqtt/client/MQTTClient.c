@@ -26,31 +26,253 @@ static void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage*
 }
 
 
+/* the slot of the publish in flight with this id, id 0 finds a free slot */
+static struct InflightMessage* findInflight(MQTTClient* c, unsigned short id)
+{
+    int i;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+    {
+        if (c->inflight[i].id == id)
+            return &c->inflight[i];
+    }
+    return NULL;
+}
+
+
 static int getNextPacketId(MQTTClient *c) {
-    return c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    do /* skip the ids still waiting for their acks */
+        c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    while (c->inflight_count > 0 && findInflight(c, c->next_packetid) != NULL);
+    return c->next_packetid;
 }
 
 
-static int sendPacket(MQTTClient* c, int length, Timer* timer)
+static void completeInflight(MQTTClient* c, struct InflightMessage* m, int rc)
+{
+    publishCompleteHandler fp = m->fp;
+    void* context = m->context;
+    unsigned short id = m->id;
+
+    m->id = 0;
+    c->inflight_count--;
+    if (fp != NULL)
+        fp(context, id, rc);
+}
+
+
+static int flushQueue(MQTTClient* c, Timer* timer);
+static int ackRequest(MQTTClient* c, int packet_type, Timer* timer);
+static void completeRequest(MQTTClient* c, struct PendingRequest* p, int rc);
+static struct PendingRequest* findPending(MQTTClient* c, unsigned char type, unsigned short id);
+static int supervise(MQTTClient* c, int timeout_ms);
+static void addPending(MQTTClient* c, struct PendingRequest* p, unsigned char type, unsigned short id,
+    int count, const char** topicFilters, messageHandler* messageHandlers, void* data,
+    requestCompleteHandler fp, void* context);
+
+
+/* acks of connect, subscribe and unsubscribe complete pending requests instead of being waited for */
+static int acksPending(MQTTClient* c)
+{
+#if defined(MQTT_TASK)
+    if (c->task)
+        return 1;
+#endif
+    return c->nonblocking;
+}
+
+
+#if defined(MQTT_TASK)
+static int receive(MQTTClient* c, int timeout_ms);
+
+
+struct Completion
+{
+    int done;
+    int rc;
+};
+
+
+static void onRequestComplete(void* context, unsigned short id, int rc)
+{
+    struct Completion* w = (struct Completion*)context;
+
+    (void)id;
+    w->rc = rc;
+    w->done = 1;
+}
+
+
+/* with the lock held, wait for the receive thread to complete the request */
+static int waitRequest(MQTTClient* c, struct Completion* w, Timer* timer)
 {
-    int rc = FAILURE,
-        sent = 0;
+    int i;
+
+    while (!w->done && !TimerIsExpired(timer))
+    {
+        if (ThreadIsCurrent(&c->thread))
+            receive(c, TimerLeftMS(timer)); /* a reconnect, or a handler: nobody else reads the ack */
+        else
+            CondWait(&c->cond, &c->mutex, TimerLeftMS(timer));
+    }
+    if (w->done)
+        return w->rc;
+    for (i = 0; i < MAX_PENDING_REQUESTS; ++i)
+    {
+        /* it does not outlive this call */
+        if (c->pending[i].type != 0 && c->pending[i].context == w)
+            c->pending[i].type = 0;
+    }
+    return FAILURE;
+}
+#endif
+
+
+static void onPingTimer(void* arg)
+{
+    ((MQTTClient*)arg)->ping_due = 1;
+}
+
+
+/* a ping is due one keepalive interval after the older of the last send and receive */
+static void scheduleKeepalive(MQTTClient* c)
+{
+    unsigned long oldest;
 
-    while (sent < length && !TimerIsExpired(timer))
+    if (c->wheel == NULL || c->keepAliveInterval == 0 || c->ping_outstanding)
+        return;
+
+    oldest = ((long)(c->sent_ms - c->received_ms) < 0) ? c->sent_ms : c->received_ms;
+    c->ping_due = 0;
+    timerwheel_add(c->wheel, &c->ping_timer, oldest + c->keepAliveInterval * 1000UL);
+}
+
+
+static void packetSent(MQTTClient* c)
+{
+    TimerCountdown(&c->last_sent, c->keepAliveInterval); // record the fact that we have successfully sent the packet
+    if (c->wheel)
+    {
+        c->sent_ms = TimerNowMS();
+        scheduleKeepalive(c);
+    }
+}
+
+
+/* write the segments, resuming after partial writes */
+static int writevAll(MQTTClient* c, socket_iovec* iov, int iovcnt, Timer* timer)
+{
+    while (iovcnt > 0 && !TimerIsExpired(timer))
     {
-        rc = c->ipstack->mqttwrite(c->ipstack, &c->buf[sent], length, TimerLeftMS(timer));
-        if (rc < 0)  // there was an error writing the data
+        int rc = c->ipstack->mqttwritev(c->ipstack, iov, iovcnt, TimerLeftMS(timer));
+        if (rc < 0)
             break;
-        sent += rc;
+        while (iovcnt > 0 && rc >= (int)iov->len)
+        {
+            rc -= iov->len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->base = (unsigned char*)iov->base + rc;
+            iov->len -= rc;
+        }
     }
-    if (sent == length)
+    return (iovcnt == 0) ? SUCCESS : FAILURE;
+}
+
+
+/* through mqttwritev, which sends without polling first */
+static int writeAll(MQTTClient* c, unsigned char* data, int length, Timer* timer)
+{
+    socket_iovec iov;
+
+    iov.base = data;
+    iov.len = length;
+    return writevAll(c, &iov, 1, timer);
+}
+
+
+/* true when len bytes fit in the send queue, moving what it holds to the front if needed */
+static int sendRoom(MQTTClient* c, size_t len)
+{
+    if (c->sendq_size - c->sendq_end >= len)
+        return 1;
+    memmove(c->sendq, c->sendq + c->sendq_start, c->sendq_end - c->sendq_start);
+    c->sendq_end -= c->sendq_start;
+    c->sendq_start = 0;
+    return c->sendq_size - c->sendq_end >= len;
+}
+
+
+/*
+ * non-blocking mode: write what the socket takes now and queue the rest behind
+ * the bytes already waiting. a packet is queued whole or not at all.
+ */
+static int queueOut(MQTTClient* c, socket_iovec* iov, int iovcnt)
+{
+    size_t total = 0;
+    int written = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; ++i)
+        total += iov[i].len;
+    if (!sendRoom(c, total))
+        return BUFFER_OVERFLOW;
+    if (c->sendq_start == c->sendq_end &&
+        (written = c->ipstack->mqttwritev(c->ipstack, iov, iovcnt, 0)) < 0)
+        return FAILURE;
+
+    for (i = 0; i < iovcnt; ++i)
     {
-        TimerCountdown(&c->last_sent, c->keepAliveInterval); // record the fact that we have successfully sent the packet
-        rc = SUCCESS;
+        unsigned int skip = ((unsigned int)written < iov[i].len) ? (unsigned int)written : iov[i].len;
+        memcpy(c->sendq + c->sendq_end, (unsigned char*)iov[i].base + skip, iov[i].len - skip);
+        c->sendq_end += iov[i].len - skip;
+        written -= skip;
     }
-    else
-        rc = FAILURE;
+    return SUCCESS;
+}
+
+
+/* send the queued bytes the socket takes now */
+static int flushSendQueue(MQTTClient* c)
+{
+    socket_iovec iov;
+    int rc;
+
+    if (c->sendq_start == c->sendq_end)
+        return SUCCESS;
+    iov.base = c->sendq + c->sendq_start;
+    iov.len = (unsigned int)(c->sendq_end - c->sendq_start);
+    if ((rc = c->ipstack->mqttwritev(c->ipstack, &iov, 1, 0)) < 0)
+        return FAILURE;
+    c->sendq_start += rc;
+    if (c->sendq_start == c->sendq_end)
+        c->sendq_start = c->sendq_end = 0;
+    return SUCCESS;
+}
+
+
+/* write, or queue in non-blocking mode */
+static int writeOut(MQTTClient* c, unsigned char* data, int length, Timer* timer)
+{
+    socket_iovec iov;
+
+    if (!c->nonblocking)
+        return writeAll(c, data, length, timer);
+    iov.base = data;
+    iov.len = length;
+    return queueOut(c, &iov, 1);
+}
+
+
+static int sendPacket(MQTTClient* c, int length, Timer* timer)
+{
+    int rc = writeOut(c, c->buf, length, timer);
 
+    if (rc == SUCCESS)
+        packetSent(c);
     return rc;
 }
 
@@ -63,6 +285,12 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
 
     for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         c->messageHandlers[i].topicFilter = 0;
+    MQTTTopicTrieInit(&c->topics);
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+        c->inflight[i].id = 0;
+    c->inflight_count = 0;
+    c->resending = MAX_INFLIGHT_MESSAGES;
+    c->queue = NULL;
     c->command_timeout_ms = command_timeout_ms;
     c->buf = sendbuf;
     c->buf_size = sendbuf_size;
@@ -72,11 +300,25 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
     c->cleansession = 0;
     c->ping_outstanding = 0;
     c->defaultMessageHandler = NULL;
+    c->streamHandler = NULL;
+    c->streaming = 0;
 	  c->next_packetid = 1;
     TimerInit(&c->last_sent);
     TimerInit(&c->last_received);
+    c->wheel = NULL;
+    timerwheel_timer_init(&c->ping_timer, onPingTimer, c);
+    c->ping_due = 0;
+    c->nonblocking = 0;
+    c->sendq = NULL;
+    c->sendq_size = c->sendq_start = c->sendq_end = 0;
+    for (i = 0; i < MAX_PENDING_REQUESTS; ++i)
+        c->pending[i].type = 0;
+    c->reconnect.host = NULL;
+    c->reconnect.delay_ms = 0;
 #if defined(MQTT_TASK)
 	  MutexInit(&c->mutex);
+	  CondInit(&c->cond);
+	  c->task = 0;
 #endif
 }
 
@@ -109,6 +351,60 @@ exit:
 }
 
 
+/* read and drop n bytes, to stay in step with the stream after a packet that does not fit */
+static int skipBytes(MQTTClient* c, int n, Timer* timer)
+{
+    while (n > 0)
+    {
+        int chunk = (n < (int)c->readbuf_size) ? n : (int)c->readbuf_size;
+        int rc = c->ipstack->mqttread(c->ipstack, c->readbuf, chunk, TimerLeftMS(timer));
+        if (rc != chunk)
+            return FAILURE;
+        n -= chunk;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * read the variable header of a publish too large for readbuf, the payload is left in
+ * the stream for streamMessage. the topic and at least one payload byte must fit.
+ */
+static int readPublishHead(MQTTClient* c, int len, int rem_len, Timer* timer)
+{
+    MQTTHeader header = {0};
+    int head;
+
+    header.byte = c->readbuf[0];
+    if (rem_len < 2 || len + 2 > (int)c->readbuf_size ||
+        c->ipstack->mqttread(c->ipstack, c->readbuf + len, 2, TimerLeftMS(timer)) != 2)
+        return FAILURE;
+    head = 2 + ((c->readbuf[len] << 8) | c->readbuf[len + 1]) + ((header.bits.qos > 0) ? 2 : 0);
+    if (head >= rem_len || len + head >= (int)c->readbuf_size)
+    {
+        if (skipBytes(c, rem_len - 2, timer) != SUCCESS)
+            return FAILURE;
+        return BUFFER_OVERFLOW;
+    }
+    if (c->ipstack->mqttread(c->ipstack, c->readbuf + len + 2, head - 2, TimerLeftMS(timer)) != head - 2)
+        return FAILURE;
+    c->streaming = 1;
+    return PUBLISH;
+}
+
+
+static void packetReceived(MQTTClient* c)
+{
+    if (c->keepAliveInterval > 0)
+        TimerCountdown(&c->last_received, c->keepAliveInterval); // record the fact that we have successfully received a packet
+    if (c->wheel)
+    {
+        c->received_ms = TimerNowMS();
+        scheduleKeepalive(c);
+    }
+}
+
+
 static int readPacket(MQTTClient* c, Timer* timer)
 {
     MQTTHeader header = {0};
@@ -126,22 +422,29 @@ static int readPacket(MQTTClient* c, Timer* timer)
     decodePacket(c, &rem_len, TimerLeftMS(timer));
     len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
 
+    c->streaming = 0;
     if (rem_len > (int)(c->readbuf_size - len))
     {
-        rc = BUFFER_OVERFLOW;
-        goto exit;
+        header.byte = c->readbuf[0];
+        if (header.bits.type == PUBLISH && c->streamHandler != NULL)
+        {
+            if ((rc = readPublishHead(c, len, rem_len, timer)) != PUBLISH)
+                goto exit;
+        }
+        else
+        {
+            rc = (skipBytes(c, rem_len, timer) == SUCCESS) ? BUFFER_OVERFLOW : FAILURE;
+            goto exit;
+        }
     }
-
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (rc = c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, TimerLeftMS(timer)) != rem_len)) {
-        rc = 0;
+    else if (rem_len > 0 && (rc = c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, TimerLeftMS(timer))) != rem_len) {
+        rc = (rc < 0) ? rc : 0; /* a failed read is not a timeout */
         goto exit;
     }
 
     header.byte = c->readbuf[0];
     rc = header.bits.type;
-    if (c->keepAliveInterval > 0)
-        TimerCountdown(&c->last_received, c->keepAliveInterval); // record the fact that we have successfully received a packet
 exit:
     return rc;
 }
@@ -150,78 +453,134 @@ exit:
 // assume topic filter and name is in correct format
 // # can only be at end
 // + and # can only be next to separator
-static char isTopicMatched(char* topicFilter, MQTTString* topicName)
+static char isTopicMatched(const char* topicFilter, MQTTString* topicName)
+{
+    const char* curf = topicFilter;
+    const char* curn = topicName->lenstring.data;
+    const char* curn_end = curn + topicName->lenstring.len;
+
+    if (curn < curn_end && *curn == '$' && (*curf == '+' || *curf == '#'))
+        return 0;   // wildcards at the first level do not match topics starting with $
+
+    while (1)
+    {   // compare one level of each
+        const char* nextf = curf;
+        const char* nextn = curn;
+        while (*nextf && *nextf != '/')
+            nextf++;
+        while (nextn < curn_end && *nextn != '/')
+            nextn++;
+
+        if (nextf - curf == 1 && *curf == '#')
+            return 1;
+        if (!(nextf - curf == 1 && *curf == '+') &&
+            (nextf - curf != nextn - curn || memcmp(curf, curn, nextf - curf) != 0))
+            return 0;
+        if (nextn == curn_end)  // "a/#" matches "a" as well
+            return *nextf == '\0' || strcmp(nextf, "/#") == 0;
+        if (*nextf == '\0')
+            return 0;
+        curf = nextf + 1;
+        curn = nextn + 1;
+    }
+}
+
+
+struct Delivery
 {
-    char* curf = topicFilter;
-    char* curn = topicName->lenstring.data;
-    char* curn_end = curn + topicName->lenstring.len;
+    MQTTClient* c;
+    MessageData md;
+    int rc;
+};
 
-    while (*curf && curn < curn_end)
+
+static void deliverToHandlers(void* context, short i)
+{
+    struct Delivery* d = (struct Delivery*)context;
+
+    // handlers whose filters end at the same node, the trie only compares hashes
+    for (; i >= 0; i = d->c->messageHandlers[i].next)
     {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
+        if (d->c->messageHandlers[i].fp != NULL &&
+            isTopicMatched(d->c->messageHandlers[i].topicFilter, d->md.topicName))
+        {
+            d->c->messageHandlers[i].fp(&d->md);
+            d->rc = SUCCESS;
         }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-
-    return (curn == curn_end) && (*curf == '\0');
+    }
 }
 
 
 int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
 {
-    int i;
-    int rc = FAILURE;
+    struct Delivery d;
+
+    d.c = c;
+    d.rc = FAILURE;
+    NewMessageData(&d.md, topicName, message);
 
     // we have to find the right message handler - indexed by topic
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    MQTTTopicTrieMatch(&c->topics, topicName->lenstring.data, topicName->lenstring.len,
+        deliverToHandlers, &d);
+
+    if (d.rc == FAILURE && c->defaultMessageHandler != NULL)
     {
-        int equal = 0, matched = 0;
-        if (c->messageHandlers[i].topicFilter != 0 &&
-            ((equal = MQTTPacket_equals(topicName, (char*)c->messageHandlers[i].topicFilter)) ||
-             (matched = isTopicMatched((char*)c->messageHandlers[i].topicFilter, topicName))))
-        {
-            if (c->messageHandlers[i].fp != NULL)
-            {
-                MessageData md;
-                NewMessageData(&md, topicName, message);
-                c->messageHandlers[i].fp(&md);
-                rc = SUCCESS;
-            }
-        }
+        c->defaultMessageHandler(&d.md);
+        d.rc = SUCCESS;
     }
 
-    if (rc == FAILURE && c->defaultMessageHandler != NULL)
+    return d.rc;
+}
+
+
+/* hand a publish larger than readbuf to the stream handler, reading its payload chunk by chunk */
+static int streamMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
+{
+    unsigned char* chunk = (unsigned char*)message->payload;   /* right after the topic in readbuf */
+    size_t room = c->readbuf + c->readbuf_size - chunk;
+    size_t total = message->payloadlen;
+    size_t offset = 0;
+    MessageData md;
+
+    NewMessageData(&md, topicName, message);
+    message->payloadlen = 0;
+    c->streamHandler(&md, 0, total);   // the topic, before any data
+
+    while (offset < total)
     {
-        MessageData md;
-        NewMessageData(&md, topicName, message);
-        c->defaultMessageHandler(&md);
-        rc = SUCCESS;
+        Timer timer;
+        int n = (int)((total - offset < room) ? total - offset : room);
+
+        TimerInit(&timer);   // each chunk gets the command timeout
+        TimerCountdownMS(&timer, c->command_timeout_ms);
+        if (c->ipstack->mqttread(c->ipstack, chunk, n, TimerLeftMS(&timer)) != n)
+            return FAILURE;
+        message->payloadlen = n;
+        c->streamHandler(&md, offset, total);
+        offset += n;
     }
-
-    return rc;
+    return SUCCESS;
 }
 
 
 int keepalive(MQTTClient* c)
 {
     int rc = SUCCESS;
+    int due;
 
     if (c->keepAliveInterval == 0) {
         goto exit;
     }
 
-    if (TimerIsExpired(&c->last_sent) || TimerIsExpired(&c->last_received))
+    if (c->wheel)
+    {
+        timerwheel_advance(c->wheel, TimerNowMS());
+        due = c->ping_due;
+    }
+    else
+        due = TimerIsExpired(&c->last_sent) || TimerIsExpired(&c->last_received);
+
+    if (due)
     {
         if (c->ping_outstanding) {
             rc = FAILURE; /* PINGRESP not received in keepalive interval */
@@ -233,7 +592,16 @@ int keepalive(MQTTClient* c)
             TimerCountdownMS(&timer, 1000);
             int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
             if (len > 0 && (rc = sendPacket(c, len, &timer)) == SUCCESS) // send the ping packet
+            {
                 c->ping_outstanding = 1;
+                if (c->wheel) /* the PINGRESP gets one keepalive interval */
+                {
+                    c->ping_due = 0;
+                    timerwheel_add(c->wheel, &c->ping_timer, TimerNowMS() + c->keepAliveInterval * 1000UL);
+                }
+                else
+                    TimerCountdown(&c->last_received, c->keepAliveInterval);
+            }
         }
     }
 
@@ -248,38 +616,61 @@ void MQTTCleanSession(MQTTClient* c)
 
     for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         c->messageHandlers[i].topicFilter = NULL;
+    MQTTTopicTrieInit(&c->topics);
 }
 
 
 void MQTTCloseSession(MQTTClient* c)
 {
+    int i;
+
+    if (c->wheel)
+        timerwheel_del(c->wheel, &c->ping_timer);
+    c->ping_due = 0;
     c->ping_outstanding = 0;
     c->isconnected = 0;
-    if (c->cleansession)
+    if (c->cleansession && c->reconnect.host == NULL) /* the supervisor subscribes again from them */
         MQTTCleanSession(c);
+    for (i = 0; i < MAX_PENDING_REQUESTS; ++i) /* their acks will not come */
+    {
+        if (c->pending[i].type != 0)
+            completeRequest(c, &c->pending[i], FAILURE);
+    }
+#if defined(MQTT_TASK)
+    CondBroadcast(&c->cond);
+#endif
 }
 
 
-int cycle(MQTTClient* c, Timer* timer)
+/* handle a packet in readbuf */
+static int handlePacket(MQTTClient* c, int packet_type, Timer* timer)
 {
     int len = 0,
         rc = SUCCESS;
 
-    int packet_type = readPacket(c, timer);     /* read the socket, see what work is due */
-
     switch (packet_type)
     {
         default:
             /* no more data to read, unrecoverable. Or read packet fails due to unexpected network error */
             rc = packet_type;
-            goto exit;
-        case 0: /* timed out reading packet */
             break;
         case CONNACK:
-        case PUBACK:
         case SUBACK:
         case UNSUBACK:
+            if (acksPending(c)) /* otherwise the blocking calls wait for them */
+                rc = ackRequest(c, packet_type, timer);
+            break;
+        case PUBACK:
+        case PUBCOMP:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            struct InflightMessage* m;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) == 1 &&
+                mypacketid != 0 && (m = findInflight(c, mypacketid)) != NULL && m->waitfor == packet_type)
+                completeInflight(c, m, SUCCESS);
             break;
+        }
         case PUBLISH:
         {
             MQTTString topicName;
@@ -293,10 +684,16 @@ int cycle(MQTTClient* c, Timer* timer)
                                               (int*)&msg.payloadlen,
                                               c->readbuf, c->readbuf_size);
             if (ret != 1) {
-                goto exit;
+                break;
             }
             msg.qos = (enum QoS)intQoS;
-            deliverMessage(c, &topicName, &msg);
+            if (c->streaming)
+            {
+                if ((rc = streamMessage(c, &topicName, &msg)) != SUCCESS)
+                    break; // the rest of the packet is lost with the stream
+            }
+            else
+                deliverMessage(c, &topicName, &msg);
             if (msg.qos != QOS0)
             {
                 if (msg.qos == QOS1)
@@ -307,11 +704,6 @@ int cycle(MQTTClient* c, Timer* timer)
                     rc = FAILURE;
                 else
                     rc = sendPacket(c, len, timer);
-
-                if (rc == FAILURE) {
-                    goto exit; // there was a problem
-
-                }
             }
             break;
         }
@@ -328,16 +720,35 @@ int cycle(MQTTClient* c, Timer* timer)
             else if ((rc = sendPacket(c, len, timer)) != SUCCESS) // send the PUBREL packet
                 rc = FAILURE; // there was a problem
             if (rc == FAILURE)
-                goto exit; // there was a problem
+                break; // there was a problem
+            if (packet_type == PUBREC)
+            {
+                struct InflightMessage* m = findInflight(c, mypacketid);
+                if (mypacketid != 0 && m != NULL && m->waitfor == PUBREC)
+                    m->waitfor = PUBCOMP;
+            }
             break;
         }
 
-        case PUBCOMP:
-            break;
         case PINGRESP:
             c->ping_outstanding = 0;
+            scheduleKeepalive(c);
             break;
     }
+    return rc;
+}
+
+
+/* handle what readPacket returned, then see what work is due */
+static int dispatch(MQTTClient* c, int packet_type, Timer* timer)
+{
+    int rc = SUCCESS;
+
+    if (packet_type > 0)
+        packetReceived(c);
+    if (packet_type != 0 /* timed out reading packet */ &&
+        (rc = handlePacket(c, packet_type, timer)) != SUCCESS)
+        goto exit;
 
     if (keepalive(c) != SUCCESS) {
         //check only keepalive FAILURE status so that previous FAILURE status can be considered as FAULT
@@ -354,25 +765,96 @@ exit:
 }
 
 
+int cycle(MQTTClient* c, Timer* timer)
+{
+    return dispatch(c, readPacket(c, timer), timer);    /* read the socket */
+}
+
+
+#if defined(MQTT_TASK)
+/* on the receive thread with the lock held, which it releases while it waits for and reads a packet */
+static int receive(MQTTClient* c, int timeout_ms)
+{
+    Timer timer;
+    int packet_type = 0;
+    int ready;
+    int rc = SUCCESS;
+
+    MutexUnlock(&c->mutex);
+    ready = c->ipstack->mqttpoll(c->ipstack, timeout_ms);
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    if (ready > 0)
+        packet_type = readPacket(c, &timer);
+    MutexLock(&c->mutex);
+
+    if (ready > 0)
+        rc = dispatch(c, packet_type, &timer);
+    else if (c->isconnected && (ready < 0 || keepalive(c) != SUCCESS))
+    {
+        rc = FAILURE;
+        MQTTCloseSession(c);
+    }
+    CondBroadcast(&c->cond); /* completions are waited for on it */
+    return rc;
+}
+#endif
+
+
 int MQTTYield(MQTTClient* c, int timeout_ms)
 {
     int rc = SUCCESS;
+    int wait = timeout_ms;
+    int ready;
     Timer timer;
+
+    if (c->nonblocking)
+        return FAILURE;
+    if (!c->isconnected && c->reconnect.host != NULL)
+        return supervise(c, timeout_ms);
     TimerInit(&timer);
     TimerCountdownMS(&timer, timeout_ms);
 
-    do {
-        Timer timer1;
-        TimerInit(&timer1);
-        TimerCountdownMS(&timer1, timeout_ms);
+    /* on a wheel, wake up for the next keepalive as well */
+    if (c->wheel)
+    {
+        long next = timerwheel_next(c->wheel, TimerNowMS());
+        if (next >= 0 && next < wait)
+            wait = (int)next;
+    }
 
-        if (cycle(c, &timer1) < 0) {
+    /* wait once, then handle every packet that is already there */
+    ready = c->ipstack->mqttpoll(c->ipstack, wait);
+    while (ready > 0)
+    {
+        if (cycle(c, &timer) < 0)
+        {
             rc = FAILURE;
-            break;
+            goto exit;
         }
+        if (TimerIsExpired(&timer))
+            break;
+        ready = c->ipstack->mqttpoll(c->ipstack, 0);
+    }
+
+    /* acks may have made room for queued messages */
+    if (ready >= 0 && c->queue && c->isconnected)
+    {
+        Timer flush_timer;
+        TimerInit(&flush_timer);
+        TimerCountdownMS(&flush_timer, c->command_timeout_ms);
+        if (flushQueue(c, &flush_timer) != SUCCESS)
+            ready = -1;
+    }
 
-	} while (!TimerIsExpired(&timer));
+    if (ready < 0 || keepalive(c) != SUCCESS)
+    {
+        rc = FAILURE;
+        if (c->isconnected)
+            MQTTCloseSession(c);
+    }
 
+exit:
     return rc;
 }
 
@@ -392,11 +874,20 @@ void MQTTRun(void* parm)
 	{
 #if defined(MQTT_TASK)
 		MutexLock(&c->mutex);
-#endif
+		if (c->isconnected || findPending(c, CONNECT, 0) != NULL)
+			receive(c, 500);
+		else
+		{
+			if (c->reconnect.host != NULL)
+				supervise(c, 500);
+			else
+				CondWait(&c->cond, &c->mutex, 500); /* no socket to read, until the next connect */
+			CondBroadcast(&c->cond);
+		}
+		MutexUnlock(&c->mutex);
+#else
 		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
 		cycle(c, &timer);
-#if defined(MQTT_TASK)
-		MutexUnlock(&c->mutex);
 #endif
 	}
 }
@@ -405,18 +896,41 @@ void MQTTRun(void* parm)
 #if defined(MQTT_TASK)
 int MQTTStartTask(MQTTClient* client)
 {
-	return ThreadStart(&client->thread, &MQTTRun, client);
+	client->task = 1;
+	if (ThreadStart(&client->thread, &MQTTRun, client) != 0)
+	{
+		client->task = 0;
+		return FAILURE;
+	}
+	return SUCCESS;
 }
 #endif
 
 
-int waitfor(MQTTClient* c, int packet_type, Timer* timer)
+/* let incoming packets be handled: read them here, or wait while the receive thread does */
+static int progress(MQTTClient* c, Timer* timer)
 {
-    int rc = FAILURE;
-
-    do
+#if defined(MQTT_TASK)
+    if (c->task)
     {
-        if (TimerIsExpired(timer))
+        if (ThreadIsCurrent(&c->thread))
+            receive(c, TimerLeftMS(timer)); /* a handler publishing */
+        else
+            CondWait(&c->cond, &c->mutex, TimerLeftMS(timer));
+        return c->isconnected ? SUCCESS : FAILURE;
+    }
+#endif
+    return cycle(c, timer);
+}
+
+
+int waitfor(MQTTClient* c, int packet_type, Timer* timer)
+{
+    int rc = FAILURE;
+
+    do
+    {
+        if (TimerIsExpired(timer))
             break; // we timed out
         rc = cycle(c, timer);
     }
@@ -428,16 +942,167 @@ int waitfor(MQTTClient* c, int packet_type, Timer* timer)
 
 
 
-int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTConnackData* data)
+void MQTTSetStreamHandler(MQTTClient* c, streamHandler handler)
+{
+    c->streamHandler = handler;
+}
+
+
+void MQTTSetTimerWheel(MQTTClient* c, timerwheel* wheel)
+{
+    if (c->wheel)
+        timerwheel_del(c->wheel, &c->ping_timer);
+    c->wheel = wheel;
+    c->ping_due = 0;
+    if (c->wheel && c->isconnected)
+    {
+        c->sent_ms = c->received_ms = TimerNowMS();
+        scheduleKeepalive(c);
+    }
+}
+
+
+/* serialize the fixed header, topic and packet id of a publish into buf, the payload is sent apart */
+static int serializePublishHead(MQTTClient* c, const char* topicName, MQTTMessage* message, unsigned char dup)
+{
+    MQTTHeader header = {0};
+    unsigned char* ptr = c->buf;
+    int topiclen = (int)strlen(topicName);
+    int head = 2 + topiclen + ((message->qos > 0) ? 2 : 0);
+    int rem_len;
+
+    if (message->payloadlen > 268435455 || (rem_len = head + (int)message->payloadlen) > 268435455 ||
+        MQTTPacket_len(rem_len) - rem_len + head > (int)c->buf_size)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+
+    header.bits.type = PUBLISH;
+    header.bits.dup = dup;
+    header.bits.qos = message->qos;
+    header.bits.retain = message->retained;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, rem_len);
+    writeCString(&ptr, topicName);
+    if (message->qos > 0)
+        writeInt(&ptr, message->id);
+    return (int)(ptr - c->buf);
+}
+
+
+/*
+ * send a publish without staging its payload in buf: the payload goes out from the
+ * caller's memory after the header, or is pulled from reader into buf chunk by chunk
+ */
+static int sendPublish(MQTTClient* c, const char* topicName, MQTTMessage* message,
+    payloadReader reader, void* readerContext, unsigned char dup, Timer* timer)
+{
+    int len = serializePublishHead(c, topicName, message, dup);
+    int rc = FAILURE;
+
+    if (len <= 0)
+        return FAILURE;
+    if (c->nonblocking && !sendRoom(c, len + message->payloadlen))
+        return BUFFER_OVERFLOW;
+
+    if (reader == NULL)
+    {
+        socket_iovec iov[2];
+        int iovcnt = (message->payloadlen > 0) ? 2 : 1;
+
+        iov[0].base = c->buf;
+        iov[0].len = len;
+        iov[1].base = message->payload;
+        iov[1].len = message->payloadlen;
+        rc = c->nonblocking ? queueOut(c, iov, iovcnt) : writevAll(c, iov, iovcnt, timer);
+    }
+    else
+    {
+        size_t offset = 0;
+
+        /* the first chunk shares the write with the header */
+        do
+        {
+            int n = (int)c->buf_size - len;
+            if ((size_t)n > message->payloadlen - offset)
+                n = (int)(message->payloadlen - offset);
+            if (n > 0 && (n = reader(readerContext, offset, c->buf + len, n)) <= 0)
+                return FAILURE;
+            if ((rc = writeOut(c, c->buf, len + n, timer)) != SUCCESS)
+                return rc;
+            offset += n;
+            len = 0;
+        } while (offset < message->payloadlen);
+    }
+
+    if (rc == SUCCESS)
+        packetSent(c);
+    return rc;
+}
+
+
+/* publishes not acknowledged before the connection dropped are to go out again */
+static void restartInflight(MQTTClient* c, unsigned char sessionPresent)
+{
+    int i;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES && !sessionPresent; ++i)
+    {
+        /* the server received it, but forgot the exchange along with the session */
+        if (c->inflight[i].id != 0 && c->inflight[i].waitfor == PUBCOMP)
+            completeInflight(c, &c->inflight[i], SUCCESS);
+    }
+    c->resending = 0;
+}
+
+
+/* send them again with DUP set, from where the last call stopped */
+static int resendInflight(MQTTClient* c, Timer* timer)
+{
+    for (; c->resending < MAX_INFLIGHT_MESSAGES; c->resending++)
+    {
+        struct InflightMessage* m = &c->inflight[c->resending];
+        int rc;
+
+        if (m->id == 0)
+            continue;
+        if (m->waitfor == PUBCOMP)
+        {
+            int len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL, 0, m->id);
+            rc = (len > 0) ? sendPacket(c, len, timer) : FAILURE;
+        }
+        else
+            rc = sendPublish(c, m->topicName, &m->message, m->reader, m->readerContext, 1, timer);
+        if (rc != SUCCESS)
+            return rc;
+    }
+    return SUCCESS;
+}
+
+
+static void connected(MQTTClient* c)
+{
+    c->isconnected = 1;
+    c->ping_outstanding = 0;
+    c->reconnect.delay_ms = 0;
+    if (c->wheel)
+    {
+        c->sent_ms = c->received_ms = TimerNowMS();
+        scheduleKeepalive(c);
+    }
+}
+
+
+/* with the lock held */
+static int connectSession(MQTTClient* c, MQTTPacket_connectData* options, MQTTConnackData* data)
 {
     Timer connect_timer;
     int rc = FAILURE;
     MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
     int len = 0;
-
 #if defined(MQTT_TASK)
-	  MutexLock(&c->mutex);
+    struct Completion w = {0, FAILURE};
+    struct PendingRequest* p = NULL;
 #endif
+
 	  if (c->isconnected) /* don't send connect packet again if we are already connected */
 		  goto exit;
 
@@ -450,11 +1115,26 @@ int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTC
     c->keepAliveInterval = options->keepAliveInterval;
     c->cleansession = options->cleansession;
     TimerCountdown(&c->last_received, c->keepAliveInterval);
+#if defined(MQTT_TASK)
+    /* the receive thread handles the connack, see ackRequest */
+    if (c->task && (c->connecting || findPending(c, CONNECT, 0) != NULL || (p = findPending(c, 0, 0)) == NULL))
+        goto exit;
+#endif
     if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
         goto exit;
     if ((rc = sendPacket(c, len, &connect_timer)) != SUCCESS)  // send the connect packet
         goto exit; // there was a problem
 
+#if defined(MQTT_TASK)
+    if (c->task)
+    {
+        addPending(c, p, CONNECT, 0, 0, NULL, NULL, data, onRequestComplete, &w);
+        CondBroadcast(&c->cond); /* wakes the receive thread waiting for a socket */
+        rc = waitRequest(c, &w, &connect_timer);
+        goto exit;
+    }
+#endif
+
     // this will be a blocking call, wait for the connack
     if (waitfor(c, CONNACK, &connect_timer) == CONNACK)
     {
@@ -464,21 +1144,37 @@ int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTC
             rc = data->rc;
         else
             rc = FAILURE;
+        if (rc == SUCCESS)
+        {
+            restartInflight(c, data->sessionPresent);
+            rc = resendInflight(c, &connect_timer);
+        }
+        if (rc == SUCCESS && c->queue)
+            rc = flushQueue(c, &connect_timer);
     }
     else
         rc = FAILURE;
 
 exit:
     if (rc == SUCCESS)
-    {
-        c->isconnected = 1;
-        c->ping_outstanding = 0;
-    }
+        connected(c);
+    return rc;
+}
+
+
+int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTConnackData* data)
+{
+    int rc;
 
+    if (c->nonblocking)
+        return FAILURE;
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    rc = connectSession(c, options, data);
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
 #endif
-
     return rc;
 }
 
@@ -490,82 +1186,157 @@ int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
 }
 
 
-int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler)
+/* qos is what the server granted, < 0 keeps it for an existing filter and is SUBFAIL for a new one */
+static int setMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler, int qos)
 {
     int rc = FAILURE;
+    short* head = MQTTTopicTrieValue(&c->topics, topicFilter, 0);
+    short* p = head;
     int i = -1;
 
-    /* first check for an existing matching slot */
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    /* first check for an existing matching slot, among the filters ending at the same node */
+    while (p != NULL && *p >= 0 && strcmp(c->messageHandlers[*p].topicFilter, topicFilter) != 0)
+        p = &c->messageHandlers[*p].next;
+    if (p != NULL && *p >= 0)
     {
-        if (c->messageHandlers[i].topicFilter != NULL && strcmp(c->messageHandlers[i].topicFilter, topicFilter) == 0)
+        i = *p;
+        if (messageHandler == NULL) /* remove existing */
         {
-            if (messageHandler == NULL) /* remove existing */
-            {
-                c->messageHandlers[i].topicFilter = NULL;
-                c->messageHandlers[i].fp = NULL;
-            }
-            rc = SUCCESS; /* return i when adding new subscription */
-            break;
+            *p = c->messageHandlers[i].next;
+            c->messageHandlers[i].topicFilter = NULL;
+            c->messageHandlers[i].fp = NULL;
+            MQTTTopicTriePrune(&c->topics, topicFilter);
+        }
+        else
+        {
+            c->messageHandlers[i].topicFilter = topicFilter;
+            c->messageHandlers[i].fp = messageHandler;
+            if (qos >= 0)
+                c->messageHandlers[i].qos = (enum QoS)qos;
         }
+        rc = SUCCESS;
     }
     /* if no existing, look for empty slot (unless we are removing) */
-    if (messageHandler != NULL) {
-        if (rc == FAILURE)
+    else if (messageHandler != NULL)
+    {
+        for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         {
-            for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-            {
-                if (c->messageHandlers[i].topicFilter == NULL)
-                {
-                    rc = SUCCESS;
-                    break;
-                }
-            }
+            if (c->messageHandlers[i].topicFilter == NULL)
+                break;
         }
-        if (i < MAX_MESSAGE_HANDLERS)
+        if (i < MAX_MESSAGE_HANDLERS && (head = MQTTTopicTrieValue(&c->topics, topicFilter, 1)) != NULL)
         {
             c->messageHandlers[i].topicFilter = topicFilter;
             c->messageHandlers[i].fp = messageHandler;
+            c->messageHandlers[i].qos = (qos >= 0) ? (enum QoS)qos : SUBFAIL;
+            c->messageHandlers[i].next = *head;
+            *head = (short)i;
+            rc = SUCCESS;
         }
     }
     return rc;
 }
 
 
-int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qos,
-       messageHandler messageHandler, MQTTSubackData* data)
+int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler)
+{
+    return setMessageHandler(c, topicFilter, messageHandler, -1);
+}
+
+
+static int serializeSubscribe(MQTTClient* c, unsigned short id, int count, const char* topicFilters[],
+    enum QoS qoss[])
+{
+    MQTTString topics[MAX_SUBSCRIBE_FILTERS];
+    int requested[MAX_SUBSCRIBE_FILTERS];
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+        topics[i].cstring = (char *)topicFilters[i];
+        topics[i].lenstring.len = 0;
+        topics[i].lenstring.data = NULL;
+        requested[i] = qoss[i];
+    }
+    return MQTTSerialize_subscribe(c->buf, c->buf_size, 0, id, count, topics, requested);
+}
+
+
+static int serializeUnsubscribe(MQTTClient* c, unsigned short id, int count, const char* topicFilters[])
+{
+    MQTTString topics[MAX_SUBSCRIBE_FILTERS];
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+        topics[i].cstring = (char *)topicFilters[i];
+        topics[i].lenstring.len = 0;
+        topics[i].lenstring.data = NULL;
+    }
+    return MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, id, count, topics);
+}
+
+
+/* with the lock held */
+static int subscribeMany(MQTTClient* c, int count, const char* topicFilters[], enum QoS qoss[],
+       messageHandler messageHandlers[], MQTTSubackData data[])
 {
     int rc = FAILURE;
     Timer timer;
     int len = 0;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
-
+    int i;
+    unsigned short id;
+    int granted[MAX_SUBSCRIBE_FILTERS];
 #if defined(MQTT_TASK)
-	  MutexLock(&c->mutex);
+    struct Completion w = {0, FAILURE};
+    struct PendingRequest* p = NULL;
 #endif
+
 	  if (!c->isconnected)
 		    goto exit;
 
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
+#if defined(MQTT_TASK)
+    /* the receive thread handles the suback, see ackRequest */
+    if (c->task && (p = findPending(c, 0, 0)) == NULL)
+        goto exit;
+#endif
+    id = getNextPacketId(c);
+    len = serializeSubscribe(c, id, count, topicFilters, qoss);
     if (len <= 0)
         goto exit;
     if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
         goto exit;             // there was a problem
 
+#if defined(MQTT_TASK)
+    if (c->task)
+    {
+        addPending(c, p, SUBSCRIBE, id, count, topicFilters, messageHandlers, data, onRequestComplete, &w);
+        rc = waitRequest(c, &w, &timer);
+        goto exit;
+    }
+#endif
+
     if (waitfor(c, SUBACK, &timer) == SUBACK)      // wait for suback
     {
-        int count = 0;
+        int granted_count = 0;
         unsigned short mypacketid;
-        data->grantedQoS = QOS0;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, (int*)&data->grantedQoS, c->readbuf, c->readbuf_size) == 1)
+        if (MQTTDeserialize_suback(&mypacketid, count, &granted_count, granted, c->readbuf, c->readbuf_size) == 1 &&
+            granted_count == count)
         {
-            if (data->grantedQoS != 0x80)
-                rc = MQTTSetMessageHandler(c, topicFilter, messageHandler);
+            /* one return code per filter, in the order they were sent */
+            for (i = 0; i < count; ++i)
+            {
+                data[i].grantedQoS = (enum QoS)(granted[i] & 0xff); /* read as a signed char */
+                if (data[i].grantedQoS != SUBFAIL &&
+                    setMessageHandler(c, topicFilters[i], messageHandlers[i], data[i].grantedQoS) != SUCCESS)
+                    rc = FAILURE;
+            }
         }
+        else
+            rc = FAILURE;
     }
     else
         rc = FAILURE;
@@ -573,6 +1344,21 @@ int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qo
 exit:
     if (rc == FAILURE)
         MQTTCloseSession(c);
+    return rc;
+}
+
+
+int MQTTSubscribeMany(MQTTClient* c, int count, const char* topicFilters[], enum QoS qoss[],
+       messageHandler messageHandlers[], MQTTSubackData data[])
+{
+    int rc;
+
+    if (count <= 0 || count > MAX_SUBSCRIBE_FILTERS || c->nonblocking)
+        return FAILURE;
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    rc = subscribeMany(c, count, topicFilters, qoss, messageHandlers, data);
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
 #endif
@@ -580,6 +1366,13 @@ exit:
 }
 
 
+int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qos,
+       messageHandler messageHandler, MQTTSubackData* data)
+{
+    return MQTTSubscribeMany(c, 1, &topicFilter, &qos, &messageHandler, data);
+}
+
+
 int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos,
        messageHandler messageHandler)
 {
@@ -588,13 +1381,168 @@ int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos,
 }
 
 
-int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
+void MQTTSetReconnect(MQTTClient* c, char* host, int port, MQTTPacket_connectData* options,
+    unsigned int min_ms, unsigned int max_ms, reconnectHandler handler, void* context)
+{
+    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
+    struct Reconnect* r = &c->reconnect;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    r->host = host;
+    r->port = port;
+    r->options = (options != 0) ? *options : default_options;
+    r->options.cleansession = 0;  /* the server keeps the session across the drops */
+    r->min_ms = (min_ms > 0) ? min_ms : 1;
+    r->max_ms = (max_ms > r->min_ms) ? max_ms : r->min_ms;
+    r->delay_ms = 0;
+    r->seed = TimerNowMS() ^ (unsigned long)(size_t)c;
+    r->fp = handler;
+    r->context = context;
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+}
+
+
+/* the next attempt after a random part of the delay, so clients dropped together spread out */
+static void backoff(MQTTClient* c)
+{
+    struct Reconnect* r = &c->reconnect;
+    unsigned int wait;
+
+    r->seed = r->seed * 1103515245UL + 12345;
+    wait = r->delay_ms / 2 + (unsigned int)((r->seed >> 16) % (r->delay_ms / 2 + 1));
+    TimerCountdownMS(&r->timer, wait);
+    r->delay_ms = (r->delay_ms > r->max_ms / 2) ? r->max_ms : r->delay_ms * 2;
+}
+
+
+/* the server lost the session, subscribe to the filters of the handlers again */
+static int resubscribe(MQTTClient* c)
+{
+    const char* topicFilters[MAX_SUBSCRIBE_FILTERS];
+    enum QoS qoss[MAX_SUBSCRIBE_FILTERS];
+    messageHandler messageHandlers[MAX_SUBSCRIBE_FILTERS];
+    MQTTSubackData data[MAX_SUBSCRIBE_FILTERS];
+    int count = 0;
+    int rc = SUCCESS;
+    int i;
+
+    for (i = 0; i < MAX_MESSAGE_HANDLERS && rc == SUCCESS; ++i)
+    {
+        /* handlers set with MQTTSetMessageHandler alone were not subscribed here */
+        if (c->messageHandlers[i].topicFilter == NULL || c->messageHandlers[i].qos == SUBFAIL)
+            continue;
+        topicFilters[count] = c->messageHandlers[i].topicFilter;
+        qoss[count] = c->messageHandlers[i].qos;
+        messageHandlers[count] = c->messageHandlers[i].fp;
+        if (++count == MAX_SUBSCRIBE_FILTERS)
+        {
+            rc = subscribeMany(c, count, topicFilters, qoss, messageHandlers, data);
+            count = 0;
+        }
+    }
+    if (rc == SUCCESS && count > 0)
+        rc = subscribeMany(c, count, topicFilters, qoss, messageHandlers, data);
+    return rc;
+}
+
+
+/* connect the network and resume the session, with the lock held */
+static int reconnect(MQTTClient* c)
+{
+    struct Reconnect* r = &c->reconnect;
+    MQTTConnackData data = {0, 0};
+    char* host = r->host;
+    int port = r->port;
+    int rc = FAILURE;
+    int net;
+
+#if defined(MQTT_TASK)
+    /* the other threads publish and fail at once meanwhile, MQTTConnect must not send on it */
+    c->connecting = 1;
+    if (c->task)
+        MutexUnlock(&c->mutex);
+#endif
+    NetworkDisconnect(c->ipstack);
+    net = NetworkConnect(c->ipstack, host, port);
+#if defined(MQTT_TASK)
+    if (c->task)
+        MutexLock(&c->mutex);
+    c->connecting = 0;
+    if (r->host == NULL) /* MQTTDisconnect meanwhile */
+    {
+        NetworkDisconnect(c->ipstack);
+        return FAILURE;
+    }
+#endif
+    if (net == 0)
+        rc = connectSession(c, &r->options, &data); /* sends the in-flight messages again */
+    if (rc == SUCCESS && !data.sessionPresent)
+        rc = resubscribe(c);
+
+    if (rc != SUCCESS)
+    {
+        if (c->isconnected)
+            MQTTCloseSession(c);
+        NetworkDisconnect(c->ipstack);
+        backoff(c);
+        return FAILURE;
+    }
+    if (r->fp != NULL)
+        r->fp(r->context, data.sessionPresent);
+    return SUCCESS;
+}
+
+
+/* with the session down, wait up to timeout_ms for the next attempt and make it when it is due */
+static int supervise(MQTTClient* c, int timeout_ms)
+{
+    struct Reconnect* r = &c->reconnect;
+
+    if (r->delay_ms == 0)
+    {
+        /* just dropped: not at once either, a whole fleet may have dropped with it */
+        r->delay_ms = r->min_ms;
+        backoff(c);
+    }
+    if (!TimerIsExpired(&r->timer))
+    {
+        int left = TimerLeftMS(&r->timer);
+
+        if (left > timeout_ms)
+            left = timeout_ms;
+#if defined(MQTT_TASK)
+        if (c->task)
+            CondWait(&c->cond, &c->mutex, left); /* MQTTConnect on another thread ends it */
+        else
+#endif
+        TimerSleepMS(left);
+        if (c->isconnected)
+            return SUCCESS;
+        if (!TimerIsExpired(&r->timer))
+            return FAILURE;
+    }
+    return reconnect(c);
+}
+
+
+int MQTTUnsubscribeMany(MQTTClient* c, int count, const char* topicFilters[])
 {
     int rc = FAILURE;
     Timer timer;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
     int len = 0;
+    int i;
+    unsigned short id;
+#if defined(MQTT_TASK)
+    struct Completion w = {0, FAILURE};
+    struct PendingRequest* p = NULL;
+#endif
+
+    if (count <= 0 || count > MAX_SUBSCRIBE_FILTERS || c->nonblocking)
+        return FAILURE;
 
 #if defined(MQTT_TASK)
 	  MutexLock(&c->mutex);
@@ -605,18 +1553,34 @@ int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic)) <= 0)
+#if defined(MQTT_TASK)
+    /* the receive thread handles the unsuback, see ackRequest */
+    if (c->task && (p = findPending(c, 0, 0)) == NULL)
+        goto exit;
+#endif
+    id = getNextPacketId(c);
+    if ((len = serializeUnsubscribe(c, id, count, topicFilters)) <= 0)
         goto exit;
     if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
         goto exit; // there was a problem
 
+#if defined(MQTT_TASK)
+    if (c->task)
+    {
+        addPending(c, p, UNSUBSCRIBE, id, count, topicFilters, NULL, NULL, onRequestComplete, &w);
+        rc = waitRequest(c, &w, &timer);
+        goto exit;
+    }
+#endif
+
     if (waitfor(c, UNSUBACK, &timer) == UNSUBACK)
     {
         unsigned short mypacketid;  // should be the same as the packetid above
         if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
         {
-            /* remove the subscription message handler associated with this topic, if there is one */
-            MQTTSetMessageHandler(c, topicFilter, NULL);
+            /* remove the subscription message handlers associated with these topics, if there are any */
+            for (i = 0; i < count; ++i)
+                MQTTSetMessageHandler(c, topicFilters[i], NULL);
         }
     }
     else
@@ -632,68 +1596,592 @@ exit:
 }
 
 
-int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
 {
-    int rc = FAILURE;
-    Timer timer;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicName;
-    int len = 0;
-
-#if defined(MQTT_TASK)
-	  MutexLock(&c->mutex);
-#endif
-	  if (!c->isconnected)
-		    goto exit;
+    return MQTTUnsubscribeMany(c, 1, &topicFilter);
+}
 
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, c->command_timeout_ms);
 
+/* send a publish, QoS 1 and 2 ones take a slot of the in-flight window */
+static int publish(MQTTClient* c, const char* topicName, MQTTMessage* message,
+    payloadReader reader, void* readerContext, publishCompleteHandler handler, void* context, Timer* timer)
+{
+    struct InflightMessage* m = NULL;
+    int rc = FAILURE;
+
+    if (c->nonblocking && c->resending < MAX_INFLIGHT_MESSAGES)
+        return BUFFER_OVERFLOW; /* after the messages of the previous connection */
     if (message->qos == QOS1 || message->qos == QOS2)
+    {
+        /* with the window full, handle incoming acks until a slot frees */
+        while ((m = findInflight(c, 0)) == NULL)
+        {
+            if (c->nonblocking)
+                return BUFFER_OVERFLOW; /* MQTTOnReadable frees slots */
+            if (TimerIsExpired(timer) || progress(c, timer) < 0)
+                goto exit;
+        }
         message->id = getNextPacketId(c);
+        m->id = message->id;
+        m->waitfor = (message->qos == QOS1) ? PUBACK : PUBREC;
+        m->topicName = topicName;
+        m->message = *message;
+        m->reader = reader;
+        m->readerContext = readerContext;
+        m->fp = handler;
+        m->context = context;
+        c->inflight_count++;
+    }
 
-    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
-              topic, (unsigned char*)message->payload, message->payloadlen);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
+    rc = sendPublish(c, topicName, message, reader, readerContext, 0, timer);
+    if (rc != SUCCESS && m != NULL)
+    {
+        /* not sent, the caller keeps the message */
+        m->id = 0;
+        c->inflight_count--;
+    }
+
+exit:
+    return rc;
+}
+
+
+int MQTTPublishAsync(MQTTClient* c, const char* topicName, MQTTMessage* message,
+    publishCompleteHandler handler, void* context)
+{
+    int rc = FAILURE;
+    Timer timer;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+	  if (!c->isconnected)
+		    goto exit;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+
+    rc = publish(c, topicName, message, NULL, NULL, handler, context, &timer);
+
+exit:
+    if (rc == FAILURE)
+        MQTTCloseSession(c);
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTInflightCount(MQTTClient* c)
+{
+    return c->inflight_count;
+}
+
+
+static void onPublishComplete(void* context, unsigned short id, int rc)
+{
+    (void)id;
+    *(int*)context = (rc == SUCCESS) ? 1 : -1;
+}
+
+
+static int publishAndWait(MQTTClient* c, const char* topicName, MQTTMessage* message,
+    payloadReader reader, void* readerContext)
+{
+    int rc = FAILURE;
+    Timer timer;
+    int done = 0;
+
+    if (c->nonblocking)
+        return FAILURE;
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+	  if (!c->isconnected)
+		    goto exit;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+
+    if ((rc = publish(c, topicName, message, reader, readerContext, onPublishComplete, &done, &timer)) != SUCCESS)
         goto exit; // there was a problem
 
-    if (message->qos == QOS1)
+    if (message->qos == QOS1 || message->qos == QOS2)
     {
-        if (waitfor(c, PUBACK, &timer) == PUBACK)
+        /* other publishes may complete meanwhile, this one is tracked by its id */
+        while (done == 0 && !TimerIsExpired(&timer))
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
+            if (progress(c, &timer) < 0)
+                break;
         }
+        if (done != 1)
+        {
+            struct InflightMessage* m = findInflight(c, message->id);
+            if (m != NULL && m->context == &done)
+            {
+                /* the message does not outlive this call, it is not sent again */
+                m->id = 0;
+                c->inflight_count--;
+            }
+            rc = FAILURE;
+        }
+    }
+
+exit:
+    if (rc == FAILURE)
+        MQTTCloseSession(c);
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+static void onQueuedComplete(void* context, unsigned short id, int rc)
+{
+    (void)rc;
+    MQTTQueueAcked((MQTTQueue*)context, id);
+}
+
+
+/* send queued messages while the in-flight window has room */
+static int flushQueue(MQTTClient* c, Timer* timer)
+{
+    MQTTQueueEntry* e;
+    int rc = SUCCESS;
+
+    while (c->inflight_count < MAX_INFLIGHT_MESSAGES && (e = MQTTQueueNext(c->queue)) != NULL)
+    {
+        MQTTMessage message;
+
+        message.qos = (enum QoS)e->qos;
+        message.retained = e->retained;
+        message.dup = 0;
+        message.id = 0;
+        message.payload = MQTTQueuePayload(e);
+        message.payloadlen = e->payloadlen;
+        if ((rc = publish(c, MQTTQueueTopic(e), &message, NULL, NULL, onQueuedComplete, c->queue, timer)) != SUCCESS)
+            break;
+        MQTTQueueSent(c->queue, e, (message.qos == QOS0) ? 0 : message.id);
+    }
+    if (rc == BUFFER_OVERFLOW)
+        rc = SUCCESS; /* the send queue is full, the rest goes from MQTTOnWritable */
+    return rc;
+}
+
+
+void MQTTSetQueue(MQTTClient* c, MQTTQueue* queue)
+{
+    c->queue = queue;
+}
+
+
+int MQTTPublishQueued(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    int rc = FAILURE;
+    Timer timer;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    if (c->queue == NULL)
+        goto exit;
+    if (message->qos == QOS0 && !c->queue->qos0)
+    {
+        /* not kept, sent now or lost */
+        if (!c->isconnected)
+            goto exit;
+        TimerInit(&timer);
+        TimerCountdownMS(&timer, c->command_timeout_ms);
+        if ((rc = publish(c, topicName, message, NULL, NULL, NULL, NULL, &timer)) == FAILURE)
+            MQTTCloseSession(c);
+        goto exit;
+    }
+
+    if (MQTTQueuePush(c->queue, topicName, message->qos, message->retained,
+            message->payload, message->payloadlen) != 0)
+        goto exit; // dropped by the limits of the queue
+    rc = SUCCESS;
+
+    if (c->isconnected)
+    {
+        TimerInit(&timer);
+        TimerCountdownMS(&timer, c->command_timeout_ms);
+        if (flushQueue(c, &timer) != SUCCESS)
+            MQTTCloseSession(c); // the message stays queued for the next connection
+    }
+
+exit:
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    return publishAndWait(c, topicName, message, NULL, NULL);
+}
+
+
+int MQTTPublishFrom(MQTTClient* c, const char* topicName, MQTTMessage* message,
+    payloadReader reader, void* context)
+{
+    return publishAndWait(c, topicName, message, reader, context);
+}
+
+
+/* MQTTTransport getfn: what has arrived, in reads the platform serves whole or not at all */
+static int readNonBlocking(void* sck, unsigned char* buf, int len)
+{
+    MQTTClient* c = (MQTTClient*)sck;
+    int rc = c->ipstack->mqttread(c->ipstack, buf, (len < MAX_NONBLOCKING_READ) ? len : MAX_NONBLOCKING_READ, 0);
+
+    return (rc < 0) ? -1 : rc;
+}
+
+
+void MQTTSetNonBlocking(MQTTClient* c, unsigned char* sendq, size_t size)
+{
+    c->nonblocking = (sendq != NULL);
+    c->sendq = sendq;
+    c->sendq_size = (sendq != NULL) ? size : 0;
+    c->sendq_start = c->sendq_end = 0;
+    memset(&c->transport, 0, sizeof(c->transport));
+    c->transport.getfn = readNonBlocking;
+    c->transport.sck = c;
+    c->streaming = 0;
+}
+
+
+/* the request of this type waiting for the ack with this id, type 0 finds a free slot */
+static struct PendingRequest* findPending(MQTTClient* c, unsigned char type, unsigned short id)
+{
+    int i;
+
+    for (i = 0; i < MAX_PENDING_REQUESTS; ++i)
+    {
+        if (c->pending[i].type == type && (type == 0 || c->pending[i].id == id))
+            return &c->pending[i];
+    }
+    return NULL;
+}
+
+
+static void addPending(MQTTClient* c, struct PendingRequest* p, unsigned char type, unsigned short id,
+    int count, const char** topicFilters, messageHandler* messageHandlers, void* data,
+    requestCompleteHandler fp, void* context)
+{
+    p->type = type;
+    p->id = id;
+    p->count = count;
+    p->topicFilters = topicFilters;
+    p->messageHandlers = messageHandlers;
+    p->data = data;
+    p->fp = fp;
+    p->context = context;
+    TimerInit(&p->timer);
+    TimerCountdownMS(&p->timer, c->command_timeout_ms);
+}
+
+
+static void completeRequest(MQTTClient* c, struct PendingRequest* p, int rc)
+{
+    requestCompleteHandler fp = p->fp;
+    void* context = p->context;
+    unsigned short id = p->id;
+
+    (void)c;
+    p->type = 0;    /* free before the handler, which may send the next request */
+    if (fp != NULL)
+        fp(context, id, rc);
+}
+
+
+/* after the connack: the messages of the previous connection, then the queue */
+static int sendBacklog(MQTTClient* c, Timer* timer)
+{
+    int rc = resendInflight(c, timer);
+
+    if (rc == BUFFER_OVERFLOW)
+        return SUCCESS; /* goes on from MQTTOnWritable */
+    if (rc == SUCCESS && c->queue)
+        rc = flushQueue(c, timer);
+    return rc;
+}
+
+
+/* complete the request a CONNACK, SUBACK or UNSUBACK in readbuf answers */
+static int ackRequest(MQTTClient* c, int packet_type, Timer* timer)
+{
+    struct PendingRequest* p;
+    unsigned short mypacketid;
+    int rc = SUCCESS;
+    int i;
+
+    if (packet_type == CONNACK)
+    {
+        MQTTConnackData data = {0, 0};
+
+        if ((p = findPending(c, CONNECT, 0)) == NULL)
+            return SUCCESS;
+        if (MQTTDeserialize_connack(&data.sessionPresent, &data.rc, c->readbuf, c->readbuf_size) == 1)
+            rc = data.rc;
         else
             rc = FAILURE;
+        if (p->data != NULL)
+            *(MQTTConnackData*)p->data = data;
+        if (rc == SUCCESS)
+        {
+            restartInflight(c, data.sessionPresent);
+            connected(c);
+            rc = sendBacklog(c, timer);
+        }
     }
-    else if (message->qos == QOS2)
+    else if (packet_type == SUBACK)
     {
-        if (waitfor(c, PUBCOMP, &timer) == PUBCOMP)
+        int granted[MAX_SUBSCRIBE_FILTERS];
+        int granted_count = 0;
+
+        if (MQTTDeserialize_suback(&mypacketid, MAX_SUBSCRIBE_FILTERS, &granted_count, granted,
+                c->readbuf, c->readbuf_size) != 1)
+            return FAILURE;
+        if ((p = findPending(c, SUBSCRIBE, mypacketid)) == NULL)
+            return SUCCESS;
+        if (granted_count != p->count)
+            rc = FAILURE;
+        for (i = 0; rc == SUCCESS && i < p->count; ++i)
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+            MQTTSubackData* data = (MQTTSubackData*)p->data;
+
+            data[i].grantedQoS = (enum QoS)(granted[i] & 0xff); /* read as a signed char */
+            if (data[i].grantedQoS != SUBFAIL &&
+                setMessageHandler(c, p->topicFilters[i], p->messageHandlers[i], data[i].grantedQoS) != SUCCESS)
                 rc = FAILURE;
         }
-        else
+    }
+    else
+    {
+        if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) != 1)
+            return FAILURE;
+        if ((p = findPending(c, UNSUBSCRIBE, mypacketid)) == NULL)
+            return SUCCESS;
+        for (i = 0; i < p->count; ++i)
+            MQTTSetMessageHandler(c, p->topicFilters[i], NULL);
+    }
+
+    completeRequest(c, p, rc);
+    return (rc == SUCCESS) ? SUCCESS : FAILURE;
+}
+
+
+int MQTTConnectAsync(MQTTClient* c, MQTTPacket_connectData* options, MQTTConnackData* data,
+    requestCompleteHandler handler, void* context)
+{
+    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
+    struct PendingRequest* p;
+    Timer timer;
+    int len = 0;
+    int rc;
+
+    if (!c->nonblocking || c->isconnected || findPending(c, CONNECT, 0) != NULL ||
+        (p = findPending(c, 0, 0)) == NULL)
+        return FAILURE;
+    if (options == 0)
+        options = &default_options; /* set default options if none were supplied */
+
+    /* nothing of the previous connection is left to send or read */
+    c->sendq_start = c->sendq_end = 0;
+    c->transport.state = 0;
+
+    c->keepAliveInterval = options->keepAliveInterval;
+    c->cleansession = options->cleansession;
+    TimerCountdown(&c->last_received, c->keepAliveInterval);
+    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+        return FAILURE;
+    TimerInit(&timer);
+    if ((rc = sendPacket(c, len, &timer)) != SUCCESS)
+        return rc;
+    addPending(c, p, CONNECT, 0, 0, NULL, NULL, data, handler, context);
+    return SUCCESS;
+}
+
+
+int MQTTSubscribeAsync(MQTTClient* c, int count, const char* topicFilters[], enum QoS qoss[],
+    messageHandler messageHandlers[], MQTTSubackData data[], requestCompleteHandler handler, void* context)
+{
+    struct PendingRequest* p;
+    unsigned short id;
+    Timer timer;
+    int len = 0;
+    int rc;
+
+    if (!c->nonblocking || !c->isconnected || count <= 0 || count > MAX_SUBSCRIBE_FILTERS)
+        return FAILURE;
+    if ((p = findPending(c, 0, 0)) == NULL)
+        return BUFFER_OVERFLOW;
+
+    id = getNextPacketId(c);
+    if ((len = serializeSubscribe(c, id, count, topicFilters, qoss)) <= 0)
+        return FAILURE;
+    TimerInit(&timer);
+    if ((rc = sendPacket(c, len, &timer)) != SUCCESS)
+    {
+        if (rc == FAILURE)
+            MQTTCloseSession(c);
+        return rc;
+    }
+    addPending(c, p, SUBSCRIBE, id, count, topicFilters, messageHandlers, data, handler, context);
+    return SUCCESS;
+}
+
+
+int MQTTUnsubscribeAsync(MQTTClient* c, int count, const char* topicFilters[],
+    requestCompleteHandler handler, void* context)
+{
+    struct PendingRequest* p;
+    unsigned short id;
+    Timer timer;
+    int len = 0;
+    int rc;
+
+    if (!c->nonblocking || !c->isconnected || count <= 0 || count > MAX_SUBSCRIBE_FILTERS)
+        return FAILURE;
+    if ((p = findPending(c, 0, 0)) == NULL)
+        return BUFFER_OVERFLOW;
+
+    id = getNextPacketId(c);
+    if ((len = serializeUnsubscribe(c, id, count, topicFilters)) <= 0)
+        return FAILURE;
+    TimerInit(&timer);
+    if ((rc = sendPacket(c, len, &timer)) != SUCCESS)
+    {
+        if (rc == FAILURE)
+            MQTTCloseSession(c);
+        return rc;
+    }
+    addPending(c, p, UNSUBSCRIBE, id, count, topicFilters, NULL, NULL, handler, context);
+    return SUCCESS;
+}
+
+
+int MQTTOnReadableMax(MQTTClient* c, int max_packets)
+{
+    int rc = SUCCESS;
+    int handled = 0;
+    Timer timer;    /* not used for waiting in non-blocking mode */
+
+    TimerInit(&timer);
+    while (max_packets <= 0 || handled < max_packets)
+    {
+        int state = c->transport.state;
+        int len = c->transport.len;
+        int packet_type = MQTTPacket_readnb(c->readbuf, (int)c->readbuf_size, &c->transport);
+
+        if (packet_type < 0) /* a read error, or a packet larger than readbuf */
+        {
             rc = FAILURE;
+            break;
+        }
+        if (packet_type == 0)
+        {
+            if (c->transport.state == state && c->transport.len == len)
+                break;  /* nothing more has arrived */
+            continue;
+        }
+        packetReceived(c);
+        handled++;
+        if (handlePacket(c, packet_type, &timer) != SUCCESS)
+        {
+            rc = FAILURE;
+            break;
+        }
     }
 
-exit:
-    if (rc == FAILURE)
+    if (rc != SUCCESS)
+        MQTTCloseSession(c);
+    return rc;
+}
+
+
+int MQTTOnReadable(MQTTClient* c)
+{
+    return MQTTOnReadableMax(c, 0);
+}
+
+
+int MQTTOnWritable(MQTTClient* c)
+{
+    int rc = flushSendQueue(c);
+    Timer timer;
+
+    TimerInit(&timer);
+    if (rc == SUCCESS && c->isconnected)
+    {
+        rc = sendBacklog(c, &timer);
+        if (rc == SUCCESS && keepalive(c) == FAILURE) /* a ping the full queue held back */
+            rc = FAILURE;
+    }
+    if (rc != SUCCESS)
         MQTTCloseSession(c);
-#if defined(MQTT_TASK)
-	  MutexUnlock(&c->mutex);
-#endif
     return rc;
 }
 
 
+int MQTTOnTimer(MQTTClient* c)
+{
+    int rc = SUCCESS;
+    int i;
+
+    for (i = 0; i < MAX_PENDING_REQUESTS; ++i)
+    {
+        /* the blocking calls close the session when the ack does not come, so do these */
+        if (c->pending[i].type != 0 && TimerIsExpired(&c->pending[i].timer))
+            rc = FAILURE;
+    }
+    if (rc == SUCCESS && c->isconnected && keepalive(c) == FAILURE)
+        rc = FAILURE;   /* BUFFER_OVERFLOW leaves the ping to MQTTOnWritable */
+    if (rc != SUCCESS)
+        MQTTCloseSession(c);
+    return rc;
+}
+
+
+int MQTTWantsWrite(MQTTClient* c)
+{
+    return c->sendq_start != c->sendq_end;
+}
+
+
+int MQTTNextTimeoutMS(MQTTClient* c)
+{
+    unsigned long now = TimerNowMS();
+    long next = -1;
+    int i;
+
+    /* a ping held back by a full send queue waits for MQTTOnWritable */
+    if (c->isconnected && c->keepAliveInterval > 0 && (c->ping_outstanding || !MQTTWantsWrite(c)))
+    {
+        if (c->wheel)
+            next = c->ping_due ? 0 : timerwheel_next(c->wheel, now);
+        else
+        {
+            int sent = TimerLeftMS(&c->last_sent);
+            int received = TimerLeftMS(&c->last_received);
+            next = (sent < received) ? sent : received;
+        }
+    }
+    for (i = 0; i < MAX_PENDING_REQUESTS; ++i)
+    {
+        if (c->pending[i].type != 0 && (next < 0 || TimerLeftMS(&c->pending[i].timer) < next))
+            next = TimerLeftMS(&c->pending[i].timer);
+    }
+    return (int)next;
+}
+
+
 int MQTTDisconnect(MQTTClient* c)
 {
     int rc = FAILURE;
@@ -709,6 +2197,7 @@ int MQTTDisconnect(MQTTClient* c)
 	  len = MQTTSerialize_disconnect(c->buf, c->buf_size);
     if (len > 0)
         rc = sendPacket(c, len, &timer);            // send the disconnect packet
+    c->reconnect.host = NULL;   /* closed on purpose, not to be reconnected */
     MQTTCloseSession(c);
 
 #if defined(MQTT_TASK)
@@ -35,6 +35,8 @@
 #endif
 
 #include "MQTTPacket.h"
+#include "timerwheel.h"
+#include "MQTTQueue.h"
 
 #if defined(MQTTCLIENT_PLATFORM_HEADER)
 /* The following sequence of macros converts the MQTTCLIENT_PLATFORM_HEADER value
@@ -51,6 +53,28 @@
 #define MAX_MESSAGE_HANDLERS 5 /* redefinable - how many subscriptions do you want? */
 #endif
 
+#if !defined(MAX_TOPIC_NODES)
+#define MAX_TOPIC_NODES (MAX_MESSAGE_HANDLERS * 4) /* redefinable - levels of all subscriptions, shared prefixes count once */
+#endif
+
+#include "MQTTTopicTrie.h"
+
+#if !defined(MAX_SUBSCRIBE_FILTERS)
+#define MAX_SUBSCRIBE_FILTERS 32 /* redefinable - topic filters in one subscribe or unsubscribe packet */
+#endif
+
+#if !defined(MAX_INFLIGHT_MESSAGES)
+#define MAX_INFLIGHT_MESSAGES 16 /* redefinable - QoS 1 and 2 publishes awaiting their acks */
+#endif
+
+#if !defined(MAX_PENDING_REQUESTS)
+#define MAX_PENDING_REQUESTS 4 /* redefinable - connect, subscribe and unsubscribe requests of the non-blocking mode awaiting their acks */
+#endif
+
+#if !defined(MAX_NONBLOCKING_READ)
+#define MAX_NONBLOCKING_READ 64 /* redefinable - largest read of the non-blocking mode, the platform serves it whole or not at all */
+#endif
+
 enum QoS { QOS0, QOS1, QOS2, SUBFAIL=0x80 };
 
 /* all failure return codes must be negative */
@@ -63,6 +87,8 @@ typedef struct Network
 {
 	int (*mqttread)(Network*, unsigned char* read_buffer, int, int);
 	int (*mqttwrite)(Network*, unsigned char* send_buffer, int, int);
+	int (*mqttwritev)(Network*, const socket_iovec*, int, int); // returns the bytes written
+	int (*mqttpoll)(Network*, int timeout_ms); // > 0 when data can be read
 } Network;*/
 
 /* The Timer structure must be defined in the platform specific header,
@@ -72,6 +98,10 @@ extern char TimerIsExpired(Timer*);
 extern void TimerCountdownMS(Timer*, unsigned int);
 extern void TimerCountdown(Timer*, unsigned int);
 extern int TimerLeftMS(Timer*);
+/* milliseconds of the platform monotonic clock, the clock of the timer wheel */
+extern unsigned long TimerNowMS(void);
+/* wait with no socket to poll, between reconnect attempts */
+extern void TimerSleepMS(int);
 
 typedef struct MQTTMessage
 {
@@ -102,6 +132,23 @@ typedef struct MQTTSubackData
 
 typedef void (*messageHandler)(MessageData*);
 
+/* called for a publish larger than the read buffer: once with the topic and an empty payload,
+ * then for each chunk of payload, which starts offset bytes into the total */
+typedef void (*streamHandler)(MessageData*, size_t offset, size_t total);
+
+/* fill buf with up to len bytes of the payload from offset on, return the count, <= 0 to abort.
+ * the same range may be asked for again when the publish is sent again */
+typedef int (*payloadReader)(void* context, size_t offset, unsigned char* buf, int len);
+
+/* called once per asynchronous publish, with SUCCESS when the last ack arrived */
+typedef void (*publishCompleteHandler)(void* context, unsigned short id, int rc);
+
+/* called once per request of the non-blocking mode, rc is the connack return code for a connect */
+typedef void (*requestCompleteHandler)(void* context, unsigned short id, int rc);
+
+/* called when the supervisor has the session back, subscribed again when the server had lost it */
+typedef void (*reconnectHandler)(void* context, unsigned char sessionPresent);
+
 typedef struct MQTTClient
 {
     unsigned int next_packetid,
@@ -119,15 +166,72 @@ typedef struct MQTTClient
     {
         const char* topicFilter;
         void (*fp) (MessageData*);
+        enum QoS qos;   /* granted, subscribed again with; SUBFAIL when not subscribed by the client */
+        short next;     /* the next handler whose filter ends at the same trie node */
     } messageHandlers[MAX_MESSAGE_HANDLERS];      /* Message handlers are indexed by subscription topic */
+    MQTTTopicTrie topics;                         /* filters by level, to the first of their handlers */
 
     void (*defaultMessageHandler) (MessageData*);
+    streamHandler streamHandler;    /* publishes too large for readbuf, dropped when NULL */
+    char streaming;                 /* the publish in readbuf is only its header */
+
+    struct InflightMessage
+    {
+        unsigned short id;      /* 0 when the slot is free */
+        unsigned char waitfor;  /* PUBACK, PUBREC or PUBCOMP */
+        const char* topicName;
+        MQTTMessage message;
+        payloadReader reader;   /* the payload comes from it when set */
+        void* readerContext;
+        publishCompleteHandler fp;
+        void* context;
+    } inflight[MAX_INFLIGHT_MESSAGES];  /* sent QoS 1 and 2 publishes, by packet id */
+    int inflight_count;
+    int resending;                  /* the next in-flight slot to send again after a reconnect */
+    MQTTQueue* queue;               /* optional, holds messages of MQTTPublishQueued */
 
     Network* ipstack;
     Timer last_sent, last_received;
+
+    timerwheel* wheel;              /* optional, keepalive is scheduled on it when set */
+    timerwheel_timer ping_timer;
+    unsigned long sent_ms, received_ms;
+    char ping_due;
+
+    char nonblocking;               /* driven by MQTTOnReadable, MQTTOnWritable and MQTTOnTimer */
+    MQTTTransport transport;        /* the packet being read in readbuf */
+    unsigned char* sendq;           /* bytes the socket did not take yet */
+    size_t sendq_size, sendq_start, sendq_end;
+    struct PendingRequest
+    {
+        unsigned char type;     /* CONNECT, SUBSCRIBE or UNSUBSCRIBE, 0 when the slot is free */
+        unsigned short id;
+        int count;
+        const char** topicFilters;
+        messageHandler* messageHandlers;
+        void* data;             /* MQTTConnackData, or MQTTSubackData of each filter */
+        requestCompleteHandler fp;
+        void* context;
+        Timer timer;
+    } pending[MAX_PENDING_REQUESTS];
+    struct Reconnect
+    {
+        char* host;             /* NULL when the session is not supervised */
+        int port;
+        MQTTPacket_connectData options;
+        unsigned int min_ms, max_ms;
+        unsigned int delay_ms;  /* doubled after each failed attempt, 0 while connected */
+        unsigned long seed;     /* of the jitter */
+        Timer timer;            /* the next attempt */
+        reconnectHandler fp;
+        void* context;
+    } reconnect;
 #if defined(MQTT_TASK)
     Mutex mutex;
     Thread thread;
+    Cond cond;                      /* broadcast by the receive thread as it handles packets */
+    char task;                      /* the receive thread reads the socket */
+    char connecting;                /* the receive thread connects the network without the lock */
 #endif
 } MQTTClient;
 
@@ -144,6 +248,25 @@ typedef struct MQTTClient
 DLLExport void MQTTClientInit(MQTTClient* client, Network* network, unsigned int command_timeout_ms,
 		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size);
 
+/** MQTT SetStreamHandler - receive publishes larger than the read buffer in chunks. The
+ *  topic has to fit in the read buffer, the payload is read into the rest of it and handed
+ *  to the handler piece by piece, so it can be any size. Acks are sent once the handler has
+ *  had the last chunk. Without a stream handler such publishes are skipped and the session
+ *  is closed, as before.
+ *  @param client - the client object to use
+ *  @param handler - the handler, or NULL
+ */
+DLLExport void MQTTSetStreamHandler(MQTTClient* client, streamHandler handler);
+
+/** MQTT SetTimerWheel - schedule the keepalive of this client on a timer wheel
+ *  instead of checking its timers on every cycle. The wheel uses TimerNowMS() and
+ *  may be shared by several clients; it is advanced by the client as it runs, and an
+ *  event loop can sleep for timerwheel_next() before calling MQTTYield.
+ *  @param client - the client object to use
+ *  @param wheel - the timer wheel, or NULL to go back to polling
+ */
+DLLExport void MQTTSetTimerWheel(MQTTClient* client, timerwheel* wheel);
+
 /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
  *  The nework object must be connected to the network endpoint before calling this
  *  @param options - connect options
@@ -167,6 +290,58 @@ DLLExport int MQTTConnect(MQTTClient* client, MQTTPacket_connectData* options);
  */
 DLLExport int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
 
+/** MQTT Publish From - like MQTTPublish, with the payload pulled from a reader into the send
+ *  buffer chunk by chunk, so it can be larger than the buffer.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send, payloadlen is the total and payload is not used
+ *  @param reader - supplies the payload
+ *  @param context - passed to the reader
+ *  @return success code
+ */
+DLLExport int MQTTPublishFrom(MQTTClient* client, const char* topic, MQTTMessage* message,
+    payloadReader reader, void* context);
+
+/** MQTT Publish Async - send an MQTT publish packet and return without waiting for its acks.
+ *  Up to MAX_INFLIGHT_MESSAGES QoS 1 and 2 publishes can be unacknowledged at a time; when the
+ *  window is full this call handles incoming packets until a slot frees or the command timeout.
+ *  The topic and payload must stay valid until the handler is called: the message is sent again,
+ *  with DUP set, when the client reconnects before it was acknowledged.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send, its id is set for QoS 1 and 2
+ *  @param handler - called on PUBACK or PUBCOMP, may be NULL
+ *  @param context - passed to the handler
+ *  @return success code
+ */
+DLLExport int MQTTPublishAsync(MQTTClient* client, const char* topic, MQTTMessage* message,
+    publishCompleteHandler handler, void* context);
+
+/** MQTT Inflight Count - the number of QoS 1 and 2 publishes not acknowledged yet
+ *  @param client - the client object to use
+ *  @return the count
+ */
+DLLExport int MQTTInflightCount(MQTTClient* client);
+
+/** MQTT SetQueue - keep the messages of MQTTPublishQueued in a queue until the server
+ *  has them. Queued messages are sent as the in-flight window allows, after MQTTConnect
+ *  and from MQTTYield, and those sent but not acknowledged when the connection dropped are
+ *  sent again on reconnect. The queue is used by the thread that runs the client.
+ *  @param client - the client object to use
+ *  @param queue - the queue, or NULL
+ */
+DLLExport void MQTTSetQueue(MQTTClient* client, MQTTQueue* queue);
+
+/** MQTT Publish Queued - copy a message to the queue and send what the window allows.
+ *  QoS 0 messages are only queued when the queue keeps them, otherwise they are sent
+ *  right away or fail while disconnected.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send
+ *  @return success code, SUCCESS once the message is queued even if the connection is down
+ */
+DLLExport int MQTTPublishQueued(MQTTClient* client, const char* topic, MQTTMessage* message);
+
 /** MQTT SetMessageHandler - set or remove a per topic message handler
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter set the message handler for
@@ -192,6 +367,19 @@ DLLExport int MQTTSubscribe(MQTTClient* client, const char* topicFilter, enum Qo
  */
 DLLExport int MQTTSubscribeWithResults(MQTTClient* client, const char* topicFilter, enum QoS, messageHandler, MQTTSubackData* data);
 
+/** MQTT Subscribe Many - send one MQTT subscribe packet for several topic filters and wait for
+ *  the suback before returning.
+ *  @param client - the client object to use
+ *  @param count - the number of filters, at most MAX_SUBSCRIBE_FILTERS
+ *  @param topicFilters - the topic filters to subscribe to
+ *  @param qoss - the requested QoS of each filter
+ *  @param messageHandlers - the handler of each filter
+ *  @param data - the granted QoS of each filter, SUBFAIL for those refused
+ *  @return success code
+ */
+DLLExport int MQTTSubscribeMany(MQTTClient* client, int count, const char* topicFilters[], enum QoS qoss[],
+    messageHandler messageHandlers[], MQTTSubackData data[]);
+
 /** MQTT Subscribe - send an MQTT unsubscribe packet and wait for unsuback before returning.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to unsubscribe from
@@ -199,12 +387,40 @@ DLLExport int MQTTSubscribeWithResults(MQTTClient* client, const char* topicFilt
  */
 DLLExport int MQTTUnsubscribe(MQTTClient* client, const char* topicFilter);
 
+/** MQTT Unsubscribe Many - send one MQTT unsubscribe packet for several topic filters and wait
+ *  for the unsuback before returning.
+ *  @param client - the client object to use
+ *  @param count - the number of filters, at most MAX_SUBSCRIBE_FILTERS
+ *  @param topicFilters - the topic filters to unsubscribe from
+ *  @return success code
+ */
+DLLExport int MQTTUnsubscribeMany(MQTTClient* client, int count, const char* topicFilters[]);
+
 /** MQTT Disconnect - send an MQTT disconnect packet and close the connection
+ *  It stops the reconnects of MQTTSetReconnect.
  *  @param client - the client object to use
  *  @return success code
  */
 DLLExport int MQTTDisconnect(MQTTClient* client);
 
+/** MQTT Set Reconnect - bring a dropped session back, from MQTTYield or the receive thread.
+ *  The network is connected again and the session resumed with cleansession 0: the filters of
+ *  the handlers are subscribed again only when the connack says the server lost the session,
+ *  and in-flight messages are sent again. Attempts wait a random part of a delay doubling from
+ *  min_ms up to max_ms, so a fleet dropped by the same outage does not come back at once.
+ *  The handlers are kept when the session closes, even a clean one. Blocking mode only.
+ *  @param client - the client object to use
+ *  @param host - the server, must stay valid, NULL stops reconnecting
+ *  @param port - its port
+ *  @param options - connect options, copied; their strings must stay valid
+ *  @param min_ms - the first delay
+ *  @param max_ms - the longest delay
+ *  @param handler - called once the session is back, may be NULL
+ *  @param context - for the handler
+ */
+DLLExport void MQTTSetReconnect(MQTTClient* client, char* host, int port, MQTTPacket_connectData* options,
+    unsigned int min_ms, unsigned int max_ms, reconnectHandler handler, void* context);
+
 /** MQTT Yield - MQTT background
  *  @param client - the client object to use
  *  @param time - the time, in milliseconds, to yield for
@@ -212,6 +428,92 @@ DLLExport int MQTTDisconnect(MQTTClient* client);
  */
 DLLExport int MQTTYield(MQTTClient* client, int time);
 
+/** MQTT SetNonBlocking - drive the client from an event loop instead of blocking calls.
+ *  The application polls the socket and calls MQTTOnReadable, MQTTOnWritable when
+ *  MQTTWantsWrite, and MQTTOnTimer after MQTTNextTimeoutMS. Packets the socket does not
+ *  take at once are kept in the send queue; a packet that does not fit in it is not sent
+ *  and the call returns BUFFER_OVERFLOW, to be tried again once it drained. Connect,
+ *  subscribe and unsubscribe are requested with the Async calls, MQTTPublishAsync and
+ *  MQTTPublishQueued return BUFFER_OVERFLOW when the in-flight window is full, the other
+ *  blocking calls fail. Incoming packets must fit in the read buffer, the stream handler
+ *  is not used.
+ *  @param client - the client object to use
+ *  @param sendq - storage for the send queue, NULL to go back to blocking calls
+ *  @param size - bytes of sendq
+ */
+DLLExport void MQTTSetNonBlocking(MQTTClient* client, unsigned char* sendq, size_t size);
+
+/** MQTT Connect Async - queue an MQTT connect packet, the handler is called with the connack.
+ *  The nework object must be connected, bytes queued for a previous connection are dropped.
+ *  @param client - the client object to use
+ *  @param options - connect options
+ *  @param data - set from the connack before the handler is called, may be NULL
+ *  @param handler - called with the connack return code, or FAILURE
+ *  @param context - passed to the handler
+ *  @return success code
+ */
+DLLExport int MQTTConnectAsync(MQTTClient* client, MQTTPacket_connectData* options,
+    MQTTConnackData* data, requestCompleteHandler handler, void* context);
+
+/** MQTT Subscribe Async - queue an MQTT subscribe packet, the handlers are set and the
+ *  handler is called when the suback arrives. The arrays must stay valid until then.
+ *  @param client - the client object to use
+ *  @param count - the number of filters, at most MAX_SUBSCRIBE_FILTERS
+ *  @param topicFilters - the topic filters to subscribe to
+ *  @param qoss - the requested QoS of each filter
+ *  @param messageHandlers - the handler of each filter
+ *  @param data - the granted QoS of each filter, SUBFAIL for those refused
+ *  @param handler - called with SUCCESS, or FAILURE when the suback did not come
+ *  @param context - passed to the handler
+ *  @return success code
+ */
+DLLExport int MQTTSubscribeAsync(MQTTClient* client, int count, const char* topicFilters[], enum QoS qoss[],
+    messageHandler messageHandlers[], MQTTSubackData data[], requestCompleteHandler handler, void* context);
+
+/** MQTT Unsubscribe Async - queue an MQTT unsubscribe packet, the handlers are removed and
+ *  the handler is called when the unsuback arrives. The filters must stay valid until then.
+ *  @param client - the client object to use
+ *  @param count - the number of filters, at most MAX_SUBSCRIBE_FILTERS
+ *  @param topicFilters - the topic filters to unsubscribe from
+ *  @param handler - called with SUCCESS, or FAILURE when the unsuback did not come
+ *  @param context - passed to the handler
+ *  @return success code
+ */
+DLLExport int MQTTUnsubscribeAsync(MQTTClient* client, int count, const char* topicFilters[],
+    requestCompleteHandler handler, void* context);
+
+/** MQTT On Readable - read and handle the packets that arrived, without waiting
+ *  @param client - the client object to use
+ *  @return success code, FAILURE when the session was closed
+ */
+DLLExport int MQTTOnReadable(MQTTClient* client);
+
+/** MQTT On Readable Max - like MQTTOnReadable, handling at most max_packets packets so other
+ *  sessions get their turn, the rest stays buffered for the next call
+ *  @param client - the client object to use
+ *  @param max_packets - the limit, 0 for none
+ *  @return success code, FAILURE when the session was closed
+ */
+DLLExport int MQTTOnReadableMax(MQTTClient* client, int max_packets);
+
+/** MQTT On Writable - send what the send queue holds, then queued messages
+ *  @param client - the client object to use
+ *  @return success code, FAILURE when the session was closed
+ */
+DLLExport int MQTTOnWritable(MQTTClient* client);
+
+/** MQTT On Timer - send the keepalive ping and fail the requests whose acks did not come
+ *  @param client - the client object to use
+ *  @return success code, FAILURE when the session was closed
+ */
+DLLExport int MQTTOnTimer(MQTTClient* client);
+
+/* true while the send queue holds bytes, the socket should be polled for writing */
+DLLExport int MQTTWantsWrite(MQTTClient* client);
+
+/* milliseconds until MQTTOnTimer has work, -1 for none */
+DLLExport int MQTTNextTimeoutMS(MQTTClient* client);
+
 /** MQTT isConnected
  *  @param client - the client object to use
  *  @return truth value indicating whether the client is connected to the server
@@ -220,6 +522,11 @@ DLLExport int MQTTIsConnected(MQTTClient* client);
 
 #if defined(MQTT_TASK)
 /** MQTT start background thread for a client.  After this, MQTTYield should not be called.
+*  The thread reads and handles every incoming packet. The other calls hold the client lock
+*  only while they send: a call waiting for its ack sleeps without it, so publishers on
+*  several threads have their round trips overlap. Completion handlers run on the thread.
+*  The thread waits for, reads and reconnects without the lock, so the network must take
+*  a read on it while others write (on the ESP8266, see esp8266_set_lock).
 *  @param client - the client object to use
 *  @return success code
 */
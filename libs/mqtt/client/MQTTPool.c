@@ -0,0 +1,194 @@
+#include "MQTTPool.h"
+
+#include <string.h>
+
+
+static void onRetryTimer(void* arg)
+{
+    ((MQTTPoolSession*)arg)->retry_due = 1;
+}
+
+
+int MQTTPoolInit(MQTTPool* pool, unsigned char* mem, size_t size, size_t sendbuf_size,
+    size_t readbuf_size, size_t sendq_size, unsigned int command_timeout_ms)
+{
+    size_t block = readbuf_size + sendq_size;
+    int i;
+
+    for (i = 0; i < MAX_POOL_SESSIONS; ++i)
+        pool->sessions[i].state = MQTTPOOL_FREE;
+    if (size < sendbuf_size || block == 0)
+        pool->blocks = 0;
+    else if ((size - sendbuf_size) / block < MAX_POOL_SESSIONS)
+        pool->blocks = (int)((size - sendbuf_size) / block);
+    else
+        pool->blocks = MAX_POOL_SESSIONS;
+
+    pool->sendbuf = mem;
+    pool->sendbuf_size = sendbuf_size;
+    pool->readbuf_size = readbuf_size;
+    pool->sendq_size = sendq_size;
+    pool->mem = mem + sendbuf_size;
+    pool->command_timeout_ms = command_timeout_ms;
+    pool->retry_ms = MQTTPOOL_RETRY_MS;
+    timerwheel_init(&pool->wheel, TimerNowMS());
+    pool->next = 0;
+    return pool->blocks;
+}
+
+
+MQTTPoolSession* MQTTPoolAdd(MQTTPool* pool, char* host, int port, MQTTPacket_connectData* options,
+    sessionHandler handler, void* context)
+{
+    MQTTPoolSession* s = NULL;
+    unsigned char* buf;
+    int i;
+
+    /* the session in slot i has the buffers of block i */
+    for (i = 0; i < pool->blocks && s == NULL; ++i)
+    {
+        if (pool->sessions[i].state == MQTTPOOL_FREE)
+            s = &pool->sessions[i];
+    }
+    if (s == NULL)
+        return NULL;
+    buf = pool->mem + (s - pool->sessions) * (pool->readbuf_size + pool->sendq_size);
+
+    s->host = host;
+    s->port = port;
+    s->options = *options;
+    s->handler = handler;
+    s->context = context;
+    NetworkInit(&s->network);
+    MQTTClientInit(&s->client, &s->network, pool->command_timeout_ms,
+        pool->sendbuf, pool->sendbuf_size, buf, pool->readbuf_size);
+    MQTTSetNonBlocking(&s->client, buf + pool->readbuf_size, pool->sendq_size);
+    MQTTSetTimerWheel(&s->client, &pool->wheel);
+    timerwheel_timer_init(&s->retry_timer, onRetryTimer, s);
+    s->retry_due = 1;   /* connect on the next turn */
+    s->state = MQTTPOOL_IDLE;
+    return s;
+}
+
+
+void MQTTPoolRemove(MQTTPool* pool, MQTTPoolSession* s)
+{
+    if (s->state == MQTTPOOL_CONNECTING || s->state == MQTTPOOL_CONNECTED)
+    {
+        MQTTDisconnect(&s->client);
+        NetworkDisconnect(&s->network);
+    }
+    MQTTSetTimerWheel(&s->client, NULL);
+    timerwheel_del(&pool->wheel, &s->retry_timer);
+    s->state = MQTTPOOL_FREE;
+}
+
+
+/* the connection failed or dropped, try again later */
+static void drop(MQTTPool* pool, MQTTPoolSession* s)
+{
+    enum MQTTPoolState state = s->state;
+
+    if (state == MQTTPOOL_CONNECTING || state == MQTTPOOL_CONNECTED)
+        NetworkDisconnect(&s->network);
+    s->state = MQTTPOOL_IDLE;
+    s->retry_due = 0;
+    timerwheel_add(&pool->wheel, &s->retry_timer, TimerNowMS() + pool->retry_ms);
+    if (state == MQTTPOOL_CONNECTED && s->handler != NULL)
+        s->handler(s, 0);
+}
+
+
+static void onConnack(void* context, unsigned short id, int rc)
+{
+    MQTTPoolSession* s = (MQTTPoolSession*)context;
+
+    (void)id;
+    if (rc == SUCCESS && s->state == MQTTPOOL_CONNECTING)
+    {
+        s->state = MQTTPOOL_CONNECTED;
+        if (s->handler != NULL)
+            s->handler(s, 1);
+    }
+    /* a refusal closes the client session, the pool drops the connection then */
+}
+
+
+/* the TCP connect blocks, as it does on the modem; MQTT connects in the background */
+static void connectSession(MQTTPool* pool, MQTTPoolSession* s)
+{
+    if (NetworkConnect(&s->network, s->host, s->port) != 0)
+    {
+        drop(pool, s);
+        return;
+    }
+    s->state = MQTTPOOL_CONNECTING;
+    if (MQTTConnectAsync(&s->client, &s->options, NULL, onConnack, s) != SUCCESS)
+        drop(pool, s);
+}
+
+
+int MQTTPoolRun(MQTTPool* pool, int timeout_ms)
+{
+    socket_pollfd fds[MAX_POOL_SESSIONS];
+    MQTTPoolSession* polled[MAX_POOL_SESSIONS];
+    int nfds = 0;
+    int wait = timeout_ms;
+    int connected = 0;
+    long next;
+    int i, k;
+
+    timerwheel_advance(&pool->wheel, TimerNowMS());
+
+    /* in the order they are served this turn, from one further than the last */
+    for (k = 0; k < pool->blocks; ++k)
+    {
+        MQTTPoolSession* s = &pool->sessions[(pool->next + k) % pool->blocks];
+        int t;
+
+        if (s->state == MQTTPOOL_IDLE && s->retry_due)
+            connectSession(pool, s);
+        if (s->state != MQTTPOOL_CONNECTING && s->state != MQTTPOOL_CONNECTED)
+            continue;
+
+        if ((t = MQTTNextTimeoutMS(&s->client)) >= 0 && t < wait)
+            wait = t;
+        if (s->network.rxend > s->network.rxstart)
+            wait = 0;   /* received already, left by the budget of the last turn */
+        fds[nfds].fd = s->network.my_socket;
+        fds[nfds].events = SOCKET_POLLIN | (MQTTWantsWrite(&s->client) ? SOCKET_POLLOUT : 0);
+        fds[nfds].revents = 0;
+        polled[nfds++] = s;
+    }
+    if (pool->blocks > 0)
+        pool->next = (pool->next + 1) % pool->blocks;
+
+    next = timerwheel_next(&pool->wheel, TimerNowMS());
+    if (next >= 0 && next < wait)
+        wait = (int)next;
+    if (socket_poll(fds, nfds, wait) < 0)
+        return -1;
+
+    for (i = 0; i < nfds; ++i)
+    {
+        MQTTPoolSession* s = polled[i];
+        int rc = SUCCESS;
+
+        /* a handler may have removed it */
+        if (s->state != MQTTPOOL_CONNECTING && s->state != MQTTPOOL_CONNECTED)
+            continue;
+
+        if ((fds[i].revents & (SOCKET_POLLIN | SOCKET_POLLHUP)) || s->network.rxend > s->network.rxstart)
+            rc = MQTTOnReadableMax(&s->client, MQTTPOOL_BUDGET);
+        if (rc == SUCCESS && (fds[i].revents & SOCKET_POLLOUT))
+            rc = MQTTOnWritable(&s->client);
+        if (rc == SUCCESS)
+            rc = MQTTOnTimer(&s->client);
+
+        if (rc != SUCCESS || (s->state == MQTTPOOL_CONNECTED && !MQTTIsConnected(&s->client)))
+            drop(pool, s);
+        else if (s->state == MQTTPOOL_CONNECTED)
+            connected++;
+    }
+    return connected;
+}
@@ -0,0 +1,106 @@
+#if !defined(MQTT_POOL_H)
+#define MQTT_POOL_H
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#include "MQTTClient.h"
+
+/*
+ * Many MQTT sessions, each with its own server and client id, run by one thread.
+ * The clients are non-blocking: one socket_poll waits for all of their sockets
+ * and the sessions are served in turn, each handling a few packets per turn and
+ * the first one rotating, so a busy session does not starve the others. They
+ * share the send buffer, which a non-blocking client only uses during a call,
+ * and a timer wheel for their keepalives and reconnects. The read buffer and
+ * send queue of each session are carved from the memory given to the pool.
+ */
+
+#if !defined(MAX_POOL_SESSIONS)
+#define MAX_POOL_SESSIONS 8 /* redefinable - sessions of a pool */
+#endif
+
+#if !defined(MQTTPOOL_BUDGET)
+#define MQTTPOOL_BUDGET 8 /* redefinable - packets a session handles per turn */
+#endif
+
+#if !defined(MQTTPOOL_RETRY_MS)
+#define MQTTPOOL_RETRY_MS 5000 /* redefinable - wait before connecting a dropped session again */
+#endif
+
+enum MQTTPoolState { MQTTPOOL_FREE, MQTTPOOL_IDLE, MQTTPOOL_CONNECTING, MQTTPOOL_CONNECTED };
+
+struct MQTTPoolSession;
+
+/* called when a session is connected, subscriptions are made from here, and when it dropped */
+typedef void (*sessionHandler)(struct MQTTPoolSession* session, int connected);
+
+typedef struct MQTTPoolSession
+{
+    MQTTClient client;
+    Network network;
+    char* host;
+    int port;
+    MQTTPacket_connectData options;
+    enum MQTTPoolState state;
+    sessionHandler handler;
+    void* context;                  /* for the application */
+    timerwheel_timer retry_timer;
+    char retry_due;
+} MQTTPoolSession;
+
+typedef struct MQTTPool
+{
+    MQTTPoolSession sessions[MAX_POOL_SESSIONS];
+    int blocks;                     /* sessions the memory has room for */
+    unsigned char* sendbuf;         /* shared by all sessions */
+    size_t sendbuf_size, readbuf_size, sendq_size;
+    unsigned char* mem;             /* the read buffer and send queue of each session */
+    unsigned int command_timeout_ms;
+    unsigned int retry_ms;
+    timerwheel wheel;
+    int next;                       /* the session served first on the next turn */
+} MQTTPool;
+
+/** MQTT Pool Init - set up a pool in the memory given
+ *  @param pool - the pool object to use
+ *  @param mem - the memory for the buffers of all sessions
+ *  @param size - bytes of mem
+ *  @param sendbuf_size - bytes of the shared send buffer, the largest packet less publish payloads
+ *  @param readbuf_size - bytes of the read buffer of each session, the largest packet received
+ *  @param sendq_size - bytes of the send queue of each session
+ *  @param command_timeout_ms - how long the acks of requests are waited for
+ *  @return the number of sessions the memory has room for, at most MAX_POOL_SESSIONS
+ */
+int MQTTPoolInit(MQTTPool* pool, unsigned char* mem, size_t size, size_t sendbuf_size,
+    size_t readbuf_size, size_t sendq_size, unsigned int command_timeout_ms);
+
+/** MQTT Pool Add - add a session, it connects on the next turns and again whenever it drops.
+ *  The host and the strings of the options must stay valid while the session is in the pool.
+ *  @param pool - the pool object to use
+ *  @param host - the server
+ *  @param port - its port
+ *  @param options - connect options, copied
+ *  @param handler - told when the session connects and drops, may be NULL
+ *  @param context - kept in the session for the application
+ *  @return the session, NULL when the pool is full
+ */
+MQTTPoolSession* MQTTPoolAdd(MQTTPool* pool, char* host, int port, MQTTPacket_connectData* options,
+    sessionHandler handler, void* context);
+
+/* disconnect a session and give its buffers back to the pool */
+void MQTTPoolRemove(MQTTPool* pool, MQTTPoolSession* session);
+
+/** MQTT Pool Run - wait for the sockets and timers of all sessions, then serve them
+ *  @param pool - the pool object to use
+ *  @param timeout_ms - the longest wait
+ *  @return the number of sessions connected, or -1 when polling failed
+ */
+int MQTTPoolRun(MQTTPool* pool, int timeout_ms);
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
@@ -0,0 +1,336 @@
+#include "MQTTQueue.h"
+
+#include <string.h>
+
+#if !defined(MQTTQUEUE_NO_FILE)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MQTTQUEUE_MAGIC 0x4d515131  /* "MQQ1" */
+
+/* entries start on 8 byte boundaries */
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+
+static MQTTQueueEntry* entryAt(MQTTQueue* q, unsigned int off)
+{
+    return (MQTTQueueEntry*)(q->ring + off);
+}
+
+
+/* the offset of the entry at off, after the wrap when there is one */
+static unsigned int follow(MQTTQueue* q, unsigned int off)
+{
+    if (q->header->size - off < sizeof(MQTTQueueEntry) || entryAt(q, off)->len == 0)
+        return 0;
+    return off;
+}
+
+
+static void reset(MQTTQueueHeader* h, unsigned int size)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic = MQTTQUEUE_MAGIC;
+    h->size = size;
+}
+
+
+static void setup(MQTTQueue* q)
+{
+    q->max_bytes = 0;
+    q->max_count = 0;
+    q->drop = MQTTQUEUE_DROP_NEWEST;
+    q->qos0 = 0;
+}
+
+
+int MQTTQueueInit(MQTTQueue* q, unsigned char* buf, size_t size)
+{
+    size_t skip = ALIGN((size_t)buf) - (size_t)buf;
+
+    if (size < skip + ALIGN(sizeof(MQTTQueueEntry) + 2))
+        return -1;
+    size = (size - skip) & ~(size_t)7;
+
+    q->header = &q->local;
+    reset(q->header, (unsigned int)size);
+    q->ring = buf + skip;
+    q->map = NULL;
+    q->maplen = 0;
+    setup(q);
+    return 0;
+}
+
+
+#if !defined(MQTTQUEUE_NO_FILE)
+/* the ring left by a previous run, if it looks sane */
+static int recover(MQTTQueue* q)
+{
+    MQTTQueueHeader* h = q->header;
+    unsigned int off = h->head;
+    unsigned int i;
+
+    if (h->head >= h->size || h->tail > h->size || h->count > h->entries)
+        return -1;
+    for (i = 0; i < h->entries; ++i)
+    {
+        MQTTQueueEntry* e;
+
+        off = follow(q, off);
+        e = entryAt(q, off);
+        if (e->len < sizeof(MQTTQueueEntry) || e->len > h->size - off)
+            return -1;
+        /* the acks of the previous connection will not come, send it again */
+        if (e->state == MQTTQUEUE_SENT)
+            e->state = MQTTQUEUE_QUEUED;
+        off += e->len;
+    }
+    return 0;
+}
+
+
+int MQTTQueueOpen(MQTTQueue* q, const char* path, size_t size)
+{
+    size_t hlen = ALIGN(sizeof(MQTTQueueHeader));
+    struct stat st;
+    int fd;
+
+    size &= ~(size_t)7;
+    if (size < ALIGN(sizeof(MQTTQueueEntry) + 2) || size > 0xffffffffUL - hlen)
+        return -1;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size != hlen + size && ftruncate(fd, hlen + size) != 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    q->map = mmap(NULL, hlen + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (q->map == MAP_FAILED)
+    {
+        q->map = NULL;
+        return -1;
+    }
+    q->maplen = hlen + size;
+    q->header = (MQTTQueueHeader*)q->map;
+    q->ring = (unsigned char*)q->map + hlen;
+    setup(q);
+
+    if (q->header->magic != MQTTQUEUE_MAGIC || q->header->size != size || recover(q) != 0)
+        reset(q->header, (unsigned int)size);
+    return 0;
+}
+#endif
+
+
+void MQTTQueueClose(MQTTQueue* q)
+{
+#if !defined(MQTTQUEUE_NO_FILE)
+    if (q->map != NULL)
+        munmap(q->map, q->maplen);
+#endif
+    q->map = NULL;
+    q->header = NULL;
+}
+
+
+void MQTTQueueSetLimits(MQTTQueue* q, size_t max_bytes, int max_count, enum MQTTQueueDrop drop)
+{
+    q->max_bytes = max_bytes;
+    q->max_count = max_count;
+    q->drop = drop;
+}
+
+
+/* free the space of the acknowledged entries at the head */
+static void reclaim(MQTTQueue* q)
+{
+    MQTTQueueHeader* h = q->header;
+
+    while (h->entries > 0)
+    {
+        unsigned int off = follow(q, h->head);
+        MQTTQueueEntry* e = entryAt(q, off);
+
+        if (e->state != MQTTQUEUE_DONE)
+            break;
+        h->head = off + e->len;
+        h->entries--;
+    }
+    if (h->entries == 0)
+        h->head = h->tail = 0;
+    else /* past a wrap, so the space before it counts as free */
+        h->head = follow(q, h->head);
+}
+
+
+static void done(MQTTQueue* q, MQTTQueueEntry* e)
+{
+    e->state = MQTTQUEUE_DONE;
+    q->header->count--;
+    q->header->bytes -= e->topiclen + e->payloadlen;
+    reclaim(q);
+}
+
+
+/* where an entry of len bytes fits, or -1 */
+static long place(MQTTQueue* q, unsigned int len)
+{
+    MQTTQueueHeader* h = q->header;
+
+    if (h->entries == 0)
+        return (len <= h->size) ? 0 : -1;
+    if (h->tail > h->head)
+    {
+        if (h->size - h->tail >= len)
+            return h->tail;
+        return (h->head >= len) ? 0 : -1;
+    }
+    /* wrapped, or full when tail meets head */
+    return (h->head - h->tail >= len) ? (long)h->tail : -1;
+}
+
+
+/* the limits leave room for a message of bytes topic and payload */
+static int withinLimits(MQTTQueue* q, size_t bytes)
+{
+    MQTTQueueHeader* h = q->header;
+
+    if (q->max_count > 0 && h->count + 1 > (unsigned int)q->max_count)
+        return 0;
+    if (q->max_bytes > 0 && h->bytes + bytes > q->max_bytes)
+        return 0;
+    return 1;
+}
+
+
+static int fits(MQTTQueue* q, size_t bytes, unsigned int len)
+{
+    return withinLimits(q, bytes) && place(q, len) >= 0;
+}
+
+
+/*
+ * drop the oldest message not sent yet, the sent ones are referenced until their acks.
+ * Only when that makes room: behind a sent message at the head the ring stays taken.
+ */
+static int dropOldest(MQTTQueue* q, size_t bytes)
+{
+    MQTTQueueEntry* e = MQTTQueueNext(q);
+
+    if (e == NULL)
+        return 0;
+    if (withinLimits(q, bytes) && e != entryAt(q, follow(q, q->header->head)))
+        return 0;
+    done(q, e);
+    return 1;
+}
+
+
+int MQTTQueuePush(MQTTQueue* q, const char* topic, int qos, unsigned char retained,
+    const void* payload, size_t payloadlen)
+{
+    MQTTQueueHeader* h = q->header;
+    size_t topiclen = strlen(topic);
+    size_t len = ALIGN(sizeof(MQTTQueueEntry) + topiclen + 1 + payloadlen);
+    MQTTQueueEntry* e;
+    long off;
+
+    if (topiclen > 0xffff || len > h->size)
+        return -1;
+    while (!fits(q, topiclen + payloadlen, (unsigned int)len))
+    {
+        if (q->drop != MQTTQUEUE_DROP_OLDEST || !dropOldest(q, topiclen + payloadlen))
+            return -1;
+    }
+
+    off = place(q, (unsigned int)len);
+    if (off == 0 && h->tail != 0 && h->size - h->tail >= sizeof(MQTTQueueEntry))
+        entryAt(q, h->tail)->len = 0;
+
+    e = entryAt(q, (unsigned int)off);
+    e->payloadlen = (unsigned int)payloadlen;
+    e->topiclen = (unsigned short)topiclen;
+    e->id = 0;
+    e->qos = (unsigned char)qos;
+    e->retained = retained;
+    e->reserved = 0;
+    memcpy(MQTTQueueTopic(e), topic, topiclen + 1);
+    if (payloadlen > 0)
+        memcpy(MQTTQueuePayload(e), payload, payloadlen);
+    e->state = MQTTQUEUE_QUEUED;
+    e->len = (unsigned int)len;
+
+    /* the entry is complete before it is counted */
+    h->tail = (unsigned int)off + (unsigned int)len;
+    h->entries++;
+    h->count++;
+    h->bytes += (unsigned int)(topiclen + payloadlen);
+    return 0;
+}
+
+
+MQTTQueueEntry* MQTTQueueNext(MQTTQueue* q)
+{
+    MQTTQueueHeader* h = q->header;
+    unsigned int off = h->head;
+    unsigned int i;
+
+    for (i = 0; i < h->entries; ++i)
+    {
+        MQTTQueueEntry* e;
+
+        off = follow(q, off);
+        e = entryAt(q, off);
+        if (e->state == MQTTQUEUE_QUEUED)
+            return e;
+        off += e->len;
+    }
+    return NULL;
+}
+
+
+void MQTTQueueSent(MQTTQueue* q, MQTTQueueEntry* e, unsigned short id)
+{
+    if (id == 0)
+        done(q, e);
+    else
+    {
+        e->id = id;
+        e->state = MQTTQUEUE_SENT;
+    }
+}
+
+
+void MQTTQueueAcked(MQTTQueue* q, unsigned short id)
+{
+    MQTTQueueHeader* h = q->header;
+    unsigned int off = h->head;
+    unsigned int i;
+
+    for (i = 0; i < h->entries; ++i)
+    {
+        MQTTQueueEntry* e;
+
+        off = follow(q, off);
+        e = entryAt(q, off);
+        if (e->state == MQTTQUEUE_SENT && e->id == id)
+        {
+            done(q, e);
+            return;
+        }
+        off += e->len;
+    }
+}
+
+
+int MQTTQueueCount(MQTTQueue* q)
+{
+    return (int)q->header->count;
+}
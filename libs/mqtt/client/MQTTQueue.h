@@ -0,0 +1,119 @@
+#if !defined(MQTT_QUEUE_H)
+#define MQTT_QUEUE_H
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * Outbound messages kept until the server has them: QoS 0 ones until they are sent,
+ * QoS 1 and 2 ones until their last ack. Messages are copied into a ring, in memory or
+ * in a memory mapped file so they also survive a restart of the process. Entries are
+ * reclaimed in order, an acknowledged message frees its space once the older ones are
+ * gone too.
+ */
+
+enum MQTTQueueDrop
+{
+    MQTTQUEUE_DROP_NEWEST,  /* refuse new messages while the queue is full */
+    MQTTQUEUE_DROP_OLDEST   /* make room by dropping the oldest messages not sent yet */
+};
+
+enum MQTTQueueState { MQTTQUEUE_QUEUED = 1, MQTTQUEUE_SENT, MQTTQUEUE_DONE };
+
+/* a message in the ring, followed by its topic, nul terminated, and payload */
+typedef struct MQTTQueueEntry
+{
+    unsigned int len;           /* bytes taken in the ring, 0 marks the wrap to the start */
+    unsigned int payloadlen;
+    unsigned short topiclen;
+    unsigned short id;          /* packet id while waiting for the acks */
+    unsigned char state;
+    unsigned char qos;
+    unsigned char retained;
+    unsigned char reserved;
+} MQTTQueueEntry;
+
+#define MQTTQueueTopic(e)   ((char*)((e) + 1))
+#define MQTTQueuePayload(e) ((void*)(MQTTQueueTopic(e) + (e)->topiclen + 1))
+
+/* kept at the start of the file when the queue is mapped */
+typedef struct MQTTQueueHeader
+{
+    unsigned int magic;
+    unsigned int size;          /* bytes of the ring */
+    unsigned int head, tail;    /* oldest entry, where the next one goes */
+    unsigned int entries;       /* in the ring, including acknowledged ones not reclaimed yet */
+    unsigned int count;         /* messages not acknowledged yet */
+    unsigned int bytes;         /* their topic and payload bytes */
+    unsigned int reserved;
+} MQTTQueueHeader;
+
+typedef struct MQTTQueue
+{
+    MQTTQueueHeader* header;
+    MQTTQueueHeader local;      /* the header of an in memory queue */
+    unsigned char* ring;
+    void* map;
+    size_t maplen;
+    size_t max_bytes;           /* 0 for no limit but the ring */
+    int max_count;              /* 0 for no limit but the ring */
+    enum MQTTQueueDrop drop;
+    char qos0;                  /* keep QoS 0 messages while disconnected */
+} MQTTQueue;
+
+/** MQTT Queue Init - set up an in memory queue
+ *  @param queue - the queue object to use
+ *  @param buf - storage for the ring, entries take 16 bytes plus topic and payload
+ *  @param size - bytes of buf
+ *  @return 0, or -1 when the buffer is too small
+ */
+int MQTTQueueInit(MQTTQueue* queue, unsigned char* buf, size_t size);
+
+#if !defined(MQTTQUEUE_NO_FILE)
+/** MQTT Queue Open - map a file as the queue, messages left in it by a previous run are kept
+ *  and those that were waiting for their acks are sent again. The file is written back by
+ *  the system, a crash of the process loses nothing but a power loss may.
+ *  @param queue - the queue object to use
+ *  @param path - the file, created when missing
+ *  @param size - bytes of the ring, a file of another size is started again
+ *  @return 0, or -1 on error
+ */
+int MQTTQueueOpen(MQTTQueue* queue, const char* path, size_t size);
+#endif
+
+void MQTTQueueClose(MQTTQueue* queue);
+
+/** MQTT Queue Set Limits
+ *  @param queue - the queue object to use
+ *  @param max_bytes - topic and payload bytes held at most, 0 for no limit
+ *  @param max_count - messages held at most, 0 for no limit
+ *  @param drop - what to do with a message that does not fit
+ */
+void MQTTQueueSetLimits(MQTTQueue* queue, size_t max_bytes, int max_count, enum MQTTQueueDrop drop);
+
+/** MQTT Queue Push - copy a message into the queue
+ *  @return 0, or -1 when it was dropped
+ */
+int MQTTQueuePush(MQTTQueue* queue, const char* topic, int qos, unsigned char retained,
+    const void* payload, size_t payloadlen);
+
+/* the oldest message not sent yet, or NULL */
+MQTTQueueEntry* MQTTQueueNext(MQTTQueue* queue);
+
+/* the message went out, id 0 for QoS 0 ones which are done then */
+void MQTTQueueSent(MQTTQueue* queue, MQTTQueueEntry* entry, unsigned short id);
+
+/* the last ack of the message sent with this id arrived */
+void MQTTQueueAcked(MQTTQueue* queue, unsigned short id);
+
+/* messages not acknowledged yet */
+int MQTTQueueCount(MQTTQueue* queue);
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
@@ -0,0 +1,259 @@
+#include "MQTTClient.h"
+
+#define NONE (-1)
+
+
+/* FNV-1a over the level, seeded with the parent so equal levels differ per parent */
+static unsigned int hashLevel(short parent, const char* level, int len)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)(unsigned short)parent;
+    int i;
+
+    for (i = 0; i < len; ++i)
+        h = (h ^ (unsigned char)level[i]) * 16777619u;
+    return h;
+}
+
+
+static int levelLength(const char* s, const char* end)
+{
+    const char* p = s;
+
+    while (p < end && *p != '/')
+        ++p;
+    return (int)(p - s);
+}
+
+
+void MQTTTopicTrieInit(MQTTTopicTrie* t)
+{
+    int i;
+
+    for (i = 0; i < MAX_TOPIC_BUCKETS; ++i)
+        t->buckets[i] = NONE;
+    for (i = 1; i < MAX_TOPIC_NODES; ++i)
+        t->nodes[i].next = (i + 1 < MAX_TOPIC_NODES) ? i + 1 : NONE;
+    t->free = (MAX_TOPIC_NODES > 1) ? 1 : NONE;
+
+    t->nodes[0].parent = NONE;
+    t->nodes[0].next = NONE;
+    t->nodes[0].plus = t->nodes[0].pound = NONE;
+    t->nodes[0].children = 0;
+    t->nodes[0].value = NONE;
+}
+
+
+static short findChild(MQTTTopicTrie* t, short parent, const char* level, int len)
+{
+    unsigned int h;
+    short n;
+
+    if (len == 1 && level[0] == '+')
+        return t->nodes[parent].plus;
+    if (len == 1 && level[0] == '#')
+        return t->nodes[parent].pound;
+
+    h = hashLevel(parent, level, len);
+    for (n = t->buckets[h % MAX_TOPIC_BUCKETS]; n != NONE; n = t->nodes[n].next)
+    {
+        if (t->nodes[n].hash == h && t->nodes[n].len == len && t->nodes[n].parent == parent)
+            return n;
+    }
+    return NONE;
+}
+
+
+static short addChild(MQTTTopicTrie* t, short parent, const char* level, int len)
+{
+    short n = t->free;
+    MQTTTopicNode* node;
+
+    if (n == NONE)
+        return NONE;
+    node = &t->nodes[n];
+    t->free = node->next;
+
+    node->hash = hashLevel(parent, level, len);
+    node->len = (unsigned short)len;
+    node->parent = parent;
+    node->plus = node->pound = NONE;
+    node->children = 0;
+    node->value = NONE;
+    node->next = NONE;
+
+    if (len == 1 && level[0] == '+')
+        t->nodes[parent].plus = n;
+    else if (len == 1 && level[0] == '#')
+        t->nodes[parent].pound = n;
+    else
+    {
+        short* bucket = &t->buckets[node->hash % MAX_TOPIC_BUCKETS];
+        node->next = *bucket;
+        *bucket = n;
+    }
+    t->nodes[parent].children++;
+    return n;
+}
+
+
+static void removeNode(MQTTTopicTrie* t, short n)
+{
+    MQTTTopicNode* node = &t->nodes[n];
+    MQTTTopicNode* parent = &t->nodes[node->parent];
+
+    if (parent->plus == n)
+        parent->plus = NONE;
+    else if (parent->pound == n)
+        parent->pound = NONE;
+    else
+    {
+        short* p = &t->buckets[node->hash % MAX_TOPIC_BUCKETS];
+        while (*p != n)
+            p = &t->nodes[*p].next;
+        *p = node->next;
+    }
+    parent->children--;
+
+    node->next = t->free;
+    t->free = n;
+}
+
+
+/* the node filter ends at, NONE when it is not there */
+static short walk(MQTTTopicTrie* t, const char* filter, int create)
+{
+    const char* p = filter;
+    const char* end = filter;
+    short n = 0;
+
+    while (*end)
+        ++end;
+    for (;;)
+    {
+        int len = levelLength(p, end);
+        short child = findChild(t, n, p, len);
+
+        if (child == NONE && (!create || (child = addChild(t, n, p, len)) == NONE))
+            return NONE;
+        n = child;
+        if (p + len == end)
+            return n;
+        p += len + 1;
+    }
+}
+
+
+short* MQTTTopicTrieValue(MQTTTopicTrie* t, const char* filter, int create)
+{
+    short n = walk(t, filter, create);
+
+    if (n == NONE)
+    {
+        if (create) /* out of nodes, drop the levels added so far */
+            MQTTTopicTriePrune(t, filter);
+        return NULL;
+    }
+    return &t->nodes[n].value;
+}
+
+
+void MQTTTopicTriePrune(MQTTTopicTrie* t, const char* filter)
+{
+    const char* p = filter;
+    const char* end = filter;
+    short n = 0;
+
+    while (*end)
+        ++end;
+    /* down as far as the filter goes, then back up while the nodes are unused */
+    for (;;)
+    {
+        int len = levelLength(p, end);
+        short child = findChild(t, n, p, len);
+
+        if (child == NONE)
+            break;
+        n = child;
+        if (p + len == end)
+            break;
+        p += len + 1;
+    }
+    while (n != 0 && t->nodes[n].value == NONE && t->nodes[n].children == 0)
+    {
+        short parent = t->nodes[n].parent;
+        removeNode(t, n);
+        n = parent;
+    }
+}
+
+
+typedef struct MatchState
+{
+    MQTTTopicTrie* t;
+    const char* end;
+    void (*fn)(void*, short);
+    void* context;
+    int count;
+} MatchState;
+
+
+static void report(MatchState* s, short n)
+{
+    if (n != NONE && s->t->nodes[n].value != NONE)
+    {
+        s->fn(s->context, s->t->nodes[n].value);
+        s->count++;
+    }
+}
+
+
+/* match the topic from the level at p below node n */
+static void matchLevel(MatchState* s, short n, const char* p, int first)
+{
+    MQTTTopicNode* node = &s->t->nodes[n];
+    int len = levelLength(p, s->end);
+    int last = (p + len == s->end);
+    /* wildcards at the first level do not match topics starting with $ */
+    int wild = !(first && len > 0 && p[0] == '$');
+    short child;
+
+    if (wild)
+        report(s, node->pound);
+
+    if ((child = findChild(s->t, n, p, len)) != NONE)
+    {
+        if (last)
+        {
+            report(s, child);
+            report(s, s->t->nodes[child].pound); /* "a/#" matches "a" too */
+        }
+        else
+            matchLevel(s, child, p + len + 1, 0);
+    }
+
+    if (wild && (child = node->plus) != NONE)
+    {
+        if (last)
+        {
+            report(s, child);
+            report(s, s->t->nodes[child].pound);
+        }
+        else
+            matchLevel(s, child, p + len + 1, 0);
+    }
+}
+
+
+int MQTTTopicTrieMatch(MQTTTopicTrie* t, const char* topic, int len,
+    void (*fn)(void* context, short value), void* context)
+{
+    MatchState s;
+
+    s.t = t;
+    s.end = topic + len;
+    s.fn = fn;
+    s.context = context;
+    s.count = 0;
+    matchLevel(&s, 0, topic, 1);
+    return s.count;
+}
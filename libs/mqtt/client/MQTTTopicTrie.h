@@ -0,0 +1,65 @@
+#if !defined(MQTT_TOPIC_TRIE_H)
+#define MQTT_TOPIC_TRIE_H
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+/*
+ * Topic filters by level, to find the subscriptions matching a topic in time that
+ * depends on the depth of the topic and not on the number of subscriptions. Levels
+ * are kept as hashes, children by level in one hash table and + and # children apart.
+ * The trie holds no strings: a match is a candidate the caller checks against its
+ * filter, which only fails on hash collisions.
+ */
+
+#if !defined(MAX_TOPIC_NODES)
+#define MAX_TOPIC_NODES 32 /* MQTTClient.h sets it from MAX_MESSAGE_HANDLERS */
+#endif
+
+#if !defined(MAX_TOPIC_BUCKETS)
+#define MAX_TOPIC_BUCKETS MAX_TOPIC_NODES
+#endif
+
+typedef struct MQTTTopicNode
+{
+    unsigned int hash;      /* of the level and the parent */
+    unsigned short len;     /* of the level */
+    short parent;
+    short next;             /* in the hash bucket, or the free list */
+    short plus, pound;      /* the + and # children */
+    short children;
+    short value;            /* set by the caller for the filter ending here, -1 for none */
+} MQTTTopicNode;
+
+typedef struct MQTTTopicTrie
+{
+    MQTTTopicNode nodes[MAX_TOPIC_NODES];   /* the root is nodes[0] */
+    short buckets[MAX_TOPIC_BUCKETS];
+    short free;
+} MQTTTopicTrie;
+
+void MQTTTopicTrieInit(MQTTTopicTrie* trie);
+
+/** MQTT Topic Trie Value - the value of the node a filter ends at
+ *  @param trie - the trie to use
+ *  @param filter - a valid topic filter
+ *  @param create - add the missing levels, their value is -1
+ *  @return the value, NULL when the filter is not there or the nodes ran out
+ */
+short* MQTTTopicTrieValue(MQTTTopicTrie* trie, const char* filter, int create);
+
+/* remove the levels of filter that no longer lead to a value */
+void MQTTTopicTriePrune(MQTTTopicTrie* trie, const char* filter);
+
+/** MQTT Topic Trie Match - call fn with the value of every filter matching a topic name
+ *  @return the number of calls
+ */
+int MQTTTopicTrieMatch(MQTTTopicTrie* trie, const char* topic, int len,
+    void (*fn)(void* context, short value), void* context);
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
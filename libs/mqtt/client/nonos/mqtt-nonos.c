@@ -7,49 +7,79 @@
 #include <string.h>
 #include <signal.h>
 
-#include <sys/time.h>
+#include <time.h>
 
 #include "socket.h"
 
 #include "mqtt-nonos.h"
 
+/*
+ * milliseconds of CLOCK_MONOTONIC, which does not jump with the wall clock.
+ * it is read through the vDSO, so every timer call can afford to read it.
+ */
+static unsigned long _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+unsigned long TimerNowMS(void)
+{
+    return _now();
+}
+
 void TimerInit(Timer* timer)
 {
-    timer->end_time = (struct timeval){0, 0};
+    timer->end_ms = 0;
 }
 
 char TimerIsExpired(Timer* timer)
 {
-    struct timeval now, res;
-    gettimeofday(&now, NULL);
-    timersub(&timer->end_time, &now, &res);
-    return res.tv_sec < 0 || (res.tv_sec == 0 && res.tv_usec <= 0);
+    return (long)(timer->end_ms - _now()) <= 0;
 }
 
 void TimerCountdownMS(Timer* timer, unsigned int timeout)
 {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    struct timeval interval = {timeout / 1000, (timeout % 1000) * 1000};
-    timeradd(&now, &interval, &timer->end_time);
+    timer->end_ms = _now() + timeout;
 }
 
 void TimerCountdown(Timer* timer, unsigned int timeout)
 {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    struct timeval interval = {timeout, 0};
-    timeradd(&now, &interval, &timer->end_time);
+    timer->end_ms = _now() + (unsigned long)timeout * 1000;
 }
 
 int TimerLeftMS(Timer* timer)
 {
-    struct timeval now, res;
-    gettimeofday(&now, NULL);
-    timersub(&timer->end_time, &now, &res);
-    //printf("left %d ms\n",
-    //       (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
-    return (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000;
+    long left = (long)(timer->end_ms - _now());
+    return left < 0 ? 0 : (int)left;
+}
+
+void TimerSleepMS(int timeout_ms)
+{
+    if (timeout_ms <= 0) {
+        return;
+    }
+    struct timespec ts = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+/* move what is left to the front and receive behind it */
+static int _fill(Network* n, Timer* timer)
+{
+    if (n->rxstart > 0) {
+        memmove(n->rxbuf, &n->rxbuf[n->rxstart], n->rxend - n->rxstart);
+        n->rxend -= n->rxstart;
+        n->rxstart = 0;
+    }
+
+    int rc = socket_recv_timeout(n->my_socket, &n->rxbuf[n->rxend],
+                                 sizeof(n->rxbuf) - n->rxend, TimerLeftMS(timer));
+    if (rc > 0) {
+        n->rxend += rc;
+    }
+    return rc;
 }
 
 static int _read(Network* n, unsigned char* buffer, int len, int timeout_ms)
@@ -58,19 +88,43 @@ static int _read(Network* n, unsigned char* buffer, int len, int timeout_ms)
     TimerInit(&timer);
     TimerCountdownMS(&timer, timeout_ms);
 
-    int bytes = 0;
+    // reads that fit the buffer are served whole or not at all, so a
+    // timeout leaves the stream where it was for the next call. the socket
+    // is tried at least once, a timeout of 0 takes what has arrived.
+    if (len <= (int)sizeof(n->rxbuf)) {
+        while (n->rxend - n->rxstart < len) {
+            int rc = _fill(n, &timer);
+            if (rc != NSAPI_ERROR_WOULD_BLOCK && rc <= 0) {
+                // closed by the peer or failed, the client drops the connection
+                return -1;
+            }
+            if (n->rxend - n->rxstart < len && TimerIsExpired(&timer)) {
+                return 0;
+            }
+        }
+        memcpy(buffer, &n->rxbuf[n->rxstart], len);
+        n->rxstart += len;
+        return len;
+    }
+
+    // larger reads take what is buffered, the rest goes straight to the caller
+    int bytes = n->rxend - n->rxstart;
+    memcpy(buffer, &n->rxbuf[n->rxstart], bytes);
+    n->rxstart = n->rxend = 0;
+
     while (bytes < len && !TimerIsExpired(&timer)) {
-        int rc = socket_recv(n->my_socket, &buffer[bytes], (size_t)(len - bytes));
-        if (rc == -1) {
-            break;
-        } else if (rc == 0) {
-            bytes = 0;
-            break;
-        } else {
-            bytes += rc;
+        int rc = socket_recv_timeout(n->my_socket, &buffer[bytes], (size_t)(len - bytes),
+                                     TimerLeftMS(&timer));
+        if (rc == NSAPI_ERROR_WOULD_BLOCK) {
+            continue;
+        } else if (rc <= 0) {
+            return -1;
         }
+        bytes += rc;
     }
-    return bytes;
+
+    // the bytes consumed cannot be given back, the stream is out of sync
+    return bytes == len ? len : -1;
 }
 
 
@@ -80,27 +134,91 @@ static int _write(Network* n, unsigned char* buffer, int len, int timeout_ms)
     TimerInit(&timer);
     TimerCountdownMS(&timer, timeout_ms);
 
+    // tried at least once, so a timeout of 0 writes what the socket takes
     int bytes = 0;
-    while (bytes < len && !TimerIsExpired(&timer)) {
-        int	rc = socket_send(n->my_socket, &buffer[bytes], len - bytes);
-        if (rc < 0) {
+    do {
+        int	rc = socket_send_timeout(n->my_socket, &buffer[bytes], len - bytes, TimerLeftMS(&timer));
+        if (rc == NSAPI_ERROR_WOULD_BLOCK) {
+            continue;
+        } else if (rc < 0) {
             bytes = rc;
             break;
-        } else if (rc == 0) {
-            bytes = 0;
-            break;
         } else {
             bytes += rc;
         }
+    } while (bytes < len && !TimerIsExpired(&timer));
+    return bytes;
+}
+
+#define NETWORK_IOV_MAX 8
+
+static int _writev(Network* n, const socket_iovec* iov, int iovcnt, int timeout_ms)
+{
+    socket_iovec vec[NETWORK_IOV_MAX];
+    int total = 0;
+
+    if (iovcnt > NETWORK_IOV_MAX) {
+        return -1;
     }
+    for (int i = 0; i < iovcnt; i++) {
+        vec[i] = iov[i];
+        total += iov[i].len;
+    }
+
+    Timer timer;
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, timeout_ms);
+
+    int bytes = 0;
+    int first = 0;
+    do {
+        int rc = socket_sendv(n->my_socket, &vec[first], iovcnt - first);
+        if (rc == NSAPI_ERROR_WOULD_BLOCK) {
+            continue;
+        } else if (rc < 0) {
+            bytes = rc;
+            break;
+        }
+        bytes += rc;
+
+        // continue after the part that was sent
+        while (rc > 0) {
+            if ((unsigned int)rc >= vec[first].len) {
+                rc -= vec[first].len;
+                first++;
+            } else {
+                vec[first].base = (char*)vec[first].base + rc;
+                vec[first].len -= rc;
+                rc = 0;
+            }
+        }
+    } while (bytes < total && !TimerIsExpired(&timer));
     return bytes;
 }
 
+static int _poll(Network* n, int timeout_ms)
+{
+    if (n->rxend > n->rxstart) {
+        return 1;
+    }
+
+    socket_pollfd pfd = { .fd = n->my_socket, .events = SOCKET_POLLIN };
+    int rc = socket_poll(&pfd, 1, timeout_ms);
+    if (rc < 0) {
+        return rc;
+    }
+    // a closed socket is readable too, the read then reports it
+    return rc > 0 && pfd.revents ? 1 : 0;
+}
+
 void NetworkInit(Network* n)
 {
-    n->my_socket = 0;
+    n->my_socket = -1;
+    n->rxstart = n->rxend = 0;
     n->mqttread = _read;
     n->mqttwrite = _write;
+    n->mqttwritev = _writev;
+    n->mqttpoll = _poll;
 }
 
 
@@ -108,8 +226,9 @@ int NetworkConnect(Network* n, char* addr, int port)
 {
     int rc = -1;
 
+    n->rxstart = n->rxend = 0;
     n->my_socket = socket_connect(addr, port);
-    if (n->my_socket != -1) {
+    if (n->my_socket >= 0) {
         rc = 0;
     }
 
@@ -117,8 +236,76 @@ int NetworkConnect(Network* n, char* addr, int port)
 }
 
 
+// may be called again, or before connecting: link ids are reused by the next connects
 void NetworkDisconnect(Network* n)
 {
-    close(n->my_socket);
+    if (n->my_socket >= 0) {
+        socket_close(n->my_socket);
+        n->my_socket = -1;
+    }
+}
+
+
+#if defined(MQTT_TASK)
+void MutexInit(Mutex* m)
+{
+    pthread_mutex_init(&m->m, NULL);
+}
+
+int MutexLock(Mutex* m)
+{
+    return pthread_mutex_lock(&m->m);
 }
 
+int MutexUnlock(Mutex* m)
+{
+    return pthread_mutex_unlock(&m->m);
+}
+
+/* the deadline of the timed wait is on the clock of the timers */
+void CondInit(Cond* c)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->c, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+int CondWait(Cond* c, Mutex* m, int timeout_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(&c->c, &m->m, &ts) == 0 ? 0 : -1;
+}
+
+void CondBroadcast(Cond* c)
+{
+    pthread_cond_broadcast(&c->c);
+}
+
+static void* _start(void* arg)
+{
+    Thread* t = (Thread*)arg;
+    t->fn(t->arg);
+    return NULL;
+}
+
+int ThreadStart(Thread* t, void (*fn)(void*), void* arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+    return pthread_create(&t->t, NULL, _start, t) == 0 ? 0 : -1;
+}
+
+int ThreadIsCurrent(Thread* t)
+{
+    return pthread_equal(t->t, pthread_self()) != 0;
+}
+#endif
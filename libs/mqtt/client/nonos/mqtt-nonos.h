@@ -1,10 +1,10 @@
 #ifndef _MQTT_NONOS_H_
 #define _MQTT_NONOS_H_
 
-#include <sys/time.h>
+#include "socket.h"
 
 typedef struct Timer {
-    struct timeval end_time;
+    unsigned long end_ms;   /* monotonic milliseconds */
 } Timer;
 
 void TimerInit(Timer*);
@@ -12,15 +12,61 @@ char TimerIsExpired(Timer*);
 void TimerCountdownMS(Timer*, unsigned int);
 void TimerCountdown(Timer*, unsigned int);
 int TimerLeftMS(Timer*);
+unsigned long TimerNowMS(void);
+void TimerSleepMS(int);
+
+/* bytes pulled from the socket at once and kept for the next reads */
+#ifndef NETWORK_RX_BUFFER_SIZE
+#define NETWORK_RX_BUFFER_SIZE 256
+#endif
 
 typedef struct Network {
     int my_socket;
+    unsigned char rxbuf[NETWORK_RX_BUFFER_SIZE];
+    int rxstart;    /* first byte not yet read by the client */
+    int rxend;      /* end of the received bytes */
     int (*mqttread) (struct Network*, unsigned char*, int, int);
     int (*mqttwrite) (struct Network*, unsigned char*, int, int);
+    /* write the segments in order, return the bytes written or < 0 */
+    int (*mqttwritev) (struct Network*, const socket_iovec*, int, int);
+    /* wait until data can be read, return > 0 when it can, 0 on timeout, < 0 on error */
+    int (*mqttpoll) (struct Network*, int);
 } Network;
 
 void NetworkInit(Network*);
 int NetworkConnect(Network*, char*, int);
 void NetworkDisconnect(Network*);
 
+#if defined(MQTT_TASK)
+#include <pthread.h>
+
+typedef struct Mutex {
+    pthread_mutex_t m;
+} Mutex;
+
+void MutexInit(Mutex*);
+int MutexLock(Mutex*);
+int MutexUnlock(Mutex*);
+
+/* waited on with the mutex held, which is released meanwhile */
+typedef struct Cond {
+    pthread_cond_t c;
+} Cond;
+
+void CondInit(Cond*);
+/* return 0 when woken, -1 on timeout */
+int CondWait(Cond*, Mutex*, int timeout_ms);
+void CondBroadcast(Cond*);
+
+typedef struct Thread {
+    pthread_t t;
+    void (*fn)(void*);
+    void* arg;
+} Thread;
+
+int ThreadStart(Thread*, void (*fn)(void*), void* arg);
+/* 1 when called on the thread */
+int ThreadIsCurrent(Thread*);
+#endif
+
 #endif
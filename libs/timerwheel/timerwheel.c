@@ -0,0 +1,196 @@
+#include <stddef.h>
+#include "timerwheel.h"
+
+#define MASK    (TIMERWHEEL_SLOTS - 1)
+
+static inline unsigned int slot_index(unsigned long t, int level)
+{
+    return (t >> (level * TIMERWHEEL_BITS)) & MASK;
+}
+
+static void link(timerwheel_timer **head, timerwheel_timer *t)
+{
+    t->next = *head;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = t;
+}
+
+static void unlink(timerwheel_timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/* the slot for t->expires as seen from tw->next_tick */
+static void place(timerwheel *tw, timerwheel_timer *t)
+{
+    unsigned long expires = t->expires;
+    long delta = (long)(expires - tw->next_tick);
+
+    if (delta < 0) {
+        // already due, runs with the next tick
+        expires = tw->next_tick;
+        delta = 0;
+    }
+
+    int level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1 &&
+           (unsigned long)delta >= (1UL << ((level + 1) * TIMERWHEEL_BITS))) {
+        level++;
+    }
+
+    // beyond the last level: park in its farthest slot, placed again later
+    unsigned long range = 1UL << (TIMERWHEEL_LEVELS * TIMERWHEEL_BITS);
+    if ((unsigned long)delta >= range) {
+        expires = tw->next_tick + range - 1;
+    }
+
+    link(&tw->slots[level][slot_index(expires, level)], t);
+}
+
+void timerwheel_init(timerwheel *tw, unsigned long now_ms)
+{
+    tw->next_tick = now_ms;
+    tw->count = 0;
+    for (int l = 0; l < TIMERWHEEL_LEVELS; l++) {
+        for (int s = 0; s < TIMERWHEEL_SLOTS; s++) {
+            tw->slots[l][s] = NULL;
+        }
+    }
+}
+
+void timerwheel_timer_init(timerwheel_timer *t, void (*cb)(void *arg), void *arg)
+{
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->cb = cb;
+    t->arg = arg;
+}
+
+int timerwheel_pending(timerwheel_timer *t)
+{
+    return t->pprev != NULL;
+}
+
+void timerwheel_add(timerwheel *tw, timerwheel_timer *t, unsigned long expires_ms)
+{
+    if (timerwheel_pending(t)) {
+        unlink(t);
+    } else {
+        tw->count++;
+    }
+    t->expires = expires_ms;
+    place(tw, t);
+}
+
+void timerwheel_del(timerwheel *tw, timerwheel_timer *t)
+{
+    if (timerwheel_pending(t)) {
+        unlink(t);
+        tw->count--;
+    }
+}
+
+/* move the timers of one slot down to where they belong now */
+static unsigned int cascade(timerwheel *tw, int level)
+{
+    unsigned int index = slot_index(tw->next_tick, level);
+    timerwheel_timer *t = tw->slots[level][index];
+
+    tw->slots[level][index] = NULL;
+    while (t) {
+        timerwheel_timer *next = t->next;
+        t->pprev = NULL;
+        place(tw, t);
+        t = next;
+    }
+    return index;
+}
+
+void timerwheel_advance(timerwheel *tw, unsigned long now_ms)
+{
+    while ((long)(now_ms - tw->next_tick) >= 0) {
+        if (!tw->count) {
+            tw->next_tick = now_ms + 1;
+            break;
+        }
+
+        unsigned int index = slot_index(tw->next_tick, 0);
+
+        // a lap of a level completed, bring the next slot of the level above down
+        for (int level = 1; !index && level < TIMERWHEEL_LEVELS; level++) {
+            index = cascade(tw, level);
+        }
+        index = slot_index(tw->next_tick, 0);
+
+        // callbacks may add or delete timers, so the slot is detached first
+        timerwheel_timer *head = tw->slots[0][index];
+        tw->slots[0][index] = NULL;
+        if (head) {
+            head->pprev = &head;
+        }
+        tw->next_tick++;
+
+        while (head) {
+            timerwheel_timer *t = head;
+            unlink(t);
+            tw->count--;
+            if (t->cb) {
+                t->cb(t->arg);
+            }
+        }
+    }
+}
+
+static int earliest(timerwheel_timer *t, unsigned long *expires)
+{
+    int found = 0;
+    for (; t; t = t->next) {
+        if (!found || (long)(t->expires - *expires) < 0) {
+            *expires = t->expires;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+long timerwheel_next(timerwheel *tw, unsigned long now_ms)
+{
+    unsigned long next = 0;
+    int found = 0;
+
+    if (!tw->count) {
+        return -1;
+    }
+
+    // slots are visited in time order, the first non-empty one of a level
+    // holds its earliest timers. the current slot of an upper level comes
+    // first while it waits to be cascaded, else it is a lap away and last.
+    for (int level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        unsigned int cur = slot_index(tw->next_tick, level);
+        unsigned long lower = (1UL << (level * TIMERWHEEL_BITS)) - 1;
+        int first = (tw->next_tick & lower) ? 1 : 0;
+
+        for (int k = first; k < first + TIMERWHEEL_SLOTS; k++) {
+            unsigned long expires;
+            if (earliest(tw->slots[level][(cur + k) & MASK], &expires)) {
+                if (!found || (long)(expires - next) < 0) {
+                    next = expires;
+                    found = 1;
+                }
+                break;
+            }
+        }
+    }
+
+    long left = (long)(next - now_ms);
+    return left < 0 ? 0 : left;
+}
@@ -0,0 +1,52 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * hierarchical timer wheel with a 1 ms tick. level 0 holds timers due in the
+ * next 64 ms, every further level covers 64 times more, timers further away
+ * than the last level are parked there and placed again when it comes round.
+ */
+#define TIMERWHEEL_LEVELS       4
+#define TIMERWHEEL_BITS         6
+#define TIMERWHEEL_SLOTS        (1 << TIMERWHEEL_BITS)
+
+typedef struct timerwheel_timer {
+    struct timerwheel_timer *next;
+    struct timerwheel_timer **pprev;    /* NULL when not scheduled */
+    unsigned long expires;              /* ms, same clock as timerwheel_advance() */
+    void (*cb)(void *arg);
+    void *arg;
+} timerwheel_timer;
+
+typedef struct timerwheel {
+    unsigned long next_tick;            /* first ms not processed yet */
+    unsigned int count;
+    timerwheel_timer *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+} timerwheel;
+
+void timerwheel_init(timerwheel *tw, unsigned long now_ms);
+
+void timerwheel_timer_init(timerwheel_timer *t, void (*cb)(void *arg), void *arg);
+
+/* (re)schedule t to fire at expires_ms, a time already past fires on the next advance */
+void timerwheel_add(timerwheel *tw, timerwheel_timer *t, unsigned long expires_ms);
+
+void timerwheel_del(timerwheel *tw, timerwheel_timer *t);
+
+int timerwheel_pending(timerwheel_timer *t);
+
+/* run the callbacks of every timer due at or before now_ms */
+void timerwheel_advance(timerwheel *tw, unsigned long now_ms);
+
+/* ms from now_ms to the next expiry, 0 if one is due, -1 if nothing is scheduled */
+long timerwheel_next(timerwheel *tw, unsigned long now_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // #ifndef _TIMERWHEEL_H_
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "socket_linux.h"
+
+/*
+ * serve several clients at once from a single loop: the listening socket is
+ * polled with the links, so accept never waits and one slow client does not
+ * hold the others. the clients are opened by the benchmark itself and ping
+ * the server in turn.
+ *
+ * usage: accept-bench [clients] [rounds] [port]
+ */
+
+#define MAX_CLIENTS 16
+#define PING        "ping"
+#define PING_LEN    4
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+    int clients = argc > 1 ? atoi(argv[1]) : 4;
+    int rounds = argc > 2 ? atoi(argv[2]) : 100;
+    int port = argc > 3 ? atoi(argv[3]) : 18883;
+
+    int client_fd[MAX_CLIENTS];
+    int client_left[MAX_CLIENTS];
+    int served_fd[MAX_CLIENTS];
+    int served = 0;
+
+    if (clients < 1 || clients > MAX_CLIENTS || rounds < 1) {
+        printf("clients must be 1 to %d, rounds at least 1\n", MAX_CLIENTS);
+        return -1;
+    }
+
+    if (socket_init(&socket_linux, "", "")) {
+        printf("socket init failed\n");
+        return -1;
+    }
+
+    int lfd = socket_listen(port, clients);
+    if (lfd < 0) {
+        printf("listen on %d failed %d\n", port, lfd);
+        return -1;
+    }
+
+    double start = now_ms();
+
+    // the connections complete in the backlog, nobody has accepted them yet
+    for (int i = 0; i < clients; i++) {
+        client_fd[i] = socket_connect("127.0.0.1", port);
+        if (client_fd[i] < 0) {
+            printf("connect %d failed %d\n", i, client_fd[i]);
+            return -1;
+        }
+        client_left[i] = rounds;
+        socket_send(client_fd[i], PING, PING_LEN);
+    }
+
+    double accepted_ms = 0;
+    int pending = clients;
+
+    while (pending) {
+        socket_pollfd fds[1 + 2 * MAX_CLIENTS];
+        unsigned int nfds = 0;
+
+        fds[nfds].fd = lfd;
+        fds[nfds++].events = SOCKET_POLLIN;
+        for (int i = 0; i < served; i++) {
+            fds[nfds].fd = served_fd[i];
+            fds[nfds++].events = SOCKET_POLLIN;
+        }
+        for (int i = 0; i < clients; i++) {
+            fds[nfds].fd = client_fd[i];
+            fds[nfds++].events = SOCKET_POLLIN;
+        }
+
+        int rc = socket_poll(fds, nfds, 1000);
+        if (rc <= 0) {
+            printf("poll %s, %d clients still pending\n", rc ? "failed" : "timed out", pending);
+            return -1;
+        }
+
+        for (unsigned int k = 0; k < nfds; k++) {
+            char buf[PING_LEN];
+
+            if (!(fds[k].revents & SOCKET_POLLIN)) {
+                continue;
+            }
+            if (k == 0) {
+                int fd = socket_accept(lfd, NULL, NULL);
+                if (fd >= 0 && served < MAX_CLIENTS) {
+                    served_fd[served++] = fd;
+                    if (served == clients) {
+                        accepted_ms = now_ms() - start;
+                    }
+                }
+            } else if (k <= (unsigned int)served) {
+                // echo what the client sent
+                rc = socket_recv(fds[k].fd, buf, sizeof(buf));
+                if (rc > 0) {
+                    socket_send(fds[k].fd, buf, rc);
+                }
+            } else {
+                int i = k - 1 - served;
+                rc = socket_recv(client_fd[i], buf, sizeof(buf));
+                if (rc > 0 && client_left[i] > 0 && --client_left[i] > 0) {
+                    socket_send(client_fd[i], PING, PING_LEN);
+                } else if (rc > 0) {
+                    pending--;
+                }
+            }
+        }
+    }
+
+    double elapsed = now_ms() - start;
+    printf("%d clients accepted in %.1f ms, %d round trips in %.1f ms, %.0f round trips/s\n",
+           clients, accepted_ms, clients * rounds, elapsed, clients * rounds * 1000.0 / elapsed);
+
+    for (int i = 0; i < clients; i++) {
+        socket_close(client_fd[i]);
+    }
+    for (int i = 0; i < served; i++) {
+        socket_close(served_fd[i]);
+    }
+    socket_close(lfd);
+    return 0;
+}
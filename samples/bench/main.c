@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "socket_linux.h"
+
+#include "MQTTClient.h"
+
+/*
+ * publish to a broker on the host through socket_linux, to measure what the
+ * MQTT layers cost without the UART in the way
+ *
+ * usage: mqtt-bench [host] [port] [count] [payload size] [qos] [async]
+ *
+ * with async, QoS 1 and 2 publishes use the in-flight window instead of
+ * waiting for each ack
+ */
+
+static int completed;
+
+static void on_complete(void *context, unsigned short id, int rc)
+{
+    (void)context;
+    (void)id;
+    if (rc == SUCCESS) {
+        completed++;
+    }
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+    char *host = argc > 1 ? argv[1] : "localhost";
+    int port = argc > 2 ? atoi(argv[2]) : 1883;
+    int count = argc > 3 ? atoi(argv[3]) : 10000;
+    int size = argc > 4 ? atoi(argv[4]) : 64;
+    int qos = argc > 5 ? atoi(argv[5]) : 0;
+    int async = argc > 6 && strcmp(argv[6], "async") == 0;
+
+    static unsigned char buf[4096];
+    static unsigned char readbuf[4096];
+    static char payload[3072];
+
+    if (size < 0 || size > (int)sizeof(payload) || qos < 0 || qos > 2) {
+        printf("payload size must be at most %d, qos 0 to 2\n", (int)sizeof(payload));
+        return -1;
+    }
+    memset(payload, 'x', size);
+
+    if (socket_init(&socket_linux, "", "")) {
+        printf("socket init failed\n");
+        return -1;
+    }
+
+    Network n;
+    MQTTClient c;
+
+    NetworkInit(&n);
+    if (NetworkConnect(&n, host, port) < 0) {
+        printf("connect to %s:%d failed\n", host, port);
+        return -1;
+    }
+
+    MQTTClientInit(&c, &n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = 4;
+    data.clientID.cstring = "mqtt-bench";
+    data.keepAliveInterval = 60;
+    data.cleansession = 1;
+
+    int rc = MQTTConnect(&c, &data);
+    if (rc < 0) {
+        printf("MQTTConnect failed %d\n", rc);
+        return -1;
+    }
+
+    MQTTMessage message = {
+        .qos = qos,
+        .payload = payload,
+        .payloadlen = size,
+    };
+
+    double start = now_ms();
+    int sent;
+    for (sent = 0; sent < count; sent++) {
+        if (async) {
+            rc = MQTTPublishAsync(&c, "bench", &message, on_complete, NULL);
+        } else {
+            rc = MQTTPublish(&c, "bench", &message);
+        }
+        if (rc < 0) {
+            printf("MQTTPublish failed %d after %d messages\n", rc, sent);
+            break;
+        }
+    }
+    while (rc >= 0 && MQTTInflightCount(&c) > 0) {
+        rc = MQTTYield(&c, 100);
+    }
+    double elapsed = now_ms() - start;
+
+    printf("%d messages of %d bytes, qos %d%s: %.1f ms, %.0f msg/s, %.2f MB/s\n",
+           sent, size, qos, async ? " async" : "", elapsed, sent * 1000.0 / elapsed,
+           (double)sent * size / 1000.0 / elapsed);
+    if (async) {
+        printf("%d acknowledged\n", completed);
+    }
+
+    MQTTDisconnect(&c);
+    NetworkDisconnect(&n);
+    return 0;
+}
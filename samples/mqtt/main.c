@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <signal.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -17,41 +19,45 @@ static const char *portname = "/dev/cu.SLAB_USBtoUART";
 
 static int serial_fd = -1;
 
-static int linux_putc(unsigned char ch, int timeout)
+static esp8266_t esp;
+
+static int linux_putc(void *priv, unsigned char ch, int timeout)
 {
+    int fd = *(int *)priv;
     fd_set wfds;
     FD_ZERO(&wfds);
-    FD_SET(serial_fd, &wfds);
+    FD_SET(fd, &wfds);
 
     struct timeval tv = {
         .tv_sec = timeout / 1000,
         .tv_usec = (timeout % 1000) * 1000,
     };
 
-    int count = select(serial_fd + 1, NULL, &wfds, NULL, &tv);
+    int count = select(fd + 1, NULL, &wfds, NULL, &tv);
     if (count > 0) {
-        return write(serial_fd, &ch, 1) == 1 ? 0 : -1;
+        return write(fd, &ch, 1) == 1 ? 0 : -1;
     } else {
         printf("putc, select failed\n");
         return -1;
     }
 }
 
-static int linux_getc(int timeout)
+static int linux_getc(void *priv, int timeout)
 {
+    int fd = *(int *)priv;
     fd_set rfds;
     FD_ZERO(&rfds);
-    FD_SET(serial_fd, &rfds);
+    FD_SET(fd, &rfds);
 
     struct timeval tv = {
         .tv_sec = timeout / 1000,
         .tv_usec = (timeout % 1000) * 1000,
     };
-    int count = select(serial_fd + 1, &rfds, NULL, NULL, &tv);
+    int count = select(fd + 1, &rfds, NULL, NULL, &tv);
     if (count > 0)
     {
         unsigned char ch;
-        return read(serial_fd, &ch, 1) == 1 ? ch : -1;
+        return read(fd, &ch, 1) == 1 ? ch : -1;
     }
     else
     {
@@ -73,7 +79,9 @@ static void init()
         exit(-1);
     }
 
-    esp8266_init(&ops);
+    esp8266_init(&esp, &ops, &serial_fd);
+    esp8266_set_clock(&esp, TimerNowMS);
+    socket_esp8266_attach(&esp);
 
     int rc = socket_init(&socket_esp8266, SSID, PASS);
     if (rc) {
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp8266.h"
+#include "check.h"
+
+/* a modem answering every command, with URCs queued by the test in between */
+static char input[1024];
+static int in_pos, in_len;
+static char line[128];
+static int line_len;
+
+static void modem_says(const char *s)
+{
+    int len = (int)strlen(s);
+
+    memcpy(input + in_len, s, len);
+    in_len += len;
+}
+
+static int getc_timeout(void *priv, int timeout_ms)
+{
+    (void)priv;
+    (void)timeout_ms;
+    if (in_pos == in_len) {
+        in_pos = in_len = 0;
+        return -1;
+    }
+    return (unsigned char)input[in_pos++];
+}
+
+static int putc_timeout(void *priv, unsigned char ch, int timeout_ms)
+{
+    int id;
+    char reply[32];
+
+    (void)priv;
+    (void)timeout_ms;
+    if (line_len < (int)sizeof(line) - 1) {
+        line[line_len++] = ch;
+    }
+    if (ch != '\n') {
+        return 0;
+    }
+    line[line_len] = '\0';
+    line_len = 0;
+    if (sscanf(line, "AT+CIPSTART=%d", &id) == 1) {
+        snprintf(reply, sizeof(reply), "%d,CONNECT\r\n\r\nOK\r\n", id);
+    } else if (sscanf(line, "AT+CIPCLOSE=%d", &id) == 1) {
+        snprintf(reply, sizeof(reply), "%d,CLOSED\r\n\r\nOK\r\n", id);
+    } else {
+        strcpy(reply, "\r\nOK\r\n");
+    }
+    modem_says(reply);
+    return 0;
+}
+
+static atcmd_ops ops = {
+    .getc_timeout = getc_timeout,
+    .putc_timeout = putc_timeout,
+};
+
+static esp8266_t esp;
+
+/* handle every URC the modem sent, as a poll of the server does */
+static void settle(void)
+{
+    socket_pollfd pfd = { .fd = ESP8266_SERVER_FD, .events = SOCKET_POLLIN };
+
+    esp8266_poll(&esp, &pfd, 1, 0);
+}
+
+static int accept_after_poll(void)
+{
+    settle();
+    return esp8266_accept(&esp, ESP8266_SERVER_FD, NULL, NULL);
+}
+
+int main(void)
+{
+    char buf[8];
+
+    esp8266_init(&esp, &ops, NULL);
+    CHECK(esp8266_listen(&esp, 80, 0) == ESP8266_SERVER_FD);
+
+    // a client gone before accept leaves nothing, its ID is taken by the next one
+    modem_says("0,CONNECT\r\n0,CLOSED\r\n0,CONNECT\r\n");
+    CHECK(accept_after_poll() == 0);
+    CHECK(accept_after_poll() == NSAPI_ERROR_WOULD_BLOCK);
+
+    // clients coming and going on one ID never fill the queue
+    for (int i = 0; i < 3 * ESP8266_SOCKET_COUNT; i++) {
+        modem_says("1,CONNECT\r\n1,CLOSED\r\n");
+    }
+    modem_says("1,CONNECT\r\n2,CONNECT\r\n2,CLOSED\r\n2,CONNECT\r\n");
+    CHECK(accept_after_poll() == 1);
+    CHECK(accept_after_poll() == 2);
+    CHECK(accept_after_poll() == NSAPI_ERROR_WOULD_BLOCK);
+
+    // a client that left data is handed out, and its ID is not reused meanwhile
+    modem_says("3,CONNECT\r\n+IPD,3,3:abc\r\n3,CLOSED\r\n");
+    settle();
+    CHECK(esp8266_open_tcp(&esp, "10.0.0.1", 1883, 0) == 4);
+    CHECK(accept_after_poll() == 3);
+    CHECK(esp8266_recv_tcp(&esp, 3, buf, sizeof(buf)) == 3 && memcmp(buf, "abc", 3) == 0);
+    CHECK(esp8266_recv_tcp(&esp, 3, buf, sizeof(buf)) == 0);
+
+    // a new client cannot take the ID while the accepted one holds it
+    modem_says("3,CONNECT\r\n");
+    CHECK(accept_after_poll() == NSAPI_ERROR_WOULD_BLOCK);
+    CHECK(esp8266_close(&esp, 3) == 0);
+    CHECK(esp8266_close(&esp, 4) == 0);
+    CHECK(esp.id_flags == 0x7);
+
+    // closing the server closes the clients never accepted
+    modem_says("3,CONNECT\r\n");
+    CHECK(esp8266_close(&esp, ESP8266_SERVER_FD) == 0);
+    CHECK(esp.server.count == 0 && esp.server.queued == 0);
+    CHECK(esp.id_flags == 0x7);
+
+    return CHECK_DONE();
+}
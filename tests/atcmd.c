@@ -0,0 +1,74 @@
+#include <string.h>
+#include "atcmd.h"
+#include "check.h"
+
+static const char *input;
+
+static int getc_timeout(void *priv, int timeout_ms)
+{
+    (void)priv;
+    (void)timeout_ms;
+    return *input ? (unsigned char)*input++ : -1;
+}
+
+static int putc_timeout(void *priv, unsigned char ch, int timeout_ms)
+{
+    (void)priv;
+    (void)ch;
+    (void)timeout_ms;
+    return 0;
+}
+
+static atcmd_ops ops = {
+    .getc_timeout = getc_timeout,
+    .putc_timeout = putc_timeout,
+};
+
+static int ids[8];
+static int nids;
+
+static void closed(void *arg, int id)
+{
+    (void)arg;
+    if (nids < 8) {
+        ids[nids] = id;
+    }
+    nids++;
+}
+
+/* feed lines to the parser until the OK, return how many ids it handed out */
+static int feed(atcmd *at, const char *lines)
+{
+    input = lines;
+    nids = 0;
+    CHECK(atcmd_recv(at, "OK\n"));
+    return nids;
+}
+
+int main(void)
+{
+    atcmd at;
+    char buf[128];
+
+    atcmd_init(&at, &ops, NULL, buf, sizeof(buf));
+    atcmd_add_id_handler(&at, "%d,CLOSED", closed, NULL);
+
+    CHECK(feed(&at, "0,CLOSED\r\nOK\r\n") == 1 && ids[0] == 0);
+    CHECK(feed(&at, "4,CLOSED\r\n12,CLOSED\r\nOK\r\n") == 2 && ids[0] == 4 && ids[1] == 12);
+    CHECK(feed(&at, "9999,CLOSED\r\nOK\r\n") == 1 && ids[0] == 9999);
+
+    // not a number, or one too long to be an id
+    CHECK(feed(&at, ",CLOSED\r\nOK\r\n") == 0);
+    CHECK(feed(&at, "x1,CLOSED\r\nOK\r\n") == 0);
+    CHECK(feed(&at, "-1,CLOSED\r\nOK\r\n") == 0);
+    CHECK(feed(&at, "1 ,CLOSED\r\nOK\r\n") == 0);
+    CHECK(feed(&at, "10000,CLOSED\r\nOK\r\n") == 0);
+    CHECK(feed(&at, "99999999999,CLOSED\r\nOK\r\n") == 0);
+
+    // the suffix must follow the digits as a whole
+    CHECK(feed(&at, "1,CLOSE\r\nOK\r\n") == 0);
+    CHECK(feed(&at, "1,closed\r\nOK\r\n") == 0);
+    CHECK(feed(&at, "1,,CLOSED\r\nOK\r\n") == 0);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,78 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "socket_linux.h"
+#include "MQTTClient.h"
+#include "check.h"
+
+#define MIN_MS      40
+#define MAX_MS      160
+#define CONNACK_MS  20      /* an attempt waits this long for the CONNACK that never comes */
+#define SLACK_MS    30
+#define ATTEMPTS    6
+
+/* a server that takes the connections and never answers */
+static int listener(int* port)
+{
+    struct sockaddr_in sa = { .sin_family = AF_INET };
+    socklen_t len = sizeof(sa);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(fd, 8) != 0 ||
+        getsockname(fd, (struct sockaddr*)&sa, &len) != 0)
+        return -1;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+int main(void)
+{
+    static MQTTClient c;
+    static unsigned char buf[128], readbuf[128];
+    Network n;
+    unsigned long at[ATTEMPTS];
+    unsigned long start;
+    unsigned int delay = MIN_MS;
+    int attempts = 0;
+    int port = 0;
+    int lfd = listener(&port);
+
+    CHECK(lfd >= 0);
+    socket_init(&socket_linux, "", "");
+    NetworkInit(&n);
+    MQTTClientInit(&c, &n, CONNACK_MS, buf, sizeof(buf), readbuf, sizeof(readbuf));
+    MQTTSetReconnect(&c, "127.0.0.1", port, NULL, MIN_MS, MAX_MS, NULL, NULL);
+
+    // an attempt is seen once it gave up on the CONNACK and yield returned
+    start = TimerNowMS();
+    while (attempts < ATTEMPTS && TimerNowMS() - start < 5000)
+    {
+        int fd;
+
+        MQTTYield(&c, 5);
+        while ((fd = accept(lfd, NULL, NULL)) >= 0)
+        {
+            if (attempts < ATTEMPTS)
+                at[attempts++] = TimerNowMS();
+            close(fd);
+        }
+    }
+    CHECK(attempts == ATTEMPTS);
+
+    // the delay starts at MIN_MS and doubles up to MAX_MS, a wait is between half of it and all of it
+    for (int i = 0; i < attempts; i++)
+    {
+        unsigned long gap = at[i] - (i ? at[i - 1] : start);
+
+        CHECK(gap >= delay / 2);
+        CHECK(gap <= delay + CONNACK_MS + SLACK_MS);
+        delay = (delay * 2 > MAX_MS) ? MAX_MS : delay * 2;
+    }
+
+    close(lfd);
+    return CHECK_DONE();
+}
@@ -0,0 +1,18 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+
+/* a failed check is reported and counted, the test goes on */
+static int check_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            check_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_DONE() (check_failures ? 1 : 0)
+
+#endif
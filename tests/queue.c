@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include "MQTTQueue.h"
+#include "check.h"
+
+static unsigned char ring[600];
+
+static int push(MQTTQueue* queue, unsigned int seq)
+{
+    char topic[16];
+    unsigned char payload[100];
+    size_t len = (seq * 37) % sizeof(payload);
+
+    snprintf(topic, sizeof(topic), "t/%u", seq);
+    memset(payload, seq & 0xff, len);
+    return MQTTQueuePush(queue, topic, 1, 0, payload, len);
+}
+
+/* the sequence number of the entry, checking its payload */
+static unsigned int entrySeq(MQTTQueueEntry* e)
+{
+    unsigned int seq = 0;
+    unsigned char* payload = MQTTQueuePayload(e);
+
+    CHECK(sscanf(MQTTQueueTopic(e), "t/%u", &seq) == 1);
+    CHECK(e->payloadlen == (seq * 37) % 100);
+    for (unsigned int i = 0; i < e->payloadlen; i++)
+        CHECK(payload[i] == (seq & 0xff));
+    return seq;
+}
+
+int main(void)
+{
+    MQTTQueue queue;
+    MQTTQueueEntry* e;
+    unsigned int seq, last = 0, taken = 0;
+    unsigned short id = 0;
+
+    // the ring wraps many times, the oldest messages not sent make room
+    CHECK(MQTTQueueInit(&queue, ring, sizeof(ring)) == 0);
+    MQTTQueueSetLimits(&queue, 0, 0, MQTTQUEUE_DROP_OLDEST);
+    for (seq = 1; seq <= 5000; seq++)
+    {
+        CHECK(push(&queue, seq) == 0);
+        if (seq % 3 == 0 && (e = MQTTQueueNext(&queue)) != NULL)
+        {
+            unsigned int n = entrySeq(e);
+
+            CHECK(n > last && n <= seq);
+            last = n;
+            taken++;
+            MQTTQueueSent(&queue, e, ++id);
+            MQTTQueueAcked(&queue, id);
+        }
+    }
+    CHECK(taken > 1000);
+
+    // what is left is the newest messages, in order
+    int count = MQTTQueueCount(&queue);
+    CHECK(count > 0);
+    while ((e = MQTTQueueNext(&queue)) != NULL)
+    {
+        unsigned int n = entrySeq(e);
+
+        CHECK(n > last);
+        last = n;
+        MQTTQueueSent(&queue, e, ++id);
+        MQTTQueueAcked(&queue, id);
+        count--;
+    }
+    CHECK(last == 5000);
+    CHECK(count == 0);
+    CHECK(MQTTQueueCount(&queue) == 0);
+
+    // a message waiting for its ack is never dropped and blocks the space behind it,
+    // the push fails instead
+    CHECK(MQTTQueueInit(&queue, ring, sizeof(ring)) == 0);
+    MQTTQueueSetLimits(&queue, 0, 0, MQTTQUEUE_DROP_OLDEST);
+    CHECK(push(&queue, 99) == 0);
+    MQTTQueueSent(&queue, MQTTQueueNext(&queue), 7);
+    for (seq = 1; seq < 50 && push(&queue, seq) == 0; seq++)
+        ;
+    CHECK(seq < 50);
+    e = MQTTQueueNext(&queue);
+    CHECK(e != NULL && entrySeq(e) == 1);
+    MQTTQueueAcked(&queue, 7);
+    CHECK(push(&queue, seq) == 0);
+
+    // a count limit drops the oldest first
+    CHECK(MQTTQueueInit(&queue, ring, sizeof(ring)) == 0);
+    MQTTQueueSetLimits(&queue, 0, 3, MQTTQUEUE_DROP_OLDEST);
+    for (seq = 1; seq <= 5; seq++)
+        CHECK(push(&queue, seq) == 0);
+    CHECK(MQTTQueueCount(&queue) == 3);
+    CHECK((e = MQTTQueueNext(&queue)) != NULL && entrySeq(e) == 3);
+    MQTTQueueSetLimits(&queue, 0, 3, MQTTQUEUE_DROP_NEWEST);
+    CHECK(push(&queue, 6) == -1);
+    CHECK((e = MQTTQueueNext(&queue)) != NULL && entrySeq(e) == 3);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,222 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "socket_linux.h"
+#include "MQTTClient.h"
+#include "check.h"
+
+/*
+ * publishers on several threads share one client, whose receive thread reads the acks
+ * and the messages the broker echoes back. The broker runs in-process on loopback.
+ */
+#define PUBLISHERS  4
+#define MESSAGES    500     /* per publisher */
+
+static MQTTClient client;
+static int echoed;
+static int received[PUBLISHERS];        /* by the broker, next sequence number expected */
+static int duplicates;
+
+static int readAll(int fd, unsigned char* buf, int len)
+{
+    int got = 0;
+
+    while (got < len)
+    {
+        int rc = (int)recv(fd, buf + got, len - got, 0);
+        if (rc <= 0)
+            return -1;
+        got += rc;
+    }
+    return got;
+}
+
+/* a whole packet into buf, its length or -1 */
+static int readPacket(int fd, unsigned char* buf, int size)
+{
+    int rem = 0, mult = 1, len = 1;
+
+    if (readAll(fd, buf, 1) != 1)
+        return -1;
+    do
+    {
+        if (len > 4 || readAll(fd, buf + len, 1) != 1)
+            return -1;
+        rem += (buf[len] & 127) * mult;
+        mult *= 128;
+    }
+    while (buf[len++] & 128);
+    if (len + rem > size || readAll(fd, buf + len, rem) != rem)
+        return -1;
+    return len + rem;
+}
+
+static int sendAll(int fd, unsigned char* buf, int len)
+{
+    return (len > 0 && send(fd, buf, len, MSG_NOSIGNAL) == len) ? 0 : -1;
+}
+
+/* acks every packet of one client, echoes its publishes once it subscribed */
+static void* broker(void* arg)
+{
+    int lfd = *(int*)arg;
+    int fd = accept(lfd, NULL, NULL);
+    int subscribed = 0;
+    unsigned char in[512], out[512];
+    int len;
+
+    while (fd >= 0 && (len = readPacket(fd, in, sizeof(in))) > 0)
+    {
+        MQTTHeader header = {0};
+        int rc = 0;
+
+        header.byte = in[0];
+        if (header.bits.type == CONNECT)
+            rc = sendAll(fd, out, MQTTSerialize_connack(out, sizeof(out), 0, 0));
+        else if (header.bits.type == SUBSCRIBE)
+        {
+            unsigned char dup;
+            unsigned short id;
+            int count, qos[1];
+            MQTTString filter[1];
+
+            MQTTDeserialize_subscribe(&dup, &id, 1, &count, filter, qos, in, len);
+            subscribed = 1;
+            rc = sendAll(fd, out, MQTTSerialize_suback(out, sizeof(out), id, 1, qos));
+        }
+        else if (header.bits.type == PUBLISH)
+        {
+            unsigned char dup, retained;
+            unsigned short id;
+            int qos, payloadlen, publisher, seq;
+            MQTTString topic;
+            unsigned char* payload;
+            char text[32];
+
+            MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topic, &payload, &payloadlen, in, len);
+            snprintf(text, sizeof(text), "%.*s", payloadlen, (char*)payload);
+            if (sscanf(text, "%d/%d", &publisher, &seq) == 2 && publisher >= 0 && publisher < PUBLISHERS)
+            {
+                if (seq == received[publisher])
+                    received[publisher]++;
+                else
+                    duplicates++;
+            }
+            if (qos > 0)
+                rc = sendAll(fd, out, MQTTSerialize_ack(out, sizeof(out), (qos == 1) ? PUBACK : PUBREC, 0, id));
+            if (rc == 0 && subscribed)
+                rc = sendAll(fd, out, MQTTSerialize_publish(out, sizeof(out), 0, 0, 0, 0, topic, payload, payloadlen));
+        }
+        else if (header.bits.type == PUBREL)
+        {
+            unsigned char type, dup;
+            unsigned short id;
+
+            MQTTDeserialize_ack(&type, &dup, &id, in, len);
+            rc = sendAll(fd, out, MQTTSerialize_ack(out, sizeof(out), PUBCOMP, 0, id));
+        }
+        else if (header.bits.type == PINGREQ)
+        {
+            out[0] = PINGRESP << 4;
+            out[1] = 0;
+            rc = sendAll(fd, out, 2);
+        }
+        else if (header.bits.type == DISCONNECT)
+            break;
+        if (rc != 0)
+            break;
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static void onEcho(MessageData* md)
+{
+    (void)md;
+    echoed++;   /* on the receive thread only */
+}
+
+static void* publisher(void* arg)
+{
+    long n = (long)arg;
+    long failures = 0;
+    char payload[32];
+
+    for (int i = 0; i < MESSAGES; i++)
+    {
+        MQTTMessage message = {0};
+
+        message.qos = (i % 2) ? QOS2 : QOS1;
+        message.payload = payload;
+        message.payloadlen = snprintf(payload, sizeof(payload), "%ld/%d", n, i);
+        if (MQTTPublish(&client, "stress/x", &message) != SUCCESS)
+            failures++;
+    }
+    return (void*)failures;
+}
+
+int main(void)
+{
+    static unsigned char buf[256], readbuf[256];
+    struct sockaddr_in sa = { .sin_family = AF_INET };
+    socklen_t salen = sizeof(sa);
+    MQTTPacket_connectData options = MQTTPacket_connectData_initializer;
+    pthread_t server, threads[PUBLISHERS];
+    long failures = 0;
+    Network n;
+    int lfd;
+
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(lfd, 1) != 0 ||
+        getsockname(lfd, (struct sockaddr*)&sa, &salen) != 0)
+    {
+        perror("listen");
+        return 1;
+    }
+    pthread_create(&server, NULL, broker, &lfd);
+
+    socket_init(&socket_linux, "", "");
+    NetworkInit(&n);
+    MQTTClientInit(&client, &n, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+    CHECK(MQTTStartTask(&client) == SUCCESS);
+    CHECK(NetworkConnect(&n, "127.0.0.1", ntohs(sa.sin_port)) == 0);
+    options.clientID.cstring = "stress";
+    options.keepAliveInterval = 1;     /* pings go out among the publishes */
+    CHECK(MQTTConnect(&client, &options) == SUCCESS);
+    CHECK(MQTTSubscribe(&client, "stress/#", QOS0, onEcho) == SUCCESS);
+
+    for (long i = 0; i < PUBLISHERS; i++)
+        pthread_create(&threads[i], NULL, publisher, (void*)i);
+    for (int i = 0; i < PUBLISHERS; i++)
+    {
+        void* rc;
+
+        pthread_join(threads[i], &rc);
+        failures += (long)rc;
+    }
+    CHECK(failures == 0);
+    CHECK(MQTTIsConnected(&client));
+
+    // each message reached the broker once and in the order of its publisher
+    for (int i = 0; i < PUBLISHERS; i++)
+        CHECK(received[i] == MESSAGES);
+    CHECK(duplicates == 0);
+
+    // the echoes follow the acks on the same connection
+    TimerSleepMS(200);
+    MutexLock(&client.mutex);
+    CHECK(echoed == PUBLISHERS * MESSAGES);
+    MutexUnlock(&client.mutex);
+
+    MQTTDisconnect(&client);
+    pthread_join(server, NULL);
+    NetworkDisconnect(&n);
+    close(lfd);
+    return CHECK_DONE();
+}
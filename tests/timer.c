@@ -0,0 +1,39 @@
+#include "mqtt-nonos.h"
+#include "check.h"
+
+int main(void)
+{
+    Timer timer;
+    unsigned long start;
+    unsigned long before;
+    int left;
+
+    TimerInit(&timer);
+    CHECK(TimerIsExpired(&timer));
+    CHECK(TimerLeftMS(&timer) == 0);
+
+    // nothing else reads the clock in between, TimerLeftMS must do it
+    TimerCountdownMS(&timer, 300);
+    start = TimerNowMS();
+    TimerSleepMS(100);
+    before = TimerNowMS();
+    left = TimerLeftMS(&timer);
+    CHECK(left <= 300 - (int)(before - start));
+    CHECK(left >= 100);
+    CHECK(!TimerIsExpired(&timer));
+
+    TimerSleepMS(left + 10);
+    CHECK(TimerLeftMS(&timer) == 0);
+    CHECK(TimerIsExpired(&timer));
+
+    // past the deadline it stays 0, never negative
+    TimerCountdownMS(&timer, 0);
+    TimerSleepMS(20);
+    CHECK(TimerLeftMS(&timer) == 0);
+
+    TimerCountdown(&timer, 2);
+    left = TimerLeftMS(&timer);
+    CHECK(left > 1900 && left <= 2000);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,101 @@
+#include <limits.h>
+#include "timerwheel.h"
+#include "check.h"
+
+#define COUNT 1000
+
+static timerwheel wheel;
+static timerwheel_timer timers[COUNT];
+static unsigned long now;
+static unsigned long last;     /* expiry of the timer fired last */
+static int fired;
+static unsigned long seed = 1;
+
+static unsigned long next_random(void)
+{
+    seed = seed * 1103515245UL + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+static void expire(void *arg)
+{
+    timerwheel_timer *t = arg;
+
+    // at the first advance past its expiry, and in expiry order
+    CHECK((long)(now - t->expires) >= 0);
+    CHECK((long)(t->expires - last) >= 0);
+    CHECK(!timerwheel_pending(t));
+    last = t->expires;
+    fired++;
+}
+
+/* schedule timers on every level and beyond, advance in uneven steps */
+static void run(unsigned long start)
+{
+    now = last = start;
+    fired = 0;
+    timerwheel_init(&wheel, now);
+
+    for (int i = 0; i < COUNT; i++) {
+        unsigned long delay = next_random();
+        if (i % 4 == 1) {
+            delay *= 64;
+        } else if (i % 4 == 2) {
+            delay *= 4096;       // past the last level
+        } else if (i % 4 == 3) {
+            delay %= 64;
+        }
+        timerwheel_timer_init(&timers[i], expire, &timers[i]);
+        timerwheel_add(&wheel, &timers[i], now + delay);
+    }
+
+    // every other timer of the first 100 is cancelled or moved
+    for (int i = 0; i < 100; i += 2) {
+        if (i % 4) {
+            timerwheel_del(&wheel, &timers[i]);
+        } else {
+            timerwheel_add(&wheel, &timers[i], now + next_random());
+        }
+    }
+    int cancelled = 25;
+
+    while (wheel.count) {
+        long next = timerwheel_next(&wheel, now);
+        CHECK(next >= 0);
+        int before = fired;
+
+        // a step short of the next expiry fires nothing
+        if (next > 1) {
+            now += next - 1;
+            timerwheel_advance(&wheel, now);
+            CHECK(fired == before);
+            now++;
+        } else {
+            now += next + next_random() % 3000;
+        }
+        timerwheel_advance(&wheel, now);
+        CHECK(fired > before);
+    }
+    CHECK(fired == COUNT - cancelled);
+    CHECK(timerwheel_next(&wheel, now) == -1);
+}
+
+int main(void)
+{
+    run(1000);
+    // the clock wraps while timers are scheduled
+    run(ULONG_MAX - 100000);
+
+    // a time already past fires on the next advance
+    now = last = 5000;
+    fired = 0;
+    timerwheel_init(&wheel, now);
+    timerwheel_timer_init(&timers[0], expire, &timers[0]);
+    timerwheel_add(&wheel, &timers[0], 4000);
+    CHECK(timerwheel_next(&wheel, now) == 0);
+    last = 4000;
+    timerwheel_advance(&wheel, now);
+    CHECK(fired == 1);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include "MQTTClient.h"
+#include "check.h"
+
+static const char* filters[] = {
+    "a/b/c", "a/+/c", "a/#", "#", "+", "+/+", "a/b/+", "+/b/#",
+    "$SYS/#", "$SYS/+/load", "/a", "a/b/c/#",
+};  /* within MAX_TOPIC_NODES of the default client */
+#define FILTERS (int)(sizeof(filters) / sizeof(filters[0]))
+
+static unsigned long matched;   /* a bit per filter */
+
+static void onMatch(void* context, short value)
+{
+    (void)context;
+    matched |= 1UL << value;
+}
+
+static unsigned long match(MQTTTopicTrie* trie, const char* topic)
+{
+    matched = 0;
+    MQTTTopicTrieMatch(trie, topic, (int)strlen(topic), onMatch, NULL);
+    return matched;
+}
+
+/* the filters matching topic, by the rules of the MQTT spec, level by level */
+static int matches(const char* f, const char* t)
+{
+    if (t[0] == '$' && (f[0] == '+' || f[0] == '#'))
+        return 0;   /* wildcards do not match a leading $ level */
+    while (1)
+    {
+        const char* fe = strchr(f, '/') ? strchr(f, '/') : f + strlen(f);
+        const char* te = strchr(t, '/') ? strchr(t, '/') : t + strlen(t);
+
+        if (fe - f == 1 && *f == '#')
+            return 1;
+        if (!(fe - f == 1 && *f == '+') && (fe - f != te - t || strncmp(f, t, fe - f) != 0))
+            return 0;
+        if (*te == '\0')
+            return *fe == '\0' || strcmp(fe, "/#") == 0;   /* # also matches the parent level */
+        if (*fe == '\0')
+            return 0;
+        f = fe + 1;
+        t = te + 1;
+    }
+}
+
+static unsigned long expected(const char* topic, int live[])
+{
+    unsigned long bits = 0;
+
+    for (int i = 0; i < FILTERS; i++)
+    {
+        if (live[i] && matches(filters[i], topic))
+            bits |= 1UL << i;
+    }
+    return bits;
+}
+
+static const char* topics[] = {
+    "a", "a/b", "a/b/c", "a/x/c", "a/b/c/d", "b", "x/b", "x/b/y", "a//c", "/a", "/",
+    "$SYS", "$SYS/cpu/load", "$SYS/x", "$other/b", "a/$x", "", "a/b/",
+};
+#define TOPICS (int)(sizeof(topics) / sizeof(topics[0]))
+
+int main(void)
+{
+    static MQTTTopicTrie trie;
+    int live[FILTERS];
+    short* value;
+
+    MQTTTopicTrieInit(&trie);
+    for (int i = 0; i < FILTERS; i++)
+    {
+        CHECK((value = MQTTTopicTrieValue(&trie, filters[i], 1)) != NULL);
+        if (value != NULL)
+            *value = (short)i;
+        live[i] = 1;
+    }
+
+    // a few by hand, then every topic against the spec
+    CHECK(match(&trie, "a/b/c") == ((1UL << 0) | (1UL << 1) | (1UL << 2) | (1UL << 3) | (1UL << 6) |
+        (1UL << 7) | (1UL << 11)));
+    CHECK(match(&trie, "$SYS/cpu/load") == ((1UL << 8) | (1UL << 9)));
+    CHECK(match(&trie, "$other/b") == 0);
+    CHECK(match(&trie, "a") == ((1UL << 2) | (1UL << 3) | (1UL << 4)));
+    for (int i = 0; i < TOPICS; i++)
+        CHECK(match(&trie, topics[i]) == expected(topics[i], live));
+
+    // removed filters no longer match, the others still do
+    for (int i = 0; i < FILTERS; i += 3)
+    {
+        *MQTTTopicTrieValue(&trie, filters[i], 0) = -1;
+        MQTTTopicTriePrune(&trie, filters[i]);
+        live[i] = 0;
+        CHECK(MQTTTopicTrieValue(&trie, filters[i], 0) == NULL || *MQTTTopicTrieValue(&trie, filters[i], 0) == -1);
+    }
+    for (int i = 0; i < TOPICS; i++)
+        CHECK(match(&trie, topics[i]) == expected(topics[i], live));
+
+    // and added again in the nodes freed by the pruning
+    for (int i = 0; i < FILTERS; i += 3)
+    {
+        CHECK((value = MQTTTopicTrieValue(&trie, filters[i], 1)) != NULL);
+        if (value != NULL)
+            *value = (short)i;
+        live[i] = 1;
+    }
+    for (int i = 0; i < TOPICS; i++)
+        CHECK(match(&trie, topics[i]) == expected(topics[i], live));
+
+    return CHECK_DONE();
+}